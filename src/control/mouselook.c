@@ -54,6 +54,8 @@ void mouselook_set(int enabled) {
   enabled = !!enabled;
   /* If already in this state, nothing to do */
   if (is_enabled == enabled) return;
+  /* Nothing to grab if there is no window (ie, running headless) */
+  if (!window) return;
 
   is_enabled = enabled;
   if (enabled) {
@@ -72,6 +72,8 @@ int mouselook_get(void);
  *
  * If mouselook is enabled, it is the controller's responsibility to pass every
  * SDL_MouseMotionEvent that occurs to mouselook_update().
+ *
+ * Has no effect if mouselook_init() has not been called.
  */
 void mouselook_set(int);
 
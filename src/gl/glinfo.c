@@ -39,6 +39,8 @@
 
 unsigned max_point_size;
 int can_draw_offscreen_points;
+int has_persistent_buffers;
+int has_instanced_arrays;
 
 void glinfo_detect(unsigned wh) {
   shader_solid_vertex vertex;
@@ -81,6 +83,12 @@ void glinfo_detect(unsigned wh) {
 
   glPopAttrib();
 
+  has_persistent_buffers =
+    (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) &&
+    (GLEW_VERSION_3_2 || (GLEW_ARB_sync &&
+                          GLEW_ARB_draw_elements_base_vertex));
+  has_instanced_arrays = GLEW_VERSION_3_3;
+
   max_vertex_texture_image_units = -1;
   glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &max_vertex_texture_image_units);
 
@@ -90,6 +98,9 @@ void glinfo_detect(unsigned wh) {
   printf("GL info: max point size = %d; off screen point support = %s\n",
          max_point_size, can_draw_offscreen_points? "yes" : "no");
   printf("Max vertex texture image units: %d\n", max_vertex_texture_image_units);
+  printf("Persistently-mapped buffers: %s\n",
+         has_persistent_buffers? "yes" : "no");
+  printf("Instanced arrays: %s\n", has_instanced_arrays? "yes" : "no");
   if (max_vertex_texture_image_units < 1)
     errx(EX_OSERR,
          "Your graphics card's OpenGL implementation does not support "
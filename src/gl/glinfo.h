@@ -54,6 +54,22 @@ extern unsigned max_point_size;
  */
 extern int can_draw_offscreen_points;
 
+/**
+ * If true, the OpenGL implementation supports immutable buffer storage which
+ * can stay mapped while in use by the GL (ARB_buffer_storage), along with
+ * fence objects (ARB_sync) and base-vertex draws
+ * (ARB_draw_elements_base_vertex). The GL marshaller uses these to let
+ * threads write geometry straight into a buffer the GL draws from.
+ */
+extern int has_persistent_buffers;
+
+/**
+ * If true, the OpenGL implementation supports instanced drawing with
+ * per-instance vertex attributes (glDrawArraysInstanced() and
+ * glVertexAttribDivisor(), both core in OpenGL 3.3).
+ */
+extern int has_instanced_arrays;
+
 /**
  * Detects the values to use for the variables declared in this file. This
  * clobbers the write colour buffer, and involves vid-sys blits. This must be
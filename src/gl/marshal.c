@@ -29,27 +29,65 @@
 #include <config.h>
 #endif
 
+#include <stdio.h>
+
 #include <SDL.h>
 #include <glew.h>
 #include "../bsd.h"
 
 #include "../alloc.h"
+#include "../defs.h"
+#include "../trace.h"
+#include "glinfo.h"
 #include "marshal.h"
 
+/**
+ * The size, in bytes, of the persistently-mapped streaming ring. Must be a
+ * power of two.
+ */
+#define RING_SIZE (32*1024*1024)
+/**
+ * The maximum number of frames whose ring contents may be in use by the GL
+ * at once. If glm_done() is executed while this many are outstanding, the GL
+ * thread blocks until the oldest has been completed.
+ */
+#define MAX_FRAMES_IN_FLIGHT 4
+/**
+ * The number of entries in the command queue. Must be a power of two.
+ * glm_do() blocks while the queue is full.
+ */
+#define QUEUE_SIZE 4096
+
+/**
+ * Unused slab memory, kept on a per-group free list so that threads flushing
+ * slabs don't need to go through the allocator each time.
+ */
+struct glm_free_buffer {
+  SLIST_ENTRY(glm_free_buffer) next;
+};
+
 struct glm_slab_group_s {
   void (*activate)(void*);
   void (*deactivate)(void*);
   void* userdata;
   void (*configure)(void);
-  unsigned data_size;
+  unsigned data_size, vertex_size;
   GLenum primitive;
   int indices_enabled;
   SDL_TLSID slab;
   SLIST_ENTRY(glm_slab_group_s) next;
+  /* The major sort keys for flushed slabs; see glm_slab_group_set_order().
+   * ordinal is the creation order of the group, to break ties.
+   */
+  unsigned order, ordinal;
+
+  SDL_SpinLock free_buffers_lock;
+  SLIST_HEAD(, glm_free_buffer) free_buffers;
 };
 
 static SLIST_HEAD(, glm_slab_group_s) slab_groups =
   SLIST_HEAD_INITIALIZER(slab_groups);
+static unsigned next_slab_group_ordinal;
 
 struct glm_slab_s {
   glm_slab_group* group;
@@ -58,21 +96,100 @@ struct glm_slab_s {
 
   unsigned data_off, data_max;
   unsigned short index_off, vertex_off;
+
+  /* Only meaningful for flushed slabs. If in_ring is true, the contents have
+   * been copied into the streaming ring, with the indices at byte offset
+   * ring_indices and the first vertex at vertex ring_base_vertex, and
+   * indices/data do not point to memory owned by this slab. ring_end is the
+   * value of ring_head immediately after the slab's reservation.
+   */
+  int in_ring;
+  unsigned ring_indices, ring_base_vertex, ring_end;
+
+  /* The minor sort key (see glm_slab_set_key()), and the number of times
+   * this slab had been flushed at the time this copy was made.
+   */
+  unsigned key, sequence;
+  /* Position in pending_slabs on the GL thread; the final tie-breaker */
+  unsigned arrival;
 };
 
+/* Flushed slabs received by the GL thread are not drawn immediately, but
+ * collected here until the next command which is not a slab (which includes
+ * the glm_done() at the end of every frame). They are then sorted by group
+ * order, group ordinal, key, and sequence, and drawn in that order, so that
+ * the result does not depend on which thread happened to flush first, and so
+ * that each group needs to be activated and configured only once.
+ */
+static glm_slab** pending_slabs;
+static unsigned num_pending_slabs, pending_slabs_cap;
+/* FNV-1a over every slab drawn; see glm_slab_sequence_hash() */
+static unsigned long long slab_sequence_hash = 0xCBF29CE484222325ULL;
+/* Set by compare_pending_slabs() if two slabs could only be ordered by
+ * arrival, which only happens if different threads drew into the same group
+ * under the same key.
+ */
+static int slab_order_is_ambiguous, slab_order_warned;
+
+/* The command queue is a bounded lock-free multi-producer, single-consumer
+ * ring of preallocated entries.
+ *
+ * A producer claims position p by CASing queue_tail from p to p+1, which is
+ * only permitted if the sequence of entry p%QUEUE_SIZE equals p (ie, the
+ * consumer is done with whatever was there before). It then fills the entry
+ * in and publishes it by setting its sequence to p+1. The consumer (the GL
+ * thread) owns queue_head; the entry there is ready when its sequence is
+ * queue_head+1, and is released back to producers by setting its sequence to
+ * queue_head+QUEUE_SIZE.
+ *
+ * When the queue runs dry, the consumer sets consumer_parked and sleeps on
+ * queue_wakeup. A producer which publishes an entry and finds consumer_parked
+ * set clears it and posts the semaphore, so the semaphore is only touched
+ * when the GL thread actually needs waking.
+ */
 struct glm_queued_item {
+  SDL_atomic_t sequence;
   void (*exec)(void*);
   void* userdata;
-
-  STAILQ_ENTRY(glm_queued_item) next;
 };
 
-static SDL_sem* queue_size;
-static SDL_SpinLock queue_lock;
-static STAILQ_HEAD(, glm_queued_item) queue =
-  STAILQ_HEAD_INITIALIZER(queue);
+static struct glm_queued_item queue[QUEUE_SIZE];
+static SDL_atomic_t queue_tail;
+static unsigned queue_head;
+static SDL_atomic_t consumer_parked;
+static SDL_sem* queue_wakeup;
 static GLuint vao, vertex_buffer, index_buffer;
 
+/* The streaming ring is a single buffer, persistently mapped at ring_base,
+ * into which threads flushing slabs copy their contents directly, so that the
+ * GL thread only needs to issue the draw call. It is NULL if unsupported or
+ * disabled, in which case each slab is uploaded with glBufferData() on the GL
+ * thread instead.
+ *
+ * Space is handed out by atomically bumping ring_head, a "virtual" byte
+ * offset which increases forever (modulo 2**32); the actual offset is its
+ * value modulo RING_SIZE. Reservations may not extend past ring_limit, which
+ * is RING_SIZE past the end of the most recent frame the GL is known to be
+ * done with. If a reservation fails, the slab simply takes the glBufferData()
+ * path.
+ *
+ * ring_fences is a FIFO, used only by the GL thread, of one fence per frame
+ * along with ring_drawn_end as of that frame's fence. ring_drawn_end is the
+ * furthest reservation end of any slab the GL thread has drawn so far. It
+ * must not be ring_head itself: by the time the fence is issued, threads may
+ * already have reserved space for the next frame, and that space is only
+ * covered by the next frame's fence.
+ */
+static GLuint ring_buffer;
+static unsigned char* ring_base;
+static SDL_atomic_t ring_head, ring_limit;
+static unsigned ring_drawn_end;
+static struct {
+  GLsync fence;
+  unsigned end;
+} ring_fences[MAX_FRAMES_IN_FLIGHT];
+static unsigned ring_fences_base, ring_fences_len;
+
 /* SDL doesn't provide a way to free TLS objects, so store unused TLSIDs in
  * this stack. We can safely assume that any reused TLS objects have NULL
  * values in them, as the glm_finish_thread() call (whose actions must complete
@@ -87,14 +204,174 @@ static SLIST_HEAD(, unused_tls) unused_tls_stack =
   SLIST_HEAD_INITIALIZER(unused_tls_stack);
 
 void glm_init(void) {
-  queue_size = SDL_CreateSemaphore(0);
-  if (!queue_size)
+  unsigned i;
+
+  queue_wakeup = SDL_CreateSemaphore(0);
+  if (!queue_wakeup)
     errx(EX_SOFTWARE, "Unable to create GL marshaller semaphore: %s",
          SDL_GetError());
 
+  for (i = 0; i < QUEUE_SIZE; ++i)
+    SDL_AtomicSet(&queue[i].sequence, i);
+
   glGenVertexArrays(1, &vao);
   glGenBuffers(1, &vertex_buffer);
   glGenBuffers(1, &index_buffer);
+
+  /* GLM_STREAMING=0 forces the glBufferData() path, eg, to compare the two
+   * on the same driver.
+   */
+  if (has_persistent_buffers &&
+      !(getenv("GLM_STREAMING") && !strcmp(getenv("GLM_STREAMING"), "0"))) {
+    glGenBuffers(1, &ring_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, ring_buffer);
+    glBufferStorage(GL_ARRAY_BUFFER, RING_SIZE, NULL,
+                    GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                    GL_MAP_COHERENT_BIT);
+    ring_base = glMapBufferRange(GL_ARRAY_BUFFER, 0, RING_SIZE,
+                                 GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                                 GL_MAP_COHERENT_BIT);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (ring_base) {
+      SDL_AtomicSet(&ring_head, 0);
+      SDL_AtomicSet(&ring_limit, RING_SIZE);
+    } else {
+      warnx("Unable to map GL streaming buffer, falling back to copying");
+      glDeleteBuffers(1, &ring_buffer);
+    }
+  }
+
+  printf("GL marshaller: %s\n", ring_base?
+         "streaming through persistently-mapped ring" :
+         "copying slabs with glBufferData()");
+}
+
+/**
+ * Retires frames at the head of ring_fences whose fences have been
+ * signalled, making their ring space available again. If block is true,
+ * waits for at least the oldest to complete.
+ *
+ * Must only be called on the GL thread.
+ */
+static void retire_ring_fences(int block) {
+  GLenum status;
+
+  while (ring_fences_len) {
+    status = glClientWaitSync(ring_fences[ring_fences_base].fence,
+                              block? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                              block? ~(GLuint64)0 : 0);
+    if (GL_TIMEOUT_EXPIRED == status)
+      break;
+    if (GL_WAIT_FAILED == status)
+      warnx("Failed to wait for GL streaming fence");
+
+    glDeleteSync(ring_fences[ring_fences_base].fence);
+    SDL_AtomicSet(&ring_limit,
+                  (int)(ring_fences[ring_fences_base].end + RING_SIZE));
+    ring_fences_base = (ring_fences_base + 1) % MAX_FRAMES_IN_FLIGHT;
+    --ring_fences_len;
+    block = 0;
+  }
+}
+
+/**
+ * Fences everything issued so far which used the streaming ring.
+ *
+ * Must only be called on the GL thread.
+ */
+static void fence_ring_frame(void) {
+  unsigned ix;
+
+  retire_ring_fences(MAX_FRAMES_IN_FLIGHT == ring_fences_len);
+
+  ix = (ring_fences_base + ring_fences_len) % MAX_FRAMES_IN_FLIGHT;
+  ring_fences[ix].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  ring_fences[ix].end = ring_drawn_end;
+  ++ring_fences_len;
+}
+
+/**
+ * Reserves size bytes (which must be a multiple of 16) of contiguous space in
+ * the streaming ring, storing the offset of the space into *offset and the
+ * new value of ring_head into *end. Returns whether the reservation
+ * succeeded.
+ */
+static int ring_reserve(unsigned* offset, unsigned* end_out, unsigned size) {
+  unsigned head, start, end;
+
+  if (!ring_base || size > RING_SIZE) return 0;
+
+  do {
+    head = (unsigned)SDL_AtomicGet(&ring_head);
+    start = head;
+    /* Reservations never wrap around the end of the buffer */
+    if ((start & (RING_SIZE-1)) + size > RING_SIZE)
+      start = (start | (RING_SIZE-1)) + 1;
+    end = start + size;
+
+    if ((signed)(end - (unsigned)SDL_AtomicGet(&ring_limit)) > 0)
+      return 0;
+  } while (!SDL_AtomicCAS(&ring_head, (int)head, (int)end));
+
+  *offset = start & (RING_SIZE-1);
+  *end_out = end;
+  return 1;
+}
+
+/**
+ * Attempts to copy the contents of the given slab into the streaming ring,
+ * setting its in_ring fields if successful. Returns whether this succeeded.
+ */
+static int copy_slab_to_ring(glm_slab* this) {
+  unsigned index_bytes, vertex_size, size, offset, end, data_offset;
+
+  index_bytes = this->group->indices_enabled?
+    (this->index_off * sizeof(unsigned short) + 15) & ~15u : 0;
+  vertex_size = this->group->vertex_size;
+  /* Vertex data must start on a multiple of the vertex size so that it can
+   * be addressed with a base vertex.
+   */
+  size = (index_bytes + vertex_size - 1 + this->data_off + 15) & ~15u;
+
+  if (!ring_reserve(&offset, &end, size)) return 0;
+
+  data_offset = (offset + index_bytes + vertex_size - 1) /
+    vertex_size * vertex_size;
+  if (index_bytes)
+    memcpy(ring_base + offset, this->indices,
+           this->index_off * sizeof(unsigned short));
+  memcpy(ring_base + data_offset, this->data, this->data_off);
+
+  this->in_ring = 1;
+  this->ring_indices = offset;
+  this->ring_base_vertex = data_offset / vertex_size;
+  this->ring_end = end;
+  return 1;
+}
+
+static unsigned short* slab_buffer_get(glm_slab_group* group) {
+  struct glm_free_buffer* buffer;
+
+  SDL_AtomicLock(&group->free_buffers_lock);
+  buffer = SLIST_FIRST(&group->free_buffers);
+  if (buffer)
+    SLIST_REMOVE_HEAD(&group->free_buffers, next);
+  SDL_AtomicUnlock(&group->free_buffers_lock);
+
+  if (buffer)
+    return (unsigned short*)buffer;
+  else
+    return xmalloc(group->data_size + 65536*sizeof(short));
+}
+
+static void slab_buffer_release(glm_slab_group* group,
+                                unsigned short* indices) {
+  struct glm_free_buffer* buffer = (struct glm_free_buffer*)indices;
+
+  SDL_AtomicLock(&group->free_buffers_lock);
+  SLIST_INSERT_HEAD(&group->free_buffers, buffer, next);
+  SDL_AtomicUnlock(&group->free_buffers_lock);
 }
 
 glm_slab_group* glm_slab_group_new(void (*activate)(void*),
@@ -111,8 +388,13 @@ glm_slab_group* glm_slab_group_new(void (*activate)(void*),
   this->userdata = userdata;
   this->configure = configure;
   this->data_size = 65536 * vertex_size;
+  this->vertex_size = vertex_size;
   this->primitive = GL_TRIANGLES;
   this->indices_enabled = 1;
+  this->free_buffers_lock = 0;
+  SLIST_INIT(&this->free_buffers);
+  this->order = 0;
+  this->ordinal = next_slab_group_ordinal++;
 
   if (SLIST_EMPTY(&unused_tls_stack)) {
     this->slab = SDL_TLSCreate();
@@ -132,6 +414,12 @@ glm_slab_group* glm_slab_group_new(void (*activate)(void*),
 
 void glm_slab_group_delete(glm_slab_group* this) {
   struct unused_tls* tls;
+  struct glm_free_buffer* buffer;
+
+  while ((buffer = SLIST_FIRST(&this->free_buffers))) {
+    SLIST_REMOVE_HEAD(&this->free_buffers, next);
+    free(buffer);
+  }
 
   tls = xmalloc(sizeof(struct unused_tls));
   tls->tls = this->slab;
@@ -147,6 +435,10 @@ void glm_slab_group_set_indices_enabled(glm_slab_group* this, int enabled) {
   this->indices_enabled = enabled;
 }
 
+void glm_slab_group_set_order(glm_slab_group* this, unsigned order) {
+  this->order = order;
+}
+
 glm_slab* glm_slab_get(glm_slab_group* group) {
   glm_slab* slab;
 
@@ -157,10 +449,13 @@ glm_slab* glm_slab_get(glm_slab_group* group) {
      */
     slab = xmalloc(sizeof(glm_slab));
     slab->group = group;
-    slab->indices = xmalloc(group->data_size + 65536*sizeof(short));
+    slab->indices = slab_buffer_get(group);
     slab->data = slab->indices + 65536;
     slab->data_off = slab->index_off = slab->vertex_off = 0;
     slab->data_max = group->data_size;
+    slab->in_ring = 0;
+    slab->key = 0;
+    slab->sequence = 0;
 
     SDL_TLSSet(group->slab, slab, NULL);
   }
@@ -190,6 +485,14 @@ unsigned short glm_slab_alloc(void** data, unsigned short** indices,
   return this->vertex_off - num_vertices;
 }
 
+void glm_slab_set_key(glm_slab* this, unsigned key) {
+  if (key == this->key) return;
+
+  /* Everything in a flushed slab must share one key */
+  flush_slab(this, 1);
+  this->key = key;
+}
+
 void glm_finish_thread(void) {
   glm_slab_group* group;
   glm_slab* slab;
@@ -204,55 +507,174 @@ void glm_finish_thread(void) {
   }
 }
 
-static void execute_slab(glm_slab*);
+static void enqueue_slab(glm_slab*);
 static void flush_slab(glm_slab* this, int reallocate) {
   glm_slab* clone;
 
   if (this->index_off || this->vertex_off) {
     clone = xmalloc(sizeof(glm_slab));
     memcpy(clone, this, sizeof(glm_slab));
-    glm_do((void(*)(void*))execute_slab, clone);
 
-    if (reallocate) {
-      this->indices = xmalloc(this->data_max + 65536*sizeof(short));
+    if (copy_slab_to_ring(clone)) {
+      /* The clone no longer needs the memory, so this slab can keep using
+       * it.
+       */
+      clone->indices = NULL;
+      clone->data = NULL;
+      if (!reallocate)
+        slab_buffer_release(this->group, this->indices);
+    } else if (reallocate) {
+      /* The clone takes ownership of the memory */
+      this->indices = slab_buffer_get(this->group);
       this->data = this->indices + 65536;
-      this->data_off = this->index_off = this->vertex_off = 0;
     }
+
+    glm_do((void(*)(void*))enqueue_slab, clone);
+    ++this->sequence;
+
+    if (reallocate)
+      this->data_off = this->index_off = this->vertex_off = 0;
   } else {
-    /* Need to free the memory, even though it currently contains nothing,
+    /* Need to release the memory, even though it currently contains nothing,
      * unless the caller has requested allocated memory to be present.
      */
     if (!reallocate)
-      free(this->indices);
+      slab_buffer_release(this->group, this->indices);
   }
 }
 
-static void execute_slab(glm_slab* this) {
-  (*this->group->activate)(this->group->userdata);
-  glBindVertexArray(vao);
-  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
-  glBufferData(GL_ARRAY_BUFFER, this->data_off, this->data, GL_STREAM_DRAW);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->index_off*sizeof(short),
-               this->indices, GL_STREAM_DRAW);
-  (*this->group->configure)();
-  if (this->group->indices_enabled)
-    glDrawElements(this->group->primitive, this->index_off, GL_UNSIGNED_SHORT,
-                   /* With an element array buffer, indicates the *offset* from
-                    * the start of that buffer. We want to start at the
-                    * beginning, so use zero.
-                    */
-                   (GLvoid*)0);
-  else
-    glDrawArrays(this->group->primitive, 0, this->vertex_off);
+static void enqueue_slab(glm_slab* this) {
+  if (num_pending_slabs == pending_slabs_cap) {
+    pending_slabs_cap = pending_slabs_cap? pending_slabs_cap * 2 : 64;
+    pending_slabs = xrealloc(pending_slabs,
+                             pending_slabs_cap * sizeof(glm_slab*));
+  }
+
+  this->arrival = num_pending_slabs;
+  pending_slabs[num_pending_slabs++] = this;
+}
+
+static int compare_pending_slabs(const void* va, const void* vb) {
+  const glm_slab* a = *(const glm_slab*const*)va;
+  const glm_slab* b = *(const glm_slab*const*)vb;
+
+#define CMP(field) if (a->field != b->field) return a->field < b->field? -1 : +1
+  CMP(group->order);
+  CMP(group->ordinal);
+  CMP(key);
+  CMP(sequence);
+#undef CMP
+  slab_order_is_ambiguous = 1;
+  return a->arrival < b->arrival? -1 : +1;
+}
+
+static void hash_drawn_slab(const glm_slab* this) {
+  unsigned fields[5], i;
+
+  fields[0] = this->group->ordinal;
+  fields[1] = this->key;
+  fields[2] = this->sequence;
+  fields[3] = this->index_off;
+  fields[4] = this->vertex_off;
+  for (i = 0; i < lenof(fields); ++i) {
+    slab_sequence_hash ^= fields[i];
+    slab_sequence_hash *= 0x100000001B3ULL;
+  }
+}
+
+unsigned long long glm_slab_sequence_hash(void) {
+  return slab_sequence_hash;
+}
 
-  if (this->group->deactivate)
-    (*this->group->deactivate)(this->group->userdata);
+/**
+ * Draws the given slab, assuming its group has already been activated and
+ * the appropriate buffer bound and configured. Frees the slab.
+ */
+static void draw_slab(glm_slab* this) {
+  if (this->in_ring) {
+    if ((signed)(this->ring_end - ring_drawn_end) > 0)
+      ring_drawn_end = this->ring_end;
+
+    if (this->group->indices_enabled)
+      glDrawElementsBaseVertex(this->group->primitive, this->index_off,
+                               GL_UNSIGNED_SHORT,
+                               (GLvoid*)(size_t)this->ring_indices,
+                               this->ring_base_vertex);
+    else
+      glDrawArrays(this->group->primitive, this->ring_base_vertex,
+                   this->vertex_off);
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, this->data_off, this->data, GL_STREAM_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->index_off*sizeof(short),
+                 this->indices, GL_STREAM_DRAW);
+    if (this->group->indices_enabled)
+      glDrawElements(this->group->primitive, this->index_off,
+                     GL_UNSIGNED_SHORT,
+                     /* With an element array buffer, indicates the *offset*
+                      * from the start of that buffer. We want to start at the
+                      * beginning, so use zero.
+                      */
+                     (GLvoid*)0);
+    else
+      glDrawArrays(this->group->primitive, 0, this->vertex_off);
+
+    slab_buffer_release(this->group, this->indices /* includes data */);
+  }
 
-  free(this->indices /* includes data */);
   free(this);
 }
 
+/**
+ * Draws all pending slabs in sort order, activating and configuring each
+ * group only once (or again if switching between the streaming ring and the
+ * copy buffers within a group).
+ */
+static void execute_pending_slabs(void) {
+  glm_slab_group* group = NULL;
+  glm_slab* slab;
+  unsigned i;
+  int in_ring = -1;
+
+  if (!num_pending_slabs) return;
+
+  qsort(pending_slabs, num_pending_slabs, sizeof(glm_slab*),
+        compare_pending_slabs);
+  if (slab_order_is_ambiguous && !slab_order_warned) {
+    warnx("Slabs from different threads share a group and key; "
+          "their draw order depends on thread timing");
+    slab_order_warned = 1;
+  }
+
+  for (i = 0; i < num_pending_slabs; ++i) {
+    slab = pending_slabs[i];
+
+    if (slab->group != group) {
+      if (group && group->deactivate)
+        (*group->deactivate)(group->userdata);
+
+      group = slab->group;
+      (*group->activate)(group->userdata);
+      glBindVertexArray(vao);
+      in_ring = -1;
+    }
+
+    if (slab->in_ring != in_ring) {
+      in_ring = slab->in_ring;
+      glBindBuffer(GL_ARRAY_BUFFER, in_ring? ring_buffer : vertex_buffer);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, in_ring? ring_buffer : index_buffer);
+      (*group->configure)();
+    }
+
+    hash_drawn_slab(slab);
+    draw_slab(slab);
+  }
+
+  if (group->deactivate)
+    (*group->deactivate)(group->userdata);
+
+  num_pending_slabs = 0;
+}
+
 static void execute_set_done(void*);
 void glm_done(void) {
   glm_do(execute_set_done, NULL);
@@ -260,54 +682,133 @@ void glm_done(void) {
 
 void glm_do(void (*f)(void*), void* ud) {
   struct glm_queued_item* entry;
+  unsigned pos;
+  signed available;
+
+  for (;;) {
+    pos = (unsigned)SDL_AtomicGet(&queue_tail);
+    entry = queue + (pos & (QUEUE_SIZE-1));
+    available = (signed)((unsigned)SDL_AtomicGet(&entry->sequence) - pos);
+
+    if (!available) {
+      if (SDL_AtomicCAS(&queue_tail, (int)pos, (int)(pos+1)))
+        break;
+    } else if (available < 0) {
+      /* Queue full; give the GL thread a chance to catch up */
+      SDL_Delay(0);
+    }
+    /* Otherwise, another producer claimed pos first; try again */
+  }
 
-  entry = xmalloc(sizeof(struct glm_queued_item));
   entry->exec = f;
   entry->userdata = ud;
+  SDL_AtomicSet(&entry->sequence, (int)(pos+1));
 
-  SDL_AtomicLock(&queue_lock);
-  STAILQ_INSERT_TAIL(&queue, entry, next);
-  SDL_AtomicUnlock(&queue_lock);
-
-  SDL_SemPost(queue_size);
+  if (SDL_AtomicGet(&consumer_parked) &&
+      SDL_AtomicCAS(&consumer_parked, 1, 0))
+    SDL_SemPost(queue_wakeup);
 }
 
 static int is_done;
 static void execute_set_done(void* ignored) {
   is_done = 1;
+
+  if (ring_base)
+    fence_ring_frame();
 }
 
-void glm_main(void) {
-  struct glm_queued_item* entry;
+static int queue_has_ready_entry(void) {
+  return (unsigned)SDL_AtomicGet(
+    &queue[queue_head & (QUEUE_SIZE-1)].sequence) == queue_head+1;
+}
+
+static void check_gl_error(const char* when) {
   int error;
 
-  is_done = 0;
-  while (!is_done) {
-    SDL_SemWait(queue_size);
+  error = glGetError();
+  if (error)
+    warnx("GL Error %s: %d (%s)", when, error, gluErrorString(error));
+}
 
-    SDL_AtomicLock(&queue_lock);
-    entry = STAILQ_FIRST(&queue);
-    STAILQ_REMOVE_HEAD(&queue, next);
-    SDL_AtomicUnlock(&queue_lock);
+/**
+ * Executes every entry currently ready in the queue, stopping early if one of
+ * them sets is_done. Returns the number executed.
+ */
+static unsigned drain_queue(void) {
+  struct glm_queued_item* entry;
+  void (*exec)(void*);
+  void* userdata;
+  unsigned count = 0;
+  Uint64 start;
+
+  while (!is_done && queue_has_ready_entry()) {
+    entry = queue + (queue_head & (QUEUE_SIZE-1));
+    exec = entry->exec;
+    userdata = entry->userdata;
+
+    /* Any other command may depend on the slabs so far being drawn */
+    if ((void(*)(void*))enqueue_slab != exec && num_pending_slabs) {
+      start = trace_begin();
+      execute_pending_slabs();
+      trace_end("glm slabs", start);
+    }
 
-    (*entry->exec)(entry->userdata);
+    /* Release the entry before executing it, so producers blocked on a full
+     * queue can proceed sooner.
+     */
+    SDL_AtomicSet(&entry->sequence, (int)(queue_head + QUEUE_SIZE));
+    ++queue_head;
 
-    error = glGetError();
-    if (error)
-      warnx("GL Error: %d (%s)", error, gluErrorString(error));
+    start = trace_begin();
+    (*exec)(userdata);
+    trace_end_with("glm command", (const void*)exec, start);
+    ++count;
 
-    free(entry);
+#ifdef GLM_DEBUG
+    /* Check after every command so errors can be attributed */
+    check_gl_error("after marshalled command");
+#endif
   }
+
+#ifndef GLM_DEBUG
+  /* glGetError() may force a round-trip to the driver, so only check once
+   * per batch. Define GLM_DEBUG to check after every command.
+   */
+  if (count)
+    check_gl_error("in marshalled batch");
+#endif
+
+  return count;
+}
+
+void glm_main(void) {
+  is_done = 0;
+  while (!is_done) {
+    if (drain_queue()) continue;
+
+    /* Nothing ready; go to sleep until a producer posts something */
+    SDL_AtomicSet(&consumer_parked, 1);
+    if (queue_has_ready_entry()) {
+      /* Raced with a producer. If it already cleared the flag, it has also
+       * posted the semaphore, which must be consumed to keep it balanced.
+       */
+      if (!SDL_AtomicCAS(&consumer_parked, 1, 0))
+        SDL_SemWait(queue_wakeup);
+    } else {
+      SDL_SemWait(queue_wakeup);
+    }
+  }
+}
+
+void glm_drain(void) {
+  is_done = 0;
+  drain_queue();
 }
 
 static void glm_do_clear(void* value) {
-  glClear(*(unsigned*)value);
-  free(value);
+  glClear((unsigned)(size_t)value);
 }
 
 void glm_clear(unsigned value) {
-  unsigned* vp = xmalloc(sizeof(unsigned));
-
-  *vp = value;
-  glm_do(glm_do_clear, vp);
+  glm_do(glm_do_clear, (void*)(size_t)value);
 }
@@ -46,6 +46,13 @@
  * to 65536 vertics and indices. When a slab is eventually flushed to OpenGL,
  * its activation function is run, then all data initialised within the slab
  * are rendered.
+ *
+ * Where the GL supports persistently-mapped buffers, flushing a slab copies
+ * its contents directly into a ring buffer shared with the GL, so the OpenGL
+ * thread need only issue the draw call. Otherwise (or if the ring is full, or
+ * the GLM_STREAMING environment variable is "0"), the slab's memory is handed
+ * to the OpenGL thread and uploaded there. Either way, slab memory is
+ * recycled rather than freed.
  */
 
 typedef struct glm_slab_group_s glm_slab_group;
@@ -92,6 +99,23 @@ void glm_slab_group_set_primitive(glm_slab_group*,int);
  */
 void glm_slab_group_set_indices_enabled(glm_slab_group*,int);
 
+/**
+ * Order (see glm_slab_group_set_order()) for groups of opaque geometry. Groups
+ * which are drawn in the same run of slabs should take their order from a
+ * named constant so that their relative order is explicit rather than an
+ * accident of creation order.
+ */
+#define GLM_ORDER_OPAQUE 100
+
+/**
+ * Sets the major sort key of slabs in this group. Within each run of slabs
+ * between other marshalled commands, slabs are drawn in ascending order of
+ * their group's order, then by group creation order, then by slab key (see
+ * glm_slab_set_key()), so that the result does not depend on thread timing.
+ * The default order is 0.
+ */
+void glm_slab_group_set_order(glm_slab_group*, unsigned);
+
 /**
  * Returns the slab associated with the current thread and the given slab
  * group. Repeated calls by the same thread with the same input return the same
@@ -122,6 +146,16 @@ unsigned short glm_slab_alloc(void** data, unsigned short** indices,
                               unsigned data_size,
                               unsigned num_vertices,
                               unsigned short num_indices);
+/**
+ * Sets the minor sort key (eg, mhive or tile order) for geometry subsequently
+ * allocated from the given slab. Geometry allocated under different keys is
+ * never drawn as one slab, so changing the key flushes the slab if needed.
+ * The default key is 0. For fully deterministic output, different threads
+ * should not draw into the same group with the same key within one run of
+ * slabs.
+ */
+void glm_slab_set_key(glm_slab*, unsigned);
+
 /**
  * Simplified interface to glm_slab_alloc().
  *
@@ -142,7 +176,9 @@ unsigned short glm_slab_alloc(void** data, unsigned short** indices,
  */
 void glm_finish_thread(void);
 /**
- * Enqueues a task which will cause glm_main() to return when executed.
+ * Enqueues a task which will cause glm_main() to return when executed. This
+ * also marks the end of a frame; every thread which has drawn anything in the
+ * frame must have called glm_finish_thread() before this is called.
  */
 void glm_done(void);
 /**
@@ -151,6 +187,10 @@ void glm_done(void);
  * be executed in the order provided; ordering between threads is only
  * guaranteed only as much as the caller can guarantee non-concurrent execution
  * of this function.
+ *
+ * This does not allocate memory or take any locks. If the queue is full, it
+ * waits for the OpenGL thread to catch up, so it must never be called from
+ * the OpenGL thread itself.
  */
 void glm_do(void (*)(void*), void*);
 
@@ -159,12 +199,38 @@ void glm_do(void (*)(void*), void*);
  */
 void glm_clear(unsigned value);
 
+/**
+ * Returns a hash of the sequence of slabs drawn since glm_init(), covering
+ * each slab's group, key, flush sequence and size in draw order. Two runs
+ * which draw the same geometry produce the same hash iff the draw order was
+ * independent of thread timing, so this is a cheap check that every slab
+ * producer keys its geometry properly.
+ *
+ * Must only be called from the thread which runs glm_main(), while it is not
+ * running.
+ */
+unsigned long long glm_slab_sequence_hash(void);
+
 /**
  * Executes tasks enqueued for OpenGL marshalling. Returns after executing a
- * task enqueued by glm_do().
+ * task enqueued by glm_done().
+ *
+ * GL errors are checked once per batch of commands executed; define GLM_DEBUG
+ * to check after each individual command instead.
  */
 void glm_main(void);
 
+/**
+ * Executes whatever tasks are currently enqueued for OpenGL marshalling,
+ * without waiting for glm_done(). This allows the OpenGL thread to wait for
+ * work outside of a frame which may itself be blocked on marshalled
+ * commands.
+ *
+ * Must only be called from the thread which runs glm_main(), while it is not
+ * running.
+ */
+void glm_drain(void);
+
 /**
  * Initialises global data needed by the OpenGL marshaller. This must be called
  * exactly once before any other glm function.
@@ -60,6 +60,10 @@ static inline void put_uniform_vec3(GLint ix, const float* f) {
 }
 
 #define no_uniforms
+/* Outside of instanced configuration, per-vertex attributes are no different
+ * from any other.
+ */
+#define vertex_attrib(cnt,name) attrib(cnt,name)
 
 #define shader(name) ;struct shader_##name##_info
 #define composed_of(x,y) GLuint program; GLint projection_matrix_ix;
@@ -187,3 +191,44 @@ static char link_error_log[65536];
 #undef uniform
 #undef composed_of
 #undef shader
+
+/* For instanced drawing, attributes declared with vertex_attrib() are read
+ * per-vertex from the first buffer, and all others once per instance from the
+ * second. Both buffers use the full vertex format.
+ */
+#define shader(name)                                            \
+  static void shader_##name##_configure_instanced_vbo_(         \
+    shader_##name##_vertex* vertex_format,                      \
+    struct shader_##name##_info* info,                          \
+    GLuint vertex_buffer, GLuint instance_buffer);              \
+  void shader_##name##_configure_instanced_vbo(                 \
+    GLuint vertex_buffer, GLuint instance_buffer                \
+  ) {                                                           \
+    shader_##name##_configure_instanced_vbo_(                   \
+      0, &name##_shader_info, vertex_buffer, instance_buffer);  \
+  }                                                             \
+  static void shader_##name##_configure_instanced_vbo_(         \
+    shader_##name##_vertex* vertex_format,                      \
+    struct shader_##name##_info* info,                          \
+    GLuint vertex_buffer, GLuint instance_buffer)
+#define composed_of(x,y)
+#define uniform(x,y)
+#define configure_instanced_attrib(cnt,name,buffer,divisor)             \
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);                                \
+  glVertexAttribPointer(info->name##_va, cnt, GL_FLOAT, GL_FALSE,       \
+                        sizeof(*vertex_format),                         \
+                        (GLvoid*)ptroffof(vertex_format, name));        \
+  glVertexAttribDivisor(info->name##_va, divisor);                      \
+  glEnableVertexAttribArray(info->name##_va);
+#define attrib(cnt,name)                                                \
+  configure_instanced_attrib(cnt, name, instance_buffer, 1)
+#undef vertex_attrib
+#define vertex_attrib(cnt,name)                                         \
+  configure_instanced_attrib(cnt, name, vertex_buffer, 0)
+#include "shaders.inc"
+#undef vertex_attrib
+#undef configure_instanced_attrib
+#undef attrib
+#undef uniform
+#undef composed_of
+#undef shader
@@ -48,31 +48,36 @@ typedef float shader_type_vec3[3];
 #define uniform(type, name) shader_type_##type name;
 #define no_uniforms int dummy;
 #define attrib(cnt,name)
+#define vertex_attrib(cnt,name)
 #define padding(cnt,name)
 extern int dummy_decl
 #include "shaders.inc"
 ;
 #undef padding
+#undef vertex_attrib
 #undef attrib
 #undef no_uniforms
 #undef uniform
 #undef composed_of
 #undef shader
 
-#define shader(name)                            \
-  ;typedef struct shader_##name##_vertex_s      \
-  shader_##name##_vertex;                       \
-  void shader_##name##_configure_vbo(void);     \
+#define shader(name)                                            \
+  ;typedef struct shader_##name##_vertex_s                      \
+  shader_##name##_vertex;                                       \
+  void shader_##name##_configure_vbo(void);                     \
+  void shader_##name##_configure_instanced_vbo(GLuint, GLuint); \
   struct shader_##name##_vertex_s
 #define composed_of(x,y)
 #define uniform(x,y)
 #define no_uniforms
 #define attrib(cnt,name) float name[cnt];
+#define vertex_attrib(cnt,name) float name[cnt];
 #define padding(cnt,name) float name[cnt];
 extern int dummy_decl
 #include "shaders.inc"
 ;
 #undef padding
+#undef vertex_attrib
 #undef attrib
 #undef no_uniforms
 #undef uniform
@@ -39,6 +39,7 @@
 #include "../contrib/lua/lualib.h"
 
 #include "../bsd.h"
+#include "../world/snapshot.h"
 #include "lluas.h"
 
 #define MEMORY_LIMIT (64*1024*1024)
@@ -48,6 +49,7 @@ extern void open_module_mg(lua_State*);
 static lua_State* interpreter;
 static lluas_error_status error_status;
 static size_t memory_in_use = 0;
+static unsigned long long chunk_hash;
 
 static lua_State* lluas_create_interpreter(void);
 static void* lluas_alloc(void*, void*, size_t, size_t);
@@ -58,9 +60,11 @@ static void lluas_invoke_top_of_stack(void);
 static void lluas_error(const char* prefix,
                         lluas_error_status status);
 static int lluas_traceback(lua_State*);
+static void lluas_hash_file(const char*);
 
 void lluas_init(void) {
   error_status = 0;
+  chunk_hash = WORLD_SNAPSHOT_HASH_INIT;
 
   if (interpreter)
     lua_close(interpreter);
@@ -155,6 +159,8 @@ void lluas_load_file(const char* filename, unsigned instr_limit) {
    * tell which file caused the problem.
    */
 
+  lluas_hash_file(filename);
+
   lua_setinstrlimit(L, instr_limit);
   switch (luaL_loadfilex(L, filename, "t" /* no bytecode allowed */)) {
   case LUA_OK: break;
@@ -179,6 +185,35 @@ void lluas_load_file(const char* filename, unsigned instr_limit) {
   lluas_invoke_top_of_stack();
 }
 
+/* Accumulates the contents of the given file into chunk_hash. A file which
+ * cannot be read is ignored here, since loading it will fail anyway.
+ */
+static void lluas_hash_file(const char* filename) {
+  FILE* in;
+  unsigned char buffer[4096];
+  unsigned long long length = 0, file_hash = WORLD_SNAPSHOT_HASH_INIT;
+  size_t n;
+
+  in = fopen(filename, "rb");
+  if (!in) return;
+
+  /* The buffer is a multiple of 8 bytes, so only the final read can be
+   * partial.
+   */
+  while ((n = fread(buffer, 1, sizeof(buffer), in))) {
+    file_hash = world_snapshot_hash(file_hash, buffer, n);
+    length += n;
+  }
+  fclose(in);
+
+  chunk_hash = world_snapshot_hash(chunk_hash, &file_hash, sizeof(file_hash));
+  chunk_hash = world_snapshot_hash(chunk_hash, &length, sizeof(length));
+}
+
+unsigned long long lluas_get_chunk_hash(void) {
+  return chunk_hash;
+}
+
 static void lluas_error(const char* prefix, lluas_error_status status) {
   lua_State* L = interpreter;
 
@@ -98,6 +98,16 @@ lluas_error_status lluas_get_error_status(void);
  */
 void lluas_load_file(const char* filename, unsigned instr_limit);
 
+/**
+ * Returns a hash of the contents of every file passed to lluas_load_file()
+ * since the last call to lluas_init(), in the order they were loaded.
+ *
+ * Everything the scripts define, such as resources, is derived from these
+ * files, so this identifies the scripted content as a whole; eg, it can be
+ * used to tell whether cached results of running the scripts are stale.
+ */
+unsigned long long lluas_get_chunk_hash(void);
+
 /**
  * Invokes the global function of the given name in the interpreter, with no
  * arguments.
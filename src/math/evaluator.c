@@ -30,7 +30,10 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 
+#include "../alloc.h"
+#include "../defs.h"
 #include "rand.h"
 #include "coords.h"
 #include "frac.h"
@@ -213,3 +216,256 @@ EVF3(chaos, a, b, c) {
       chaos_accum(
         chaos_accum(0, a), b), c));
 }
+
+/* Every builder-visible cell function, with the number of leading arguments
+ * it actually reads (the builders replicate the last meaningful index into
+ * the unused slots).
+ */
+#define EVALUATOR_OPS(X)                                \
+  X(add,2) X(sub,2) X(mul,2) X(div,2) X(mod,2)          \
+  X(neg,1) X(abs,1) X(to_angle,1) X(cos,1) X(sin,1)     \
+  X(sqrt,1) X(magnitude,3)                              \
+  X(logand,2) X(logor,2) X(lognot,1)                    \
+  X(equ,2) X(neq,2) X(lt,2) X(le,2) X(gt,2) X(ge,2)     \
+  X(if,3) X(clamp,3) X(clamp_min,2) X(clamp_max,2)      \
+  X(fraction_of,1) X(fraction_smul,2) X(fraction_umul,2) \
+  X(zoscale,2) X(chaos,3)
+
+enum {
+  /* dst = constants[aux] */
+  eop_const,
+  /* dst = src[0] */
+  eop_mov,
+  /* dst = functions[aux](src[0], src[1], src[2]) */
+  eop_call,
+#define EVALUATOR_OP_ENUM(name,arity) eop_##name,
+  EVALUATOR_OPS(EVALUATOR_OP_ENUM)
+#undef EVALUATOR_OP_ENUM
+};
+
+static const struct {
+  evaluator_f f;
+  unsigned short op, arity;
+} evaluator_opcodes[] = {
+  { evaluator_const_f, eop_mov, 1 },
+#define EVALUATOR_OP_ENTRY(name,arity)                  \
+  { evaluator_##name##_f, eop_##name, arity },
+  EVALUATOR_OPS(EVALUATOR_OP_ENTRY)
+#undef EVALUATOR_OP_ENTRY
+};
+
+#define EVC_CONSTANT 1
+#define EVC_NEEDED 2
+
+evaluator_program* evaluator_compile(const evaluator_cell* cells, unsigned n,
+                                     const unsigned* outputs,
+                                     unsigned num_outputs) {
+  evaluator_program* this;
+  evaluator_insn* insns, * insn;
+  evaluator_value* values;
+  unsigned char* flags;
+  unsigned i, j, num_insns = 0, num_constants = 0, num_functions = 0;
+
+  if (n > 65536) abort();
+
+  insns = xmalloc(sizeof(evaluator_insn) * (n? n : 1));
+  values = xmalloc(sizeof(evaluator_value) * (n? n : 1));
+  flags = zxmalloc(n? n : 1);
+
+  /* Resolve each cell to an opcode, and fold every cell whose inputs are all
+   * constants. Forward and self references read whatever the caller
+   * pre-populated, so they are never constant.
+   */
+  for (i = 0; i < n; ++i) {
+    insn = insns + i;
+    insn->dst = i;
+    insn->aux = 0;
+
+    if (ecf_direct == cells[i].format) {
+      insn->op = eop_const;
+      values[i] = (*cells[i].f)(cells[i].value.direct, 0, 0);
+      flags[i] = EVC_CONSTANT;
+      continue;
+    }
+
+    insn->op = eop_call;
+    insn->src[0] = cells[i].value.indirect[0];
+    insn->src[1] = cells[i].value.indirect[1];
+    insn->src[2] = cells[i].value.indirect[2];
+    for (j = 0; j < lenof(evaluator_opcodes); ++j) {
+      if (cells[i].f == evaluator_opcodes[j].f) {
+        insn->op = evaluator_opcodes[j].op;
+        /* Normalise unused operands so they neither keep other cells alive
+         * nor defeat folding.
+         */
+        if (evaluator_opcodes[j].arity < 2) insn->src[1] = insn->src[0];
+        if (evaluator_opcodes[j].arity < 3) insn->src[2] = insn->src[1];
+        break;
+      }
+    }
+
+    if (insn->src[0] < i && (flags[insn->src[0]] & EVC_CONSTANT) &&
+        insn->src[1] < i && (flags[insn->src[1]] & EVC_CONSTANT) &&
+        insn->src[2] < i && (flags[insn->src[2]] & EVC_CONSTANT)) {
+      values[i] = (*cells[i].f)(values[insn->src[0]],
+                                values[insn->src[1]],
+                                values[insn->src[2]]);
+      insn->op = eop_const;
+      flags[i] = EVC_CONSTANT;
+    }
+  }
+
+  /* Propagate liveness backwards from the outputs. Only backward references
+   * keep a cell alive; anything else reads a caller-provided value.
+   */
+  if (outputs) {
+    for (i = 0; i < num_outputs; ++i)
+      if (outputs[i] < n)
+        flags[outputs[i]] |= EVC_NEEDED;
+  } else {
+    for (i = 0; i < n; ++i)
+      flags[i] |= EVC_NEEDED;
+  }
+
+  for (i = n; i > 0; --i) {
+    insn = insns + i - 1;
+    if ((flags[i-1] & (EVC_NEEDED|EVC_CONSTANT)) != EVC_NEEDED)
+      continue;
+
+    for (j = 0; j < 3; ++j)
+      if (insn->src[j] < i-1)
+        flags[insn->src[j]] |= EVC_NEEDED;
+  }
+
+  /* Compact the surviving instructions in place. A copy of a cell onto
+   * itself (ie, a nop input) has no effect and is dropped entirely.
+   */
+  for (i = 0; i < n; ++i) {
+    if (!(flags[i] & EVC_NEEDED)) continue;
+
+    insn = insns + i;
+    if (eop_mov == insn->op && insn->src[0] == i) continue;
+
+    switch (insn->op) {
+    case eop_const:
+      insn->aux = num_constants;
+      values[num_constants++] = values[i];
+      break;
+
+    case eop_call:
+      insn->aux = num_functions++;
+      break;
+    }
+
+    insns[num_insns++] = *insn;
+  }
+
+  this = xmalloc(sizeof(evaluator_program) +
+                 sizeof(evaluator_insn) * num_insns +
+                 sizeof(evaluator_value) * num_constants +
+                 sizeof(evaluator_f) * num_functions);
+  this->num_cells = n;
+  this->num_insns = num_insns;
+  this->constants = (evaluator_value*)(this + 1);
+  this->functions = (evaluator_f*)(this->constants + num_constants);
+  this->insns = (evaluator_insn*)(this->functions + num_functions);
+  memcpy(this->insns, insns, sizeof(evaluator_insn) * num_insns);
+  memcpy(this->constants, values, sizeof(evaluator_value) * num_constants);
+  for (i = 0; i < num_insns; ++i)
+    if (eop_call == insns[i].op)
+      this->functions[insns[i].aux] = cells[insns[i].dst].f;
+
+  free(flags);
+  free(values);
+  free(insns);
+  return this;
+}
+
+void evaluator_program_delete(evaluator_program* this) {
+  free(this);
+}
+
+void evaluator_program_execute(const evaluator_program* this,
+                               evaluator_value* dst) {
+  const evaluator_insn* insn, * end = this->insns + this->num_insns;
+
+  for (insn = this->insns; insn != end; ++insn) {
+    switch (insn->op) {
+    case eop_const:
+      dst[insn->dst] = this->constants[insn->aux];
+      break;
+
+    case eop_mov:
+      dst[insn->dst] = dst[insn->src[0]];
+      break;
+
+    case eop_call:
+      dst[insn->dst] = (*this->functions[insn->aux])(
+        dst[insn->src[0]], dst[insn->src[1]], dst[insn->src[2]]);
+      break;
+
+#define EVALUATOR_OP_EXEC(name,arity)                                   \
+    case eop_##name:                                                    \
+      dst[insn->dst] = evaluator_##name##_f(                            \
+        dst[insn->src[0]], dst[insn->src[1]], dst[insn->src[2]]);       \
+      break;
+    EVALUATOR_OPS(EVALUATOR_OP_EXEC)
+#undef EVALUATOR_OP_EXEC
+
+    default:
+      abort();
+      break;
+    }
+  }
+}
+
+void evaluator_program_execute_batch(const evaluator_program* this,
+                                     evaluator_value* dst,
+                                     unsigned count) {
+  const evaluator_insn* insn, * end = this->insns + this->num_insns;
+  evaluator_value* out, v;
+  const evaluator_value* a, * b, * c;
+  evaluator_f f;
+  unsigned k;
+
+  for (insn = this->insns; insn != end; ++insn) {
+    /* An instruction may read its own destination row (if it references
+     * its own pre-populated value), but each element is read before it is
+     * written, so that aliasing is harmless.
+     */
+    out = dst + insn->dst * (size_t)count;
+    a = dst + insn->src[0] * (size_t)count;
+    b = dst + insn->src[1] * (size_t)count;
+    c = dst + insn->src[2] * (size_t)count;
+
+    switch (insn->op) {
+    case eop_const:
+      v = this->constants[insn->aux];
+      for (k = 0; k < count; ++k)
+        out[k] = v;
+      break;
+
+    case eop_mov:
+      memcpy(out, a, sizeof(evaluator_value) * count);
+      break;
+
+    case eop_call:
+      f = this->functions[insn->aux];
+      for (k = 0; k < count; ++k)
+        out[k] = (*f)(a[k], b[k], c[k]);
+      break;
+
+#define EVALUATOR_OP_BATCH(name,arity)                                  \
+    case eop_##name:                                                    \
+      for (k = 0; k < count; ++k)                                       \
+        out[k] = evaluator_##name##_f(a[k], b[k], c[k]);                \
+      break;
+    EVALUATOR_OPS(EVALUATOR_OP_BATCH)
+#undef EVALUATOR_OP_BATCH
+
+    default:
+      abort();
+      break;
+    }
+  }
+}
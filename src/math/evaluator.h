@@ -331,4 +331,92 @@ unsigned evaluator_chaos(evaluator_builder*, unsigned, unsigned, unsigned);
  */
 unsigned evaluator_nop(evaluator_builder*);
 
+/**
+ * A single instruction in a compiled evaluator program.
+ *
+ * This should be treated as an opaque struct.
+ */
+typedef struct {
+  unsigned short op, dst, src[3], aux;
+} evaluator_insn;
+
+/**
+ * An evaluator function compiled into a flat instruction stream.
+ *
+ * Compilation folds every cell whose inputs are all known at compile time
+ * into a constant, drops cells which do not contribute to any requested
+ * output, and resolves each remaining cell function to an opcode so that
+ * execution is a tight dispatch loop rather than an indirect call per cell.
+ * Results are bit-identical to evaluator_execute() for every output cell.
+ *
+ * Compiled programs operate on the same result vector layout as the cells
+ * they were compiled from: inputs are pre-populated at the index of the
+ * corresponding nop cell (or any other index read before it is written), and
+ * outputs are read from the index of their cell. Entries of cells which were
+ * neither requested as outputs nor needed to compute one are left untouched.
+ *
+ * Cell functions are assumed to be pure; direct cells are folded by passing
+ * zero as the (undefined) second and third arguments.
+ *
+ * Programs are immutable once compiled, and may be executed concurrently
+ * from any number of threads.
+ */
+typedef struct {
+  /**
+   * The number of cells in the original function, and thus the length of
+   * the result vector the program operates on.
+   */
+  unsigned num_cells;
+  /**
+   * The number of instructions in the program.
+   */
+  unsigned num_insns;
+  evaluator_insn* insns;
+  evaluator_value* constants;
+  evaluator_f* functions;
+} evaluator_program;
+
+/**
+ * Compiles the given evaluator function into a program.
+ *
+ * @param cells The cells to compile. They need not outlive the program.
+ * @param n The number of cells. Must not exceed 65536.
+ * @param outputs The indices of the cells whose values the caller will read
+ * after execution. If NULL, every cell is treated as an output.
+ * @param num_outputs The length of the outputs array.
+ * @return The compiled program, which must be freed with
+ * evaluator_program_delete().
+ */
+evaluator_program* evaluator_compile(const evaluator_cell* cells, unsigned n,
+                                     const unsigned* outputs,
+                                     unsigned num_outputs);
+/**
+ * Frees the memory held by the given program.
+ */
+void evaluator_program_delete(evaluator_program*);
+
+/**
+ * Executes the given program once.
+ *
+ * @param dst The result vector, of length program->num_cells, with inputs
+ * pre-populated exactly as for evaluator_execute().
+ */
+void evaluator_program_execute(const evaluator_program*,
+                               evaluator_value* dst);
+/**
+ * Executes the given program over count independent sets of inputs at once.
+ *
+ * The result vector is laid out cell-major: the value of cell i for input
+ * set k lives at dst[i*count + k]. Each instruction is applied to all count
+ * sets before moving on to the next, so dispatch cost is paid once per
+ * instruction rather than once per instruction per input set. The results
+ * for each input set are identical to those of evaluator_program_execute().
+ *
+ * @param dst The result vector, of length program->num_cells*count.
+ * @param count The number of input sets.
+ */
+void evaluator_program_execute_batch(const evaluator_program*,
+                                     evaluator_value* dst,
+                                     unsigned count);
+
 #endif /* MATH_EVALUATOR_H_ */
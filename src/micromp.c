@@ -29,21 +29,37 @@
 #include <config.h>
 #endif
 
-#include <SDL.h>
-
 #if defined(HAVE_SYS_PARAM_H) && defined(HAVE_SYS_CPUSET_H) &&  \
   defined(HAVE_CPUSET_SETAFFINITY)
 #define USE_BSD_CPUSET_SETAFFINITY
+#elif defined(HAVE_PTHREAD_H) && defined(HAVE_SCHED_H) &&       \
+  defined(HAVE_PTHREAD_SETAFFINITY_NP)
+#define USE_PTHREAD_SETAFFINITY_NP
+/* Needed on GNU for pthread_setaffinity_np() and the CPU_* macros */
+#define _GNU_SOURCE
 #endif
 
+#include <SDL.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #ifdef USE_BSD_CPUSET_SETAFFINITY
 #include <sys/param.h>
 #include <sys/cpuset.h>
 #endif
 
+#ifdef USE_PTHREAD_SETAFFINITY_NP
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "bsd.h"
 
 #include "micromp.h"
+#include "trace.h"
 
 /* Define UMP_NO_THREADING to do everything single-threaded. */
 
@@ -55,6 +71,44 @@ static ump_task* current_task;
 static SDL_atomic_t current_task_id;
 static int current_task_is_sync;
 
+/**
+ * The number of workers currently blocked on assignment_notification, and the
+ * number of joiners currently blocked on completion_notification waiting for
+ * num_busy_workers to reach zero.
+ *
+ * A waiter increments its counter while holding the mutex, then re-checks its
+ * wake condition before sleeping. The notifier changes the wake condition
+ * first, then only takes the mutex and broadcasts if the counter is non-zero.
+ * Since both sides use full barriers, at least one of them always sees the
+ * other's write, so the notifications can be skipped entirely whenever
+ * everyone is still spinning.
+ */
+static SDL_atomic_t num_parked_workers, num_parked_joiners;
+
+/**
+ * The time, in microseconds, for which a thread polls for its wake condition
+ * before parking on a condition variable, and the same in performance counter
+ * ticks. See ump_set_spin_budget().
+ */
+static volatile unsigned spin_budget = UMP_DEFAULT_SPIN_BUDGET;
+static volatile Uint64 spin_budget_ticks;
+
+#ifdef UMP_VERBOSE_TIMING
+/**
+ * Performance counter values at which the current task was dispatched and at
+ * which the last worker finished it, respectively.
+ */
+static Uint64 dispatch_time, completion_time;
+#endif
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define SPIN_PAUSE() __asm__ __volatile__("pause")
+#elif defined(__GNUC__) && (defined(__arm__) || defined(__aarch64__))
+#define SPIN_PAUSE() __asm__ __volatile__("yield")
+#else
+#define SPIN_PAUSE() do { } while (0)
+#endif
+
 /**
  * Indicates the most recent task ID accepted by each thread. This is used by
  * the "impersonation mechanism" which allows to recover from operating system
@@ -85,6 +139,45 @@ typedef struct {
 
 static ump_thread_spec thread_specs[UMP_MAX_THREADS];
 
+/**
+ * Whether the current task is being executed with work stealing. This is
+ * distinct from current_task->work_stealing, since that may be set on tasks
+ * too large to steal from.
+ */
+static int current_task_is_stealing;
+
+/**
+ * The per-thread deques of divisions used by work-stealing tasks. Element i
+ * belongs to worker i (or whoever is impersonating it); element num_workers
+ * belongs to the master thread.
+ *
+ * Since the divisions initially given to any thread always form a contiguous
+ * range, and nothing is ever pushed onto a deque once the task has started, a
+ * deque is simply a packed word holding the half-open range [low,high), with
+ * low in the lower 16 bits. The owner pops from the low end and thieves steal
+ * from the high end. Both are a single CAS on the whole word, so no lock is
+ * needed and no division can ever be handed out twice.
+ *
+ * Each deque lives in its own cache line, so that the owner popping from its
+ * deque doesn't disturb anyone else.
+ */
+static struct {
+  SDL_atomic_t range;
+  volatile unsigned char padding[UMP_CACHE_LINE_SZ - sizeof(SDL_atomic_t)];
+} division_deques[UMP_MAX_THREADS+1];
+
+/**
+ * Executes a single division of a task, recording it as a trace scope tagged
+ * with the task's function.
+ */
+static inline void exec_division(void (*exec)(unsigned,unsigned),
+                                 unsigned division, unsigned n) {
+  Uint64 start = trace_begin();
+
+  (*exec)(division, n);
+  trace_end_with("ump division", (const void*)exec, start);
+}
+
 static void exec_region(unsigned lower_bound, unsigned upper_bound) {
   unsigned i, n;
   void (*exec)(unsigned,unsigned);
@@ -93,118 +186,721 @@ static void exec_region(unsigned lower_bound, unsigned upper_bound) {
   exec = current_task->exec;
 
   for (i = lower_bound; i < upper_bound; ++i)
-    (*exec)(i, n);
+    exec_division(exec, i, n);
 }
 
-static int ump_main(void* vspec) {
+/**
+ * Calculates the range of divisions statically assigned to the given worker
+ * for the current task.
+ */
+static void worker_region(unsigned* lower_bound, unsigned* upper_bound,
+                          unsigned worker, unsigned count) {
+  unsigned n, work_offset, work_amt;
+
+  n = current_task->num_divisions;
+  if (current_task_is_sync)
+    /* Master gets a fair share of work */
+    work_offset = n / (1 + count);
+  else
+    /* Master gets specific unfair amount of work */
+    work_offset = current_task->divisions_for_master;
+
+  work_amt = n - work_offset;
+
+  *lower_bound = work_offset + worker * work_amt / count;
+  *upper_bound = work_offset + (worker+1) * work_amt / count;
+}
+
+static void deque_init(unsigned owner, unsigned low, unsigned high) {
+  SDL_AtomicSet(&division_deques[owner].range, (int)((high << 16) | low));
+}
+
+/**
+ * Removes the lowest division from the given deque, storing it in *division.
+ * Returns whether there was anything to remove.
+ */
+static int deque_pop(unsigned owner, unsigned* division) {
+  int range;
+  unsigned low, high;
+
+  do {
+    range = SDL_AtomicGet(&division_deques[owner].range);
+    low = range & 0xFFFF;
+    high = ((unsigned)range) >> 16;
+    if (low >= high) return 0;
+  } while (!SDL_AtomicCAS(&division_deques[owner].range, range,
+                          (int)((high << 16) | (low+1))));
+
+  *division = low;
+  return 1;
+}
+
+/**
+ * Like deque_pop(), but removes the highest division instead. Thieves use
+ * this end so as to contend with the owner as little as possible.
+ */
+static int deque_steal(unsigned victim, unsigned* division) {
+  int range;
+  unsigned low, high;
+
+  do {
+    range = SDL_AtomicGet(&division_deques[victim].range);
+    low = range & 0xFFFF;
+    high = ((unsigned)range) >> 16;
+    if (low >= high) return 0;
+  } while (!SDL_AtomicCAS(&division_deques[victim].range, range,
+                          (int)(((high-1) << 16) | low)));
+
+  *division = high-1;
+  return 1;
+}
+
+/**
+ * Executes all divisions in the given deque, then, if may_steal is true,
+ * steals divisions from the other deques until none have anything left.
+ *
+ * Since deques only ever shrink once a task has started, a single pass over
+ * the other deques is sufficient to know that all work has been claimed.
+ */
+static void exec_stealing(unsigned owner, int may_steal) {
+  unsigned i, n, victim, division;
+  void (*exec)(unsigned,unsigned);
+
+  n = current_task->num_divisions;
+  exec = current_task->exec;
+
+  while (deque_pop(owner, &division))
+    exec_division(exec, division, n);
+
+  if (!may_steal) return;
+
+  /* Start with the next deque over so that thieves tend to spread out rather
+   * than all converging on the same victim.
+   */
+  for (i = 1; i <= num_workers; ++i) {
+    victim = (owner + i) % (num_workers + 1);
+    while (deque_steal(victim, &division))
+      exec_division(exec, division, n);
+  }
+}
+
+/**
+ * Tasks submitted via ump_submit() are held in a fixed table of slots. The
+ * task with id n lives in slot n % UMP_MAX_SUBMITTED_TASKS. Since ids are
+ * allocated sequentially, a slot is only reused by id n once id
+ * n-UMP_MAX_SUBMITTED_TASKS has completed, so a slot whose id differs from the
+ * one being queried always indicates that the queried task is done.
+ */
+typedef enum {
+  /* Completed, or never used */
+  ump_submitted_done = 0,
+  /* Has at least one incomplete dependency */
+  ump_submitted_waiting,
+  /* Has divisions which have not yet been claimed */
+  ump_submitted_runnable,
+  /* All divisions claimed, but some still executing */
+  ump_submitted_claimed
+} ump_submitted_state;
+
+typedef struct {
+  /* Written under the mutex before id is set */
+  void (*exec)(unsigned,unsigned);
+  unsigned num_divisions;
+  ump_task_id dependencies[UMP_MAX_DEPENDENCIES];
+  unsigned num_dependencies;
+
+  /* The id of the task currently or most recently in this slot. Always set
+   * before state when a slot is (re)used.
+   */
+  SDL_atomic_t id;
+  /* A ump_submitted_state */
+  SDL_atomic_t state;
+  /* The next division to be claimed in the lower 16 bits, and the
+   * "generation" of the slot (ie, the id divided by the number of slots) in
+   * the upper bits. Including the generation means that a thread which read a
+   * stale id can never claim a division of a later occupant of the slot.
+   */
+  SDL_atomic_t claim;
+  /* The number of divisions which have not yet finished executing */
+  SDL_atomic_t divisions_remaining;
+
+  volatile unsigned char padding[UMP_CACHE_LINE_SZ];
+} ump_submitted_task;
+
+static ump_submitted_task submitted_tasks[UMP_MAX_SUBMITTED_TASKS];
+/* Protected by mutex */
+static ump_task_id next_submitted_task_id = 1;
+/* The number of submitted tasks in the ump_submitted_runnable state */
+static SDL_atomic_t num_runnable_submitted_tasks;
+
+#define SUBMITTED_SLOT(id) (submitted_tasks + (id) % UMP_MAX_SUBMITTED_TASKS)
+#define SUBMITTED_GENERATION(id)                                \
+  ((int)(((id) / UMP_MAX_SUBMITTED_TASKS) & 0x7FFF) << 16)
+
+static int submitted_task_is_done(ump_task_id id) {
+  ump_submitted_task* slot = SUBMITTED_SLOT(id);
+
+  /* Order matters here; see the comment on the id field */
+  return !id ||
+    ump_submitted_done == SDL_AtomicGet(&slot->state) ||
+    id != (ump_task_id)SDL_AtomicGet(&slot->id);
+}
+
+static void complete_submitted_task_locked(ump_submitted_task*);
+
+/**
+ * Makes the given submitted task, which has no incomplete dependencies,
+ * available to workers. The mutex must be held.
+ */
+static void start_submitted_task_locked(ump_submitted_task* slot) {
+  if (!slot->num_divisions) {
+    complete_submitted_task_locked(slot);
+    return;
+  }
+
+  SDL_AtomicSet(&slot->claim,
+                SUBMITTED_GENERATION((ump_task_id)SDL_AtomicGet(&slot->id)));
+  SDL_AtomicSet(&slot->divisions_remaining, slot->num_divisions);
+  SDL_AtomicSet(&slot->state, ump_submitted_runnable);
+  SDL_AtomicAdd(&num_runnable_submitted_tasks, +1);
+
+  if (SDL_CondBroadcast(assignment_notification))
+    errx(EX_SOFTWARE, "Unable to broadcast assignment notification: %s",
+         SDL_GetError());
+}
+
+/**
+ * Marks the given submitted task as done, and starts any tasks which were
+ * only waiting on it. The mutex must be held.
+ */
+static void complete_submitted_task_locked(ump_submitted_task* slot) {
+  unsigned i, j;
+  ump_submitted_task* other;
+
+  SDL_AtomicSet(&slot->state, ump_submitted_done);
+
+  for (i = 0; i < UMP_MAX_SUBMITTED_TASKS; ++i) {
+    other = submitted_tasks + i;
+    if (ump_submitted_waiting != SDL_AtomicGet(&other->state)) continue;
+
+    for (j = 0; j < other->num_dependencies; ++j)
+      if (!submitted_task_is_done(other->dependencies[j]))
+        break;
+
+    if (j == other->num_dependencies)
+      start_submitted_task_locked(other);
+  }
+
+  if (SDL_CondBroadcast(completion_notification))
+    errx(EX_SOFTWARE, "Unable to broadcast completion notification: %s",
+         SDL_GetError());
+}
+
+/**
+ * Attempts to claim and execute one division of the given submitted task.
+ * Returns whether a division was executed.
+ */
+static int exec_submitted_division(ump_task_id id) {
+  ump_submitted_task* slot = SUBMITTED_SLOT(id);
+  void (*exec)(unsigned,unsigned);
+  unsigned n, division;
+  int claim;
+
+  if (ump_submitted_runnable != SDL_AtomicGet(&slot->state) ||
+      id != (ump_task_id)SDL_AtomicGet(&slot->id))
+    return 0;
+
+  exec = slot->exec;
+  n = slot->num_divisions;
+
+  do {
+    claim = SDL_AtomicGet(&slot->claim);
+    if ((claim & ~0xFFFF) != SUBMITTED_GENERATION(id)) return 0;
+    division = claim & 0xFFFF;
+    if (division >= n) return 0;
+  } while (!SDL_AtomicCAS(&slot->claim, claim, claim+1));
+
+  if (division == n-1) {
+    /* We claimed the last division, so nobody else needs to look at this
+     * task anymore.
+     */
+    SDL_AtomicSet(&slot->state, ump_submitted_claimed);
+    SDL_AtomicAdd(&num_runnable_submitted_tasks, -1);
+  }
+
+  exec_division(exec, division, n);
+
+  if (1 == SDL_AtomicAdd(&slot->divisions_remaining, -1)) {
+    if (SDL_LockMutex(mutex))
+      errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+
+    complete_submitted_task_locked(slot);
+
+    if (SDL_UnlockMutex(mutex))
+      errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
+  }
+
+  return 1;
+}
+
+/**
+ * Executes divisions of runnable submitted tasks until there are none left or
+ * until the current task id differs from prev_task.
+ */
+static void exec_submitted_tasks(int prev_task) {
+  unsigned i;
+  int did_anything;
+
+  do {
+    did_anything = 0;
+    for (i = 0; i < UMP_MAX_SUBMITTED_TASKS; ++i) {
+      if (prev_task != SDL_AtomicGet(&current_task_id))
+        return;
+
+      while (exec_submitted_division(
+               (ump_task_id)SDL_AtomicGet(&submitted_tasks[i].id))) {
+        did_anything = 1;
+        if (prev_task != SDL_AtomicGet(&current_task_id))
+          return;
+      }
+    }
+  } while (did_anything);
+}
+
+/**
+ * Executes the share of the current task belonging to the given worker.
+ */
+static void exec_worker_share(unsigned effective_id) {
+  unsigned lower_bound, upper_bound;
+
+  if (current_task_is_stealing) {
+    /* Our divisions are already in our deque */
+    exec_stealing(effective_id, 1);
+  } else {
+    worker_region(&lower_bound, &upper_bound, effective_id, num_workers);
+    exec_region(lower_bound, upper_bound);
+  }
+}
+
+#ifdef UMP_VERBOSE_TIMING
+static unsigned micros_since(Uint64 then) {
+  return (unsigned)((SDL_GetPerformanceCounter() - then) * 1000000 /
+                    SDL_GetPerformanceFrequency());
+}
+#endif
+
+/**
+ * Marks one worker's share of the current task as complete, waking any
+ * parked joiner if that was the last one.
+ */
+static void finish_worker_share(void) {
+  if (1 == SDL_AtomicAdd(&num_busy_workers, -1)) {
+#ifdef UMP_VERBOSE_TIMING
+    completion_time = SDL_GetPerformanceCounter();
+#endif
+
+    if (SDL_AtomicGet(&num_parked_joiners)) {
+      if (SDL_LockMutex(mutex))
+        errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+
+      if (SDL_CondBroadcast(completion_notification))
+        errx(EX_SOFTWARE, "Unable to broadcast completion notification: %s",
+             SDL_GetError());
+
+      if (SDL_UnlockMutex(mutex))
+        errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
+    }
+  }
+}
+
+/**
+ * Polls for a new task assignment or runnable submitted tasks for up to
+ * spin_budget_ticks, without touching the mutex. Returns whether anything
+ * turned up.
+ */
+static int spin_for_assignment(int prev_task) {
+  Uint64 budget = spin_budget_ticks, deadline;
+
+  if (!budget) return 0;
+
+  deadline = SDL_GetPerformanceCounter() + budget;
+  do {
+    if (prev_task != SDL_AtomicGet(&current_task_id) ||
+        SDL_AtomicGet(&num_runnable_submitted_tasks))
+      return 1;
+
+    SPIN_PAUSE();
+  } while (SDL_GetPerformanceCounter() < deadline);
+
+  return 0;
+}
+
+/**
+ * The maximum number of logical CPUs considered when laying out threads.
+ */
+#define UMP_MAX_CPUS 1024
+/**
+ * The number of entries at the head of cpu_layout which are reserved for
+ * threads other than the workers (see ump_pin_reserved_thread()).
+ */
+#define UMP_NUM_RESERVED_CPUS 2
+
+/**
+ * The logical CPUs to which threads are pinned, in order of preference. The
+ * first UMP_NUM_RESERVED_CPUS are reserved for the GL and rendering threads;
+ * worker n is pinned to element UMP_NUM_RESERVED_CPUS+n (wrapping around the
+ * unreserved elements if there are more workers than CPUs). If there are no
+ * unreserved elements, workers are not pinned at all, rather than being
+ * stacked onto the reserved CPUs.
+ *
+ * When the topology is known, this starts with one logical CPU from each
+ * physical core, grouped by NUMA node and package, followed by the remaining
+ * SMT siblings. This way, workers only end up sharing a physical core with
+ * each other or the reserved threads if there are more threads than cores.
+ */
+static unsigned cpu_layout[UMP_MAX_CPUS];
+static unsigned cpu_layout_len;
+/**
+ * The number of elements at the head of cpu_layout which are on distinct
+ * physical cores.
+ */
+static unsigned cpu_layout_num_cores;
+static int cpu_layout_pin, cpu_layout_initialised;
+
+/**
+ * Parses a Linux-style CPU list (eg, "0-3,8,10-11") into dst, which has room
+ * for max elements. Returns the number of CPUs parsed, or -1 if the string is
+ * malformed.
+ */
+static signed parse_cpu_list(unsigned* dst, unsigned max, const char* str) {
+  unsigned n = 0, low, high;
+  char* end;
+
+  while (*str && '\n' != *str) {
+    low = high = strtoul(str, &end, 10);
+    if (end == str) return -1;
+    str = end;
+
+    if ('-' == *str) {
+      ++str;
+      high = strtoul(str, &end, 10);
+      if (end == str || high < low) return -1;
+      str = end;
+    }
+
+    for (; low <= high && n < max; ++low)
+      dst[n++] = low;
+
+    if (',' == *str)
+      ++str;
+    else if (*str && '\n' != *str)
+      return -1;
+  }
+
+  return n;
+}
+
+#ifdef USE_PTHREAD_SETAFFINITY_NP
+typedef struct {
+  unsigned cpu;
+  signed node, package, core;
+} ump_cpu_info;
+
+static signed read_sys_int(const char* path) {
+  FILE* in;
+  signed value;
+
+  in = fopen(path, "r");
+  if (!in) return -1;
+  if (1 != fscanf(in, "%d", &value)) value = -1;
+  fclose(in);
+  return value;
+}
+
+static int compare_cpu_info(const void* va, const void* vb) {
+  const ump_cpu_info* a = va, * b = vb;
+
+  if (a->node != b->node) return a->node < b->node? -1 : +1;
+  if (a->package != b->package) return a->package < b->package? -1 : +1;
+  if (a->core != b->core) return a->core < b->core? -1 : +1;
+  return a->cpu < b->cpu? -1 : a->cpu > b->cpu;
+}
+
+/**
+ * Populates cpu_layout from the topology Linux exposes under /sys, limited to
+ * the CPUs this process is permitted to run on. Returns whether anything was
+ * found.
+ */
+static int detect_linux_topology(void) {
+  static ump_cpu_info infos[UMP_MAX_CPUS];
+  static unsigned node_cpus[UMP_MAX_CPUS];
+  char path[128], list[4096];
+  cpu_set_t allowed;
+  FILE* in;
+  unsigned cpu, node, i, j, n = 0;
+  signed node_cpus_len;
+
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+
+  for (cpu = 0; cpu < UMP_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed)) continue;
+
+    infos[n].cpu = cpu;
+    infos[n].node = 0;
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%u/topology/physical_package_id",
+             cpu);
+    infos[n].package = read_sys_int(path);
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+    infos[n].core = read_sys_int(path);
+    if (infos[n].core < 0) {
+      /* Topology unknown; assume every CPU is its own core */
+      infos[n].package = 0;
+      infos[n].core = cpu;
+    }
+    ++n;
+  }
+
+  if (!n) return 0;
+
+  /* Node IDs can be sparse, but there are never more nodes than CPUs */
+  for (node = 0; node < UMP_MAX_CPUS; ++node) {
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/node/node%u/cpulist", node);
+    in = fopen(path, "r");
+    if (!in) continue;
+    if (!fgets(list, sizeof(list), in)) list[0] = 0;
+    fclose(in);
+
+    node_cpus_len = parse_cpu_list(node_cpus, UMP_MAX_CPUS, list);
+    for (i = 0; node_cpus_len > 0 && i < (unsigned)node_cpus_len; ++i)
+      for (j = 0; j < n; ++j)
+        if (node_cpus[i] == infos[j].cpu)
+          infos[j].node = node;
+  }
+
+  qsort(infos, n, sizeof(ump_cpu_info), compare_cpu_info);
+
+  /* First pass: the first logical CPU of every physical core */
+  cpu_layout_len = 0;
+  for (i = 0; i < n; ++i)
+    if (!i || infos[i].node != infos[i-1].node ||
+        infos[i].package != infos[i-1].package ||
+        infos[i].core != infos[i-1].core)
+      cpu_layout[cpu_layout_len++] = infos[i].cpu;
+
+  cpu_layout_num_cores = cpu_layout_len;
+
+  /* Second pass: the SMT siblings */
+  for (i = 1; i < n; ++i)
+    if (infos[i].node == infos[i-1].node &&
+        infos[i].package == infos[i-1].package &&
+        infos[i].core == infos[i-1].core)
+      cpu_layout[cpu_layout_len++] = infos[i].cpu;
+
+  return 1;
+}
+#endif /* USE_PTHREAD_SETAFFINITY_NP */
+
+/**
+ * Determines cpu_layout, if not already done.
+ *
+ * The layout can be overridden with the UMP_CPUS environment variable, which
+ * is either a CPU list as accepted by parse_cpu_list(), whose first
+ * UMP_NUM_RESERVED_CPUS elements are used for the reserved threads and the
+ * rest for one worker each, or the string "none" to disable pinning
+ * entirely.
+ */
+static void init_cpu_layout(void) {
+  const char* override;
+  signed n;
+  unsigned i;
+
+  if (cpu_layout_initialised) return;
+  cpu_layout_initialised = 1;
+
+#if defined(USE_BSD_CPUSET_SETAFFINITY) || defined(USE_PTHREAD_SETAFFINITY_NP)
+  cpu_layout_pin = 1;
+#endif
+
+  override = getenv("UMP_CPUS");
+  if (override && !strcmp(override, "none")) {
+    cpu_layout_pin = 0;
+  } else if (override && *override) {
+    n = parse_cpu_list(cpu_layout, UMP_MAX_CPUS, override);
+    if (n > 0) {
+      cpu_layout_len = cpu_layout_num_cores = n;
+      return;
+    }
+
+    warnx("Ignoring malformed UMP_CPUS: \"%s\"", override);
+  }
+
+#ifdef USE_PTHREAD_SETAFFINITY_NP
+  if (detect_linux_topology()) return;
+#endif
+
+  /* No topology information; assume each CPU is a distinct core */
+  n = SDL_GetCPUCount();
+  if (n < 1) n = 1;
+  if (n > UMP_MAX_CPUS) n = UMP_MAX_CPUS;
+  for (i = 0; i < (unsigned)n; ++i)
+    cpu_layout[i] = i;
+  cpu_layout_len = cpu_layout_num_cores = n;
+}
+
+/**
+ * Pins the calling thread to the CPU at the given index in cpu_layout,
+ * wrapping around if necessary.
+ */
+static void pin_to_layout(unsigned ix, const char* thread_name) {
 #ifdef USE_BSD_CPUSET_SETAFFINITY
   cpuset_t affinity;
 #endif
-  ump_thread_spec spec;
-  unsigned effective_id;
-  unsigned work_amt, work_offset;
-  unsigned lower_bound, upper_bound, n;
-  int prev_task = 0;
-#ifdef UMP_VERBOSE_TIMING
-  unsigned received, completed;
+#ifdef USE_PTHREAD_SETAFFINITY_NP
+  cpu_set_t affinity;
+  int error;
 #endif
+  unsigned cpu;
 
-  memcpy(&spec, vspec, sizeof(spec));
+  init_cpu_layout();
+  if (!cpu_layout_pin) return;
+
+  cpu = cpu_layout[ix % cpu_layout_len];
 
 #ifdef USE_BSD_CPUSET_SETAFFINITY
-  /* Pin self to CPU n+1 */
   CPU_ZERO(&affinity);
-  CPU_SET(spec.ordinal+1, &affinity);
+  CPU_SET(cpu, &affinity);
   if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1 /* self */,
                          sizeof(affinity), &affinity))
-    warn("Unable to set affinity for uMP thread %d", spec.ordinal);
+    warn("Unable to set affinity for %s to CPU %d", thread_name, cpu);
 #endif
 
-  if (SDL_LockMutex(mutex))
-    errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+#ifdef USE_PTHREAD_SETAFFINITY_NP
+  CPU_ZERO(&affinity);
+  CPU_SET(cpu, &affinity);
+  if ((error = pthread_setaffinity_np(pthread_self(),
+                                      sizeof(affinity), &affinity)))
+    warnx("Unable to set affinity for %s to CPU %d: %s",
+          thread_name, cpu, strerror(error));
+#endif
 
-  while (1) {
-    /* Mutex locked at this point */
+  (void)cpu;
+  (void)thread_name;
+}
 
+static int ump_main(void* vspec) {
+  ump_thread_spec spec;
+  unsigned effective_id;
+  int prev_task = 0;
+  char thread_name[32];
+#ifdef UMP_VERBOSE_TIMING
+  unsigned received, completed;
+#endif
+
+  memcpy(&spec, vspec, sizeof(spec));
+
+  snprintf(thread_name, sizeof(thread_name), "uMP thread %d", spec.ordinal);
+  init_cpu_layout();
+  if (cpu_layout_len > UMP_NUM_RESERVED_CPUS)
+    pin_to_layout(UMP_NUM_RESERVED_CPUS +
+                  spec.ordinal % (cpu_layout_len - UMP_NUM_RESERVED_CPUS),
+                  thread_name);
+  trace_set_thread_name(thread_name);
+
+  while (1) {
     /* Cease impersonation */
     effective_id = spec.ordinal;
 
-    /* Wait for assignment */
-    while (prev_task == SDL_AtomicGet(&current_task_id)) {
-      if (SDL_CondWait(assignment_notification, mutex))
-        errx(EX_SOFTWARE, "Unable to wait on condition: %s", SDL_GetError());
+    /* Tasks tend to come in bursts within a frame, so poll for a while
+     * before going to sleep; waking from a condition variable costs far more
+     * than the typical gap between two tasks. If something turns up, the
+     * mutex is never touched; the master only needs it to wake parked
+     * workers.
+     */
+    if (spin_for_assignment(prev_task)) {
+      if (prev_task == SDL_AtomicGet(&current_task_id)) {
+        /* Only submitted work arrived; do it and go back to waiting */
+        exec_submitted_tasks(prev_task);
+        continue;
+      }
+    } else {
+      if (SDL_LockMutex(mutex))
+        errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+
+      /* Wait for assignment, working on submitted tasks meanwhile */
+      while (prev_task == SDL_AtomicGet(&current_task_id)) {
+        if (SDL_AtomicGet(&num_runnable_submitted_tasks)) {
+          if (SDL_UnlockMutex(mutex))
+            errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
+
+          exec_submitted_tasks(prev_task);
+
+          if (SDL_LockMutex(mutex))
+            errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+        } else {
+          /* Announce intent to sleep, then check once more, since the
+           * master does not broadcast if it sees nobody parked.
+           */
+          SDL_AtomicAdd(&num_parked_workers, +1);
+          if (prev_task == SDL_AtomicGet(&current_task_id) &&
+              !SDL_AtomicGet(&num_runnable_submitted_tasks) &&
+              SDL_CondWait(assignment_notification, mutex))
+            errx(EX_SOFTWARE, "Unable to wait on condition: %s",
+                 SDL_GetError());
+          SDL_AtomicAdd(&num_parked_workers, -1);
+        }
+      }
+
+      if (SDL_UnlockMutex(mutex))
+        errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
     }
 
     prev_task = SDL_AtomicGet(&current_task_id);
 
-    /* Try to take ownership of this task.
-     * This needs to be within the mutex lock, since it can jump back to the
-     * beginning of the loop. But we can't assume that the mutex protects our
-     * accepted_task_ids slot, since impersonators will write to it without
-     * holding the mutex.
+    /* Try to take ownership of this task. We can't assume that the mutex
+     * protects our accepted_task_ids slot, since impersonators will write to
+     * it without holding the mutex.
      */
     if (!SDL_AtomicCAS(accepted_task_ids+spec.ordinal, prev_task-1, prev_task))
       /* Somebody has impersonated us meanwhile */
       continue;
 
-    if (SDL_UnlockMutex(mutex))
-      errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
-
     process_task:
 
 #ifdef UMP_VERBOSE_TIMING
-    received = SDL_GetTicks();
-    printf("uMP thread %d: Got task at %d\n", spec.ordinal, received);
+    received = micros_since(dispatch_time);
+    printf("uMP thread %d: Got task %d after %u us\n",
+           spec.ordinal, prev_task, received);
 #endif
 
-    /* Calculate work boundaries */
-    n = current_task->num_divisions;
-    if (current_task_is_sync)
-      /* Master gets a fair share of work */
-      work_offset = n / (1 + spec.count);
-    else
-      /* Master gets specific unfair amount of work */
-      work_offset = current_task->divisions_for_master;
-
-    work_amt = n - work_offset;
-
-    lower_bound = work_offset + effective_id * work_amt / spec.count;
-    upper_bound = work_offset + (effective_id+1) * work_amt / spec.count;
-
-    exec_region(lower_bound, upper_bound);
+    exec_worker_share(effective_id);
 
 #ifdef UMP_VERBOSE_TIMING
-    completed = SDL_GetTicks();
-    printf("uMP thread %d: Task completed at %d (delta %d)\n",
-           spec.ordinal, completed, completed - received);
+    completed = micros_since(dispatch_time);
+    printf("uMP thread %d: Task %d completed after %u us (delta %u us)\n",
+           spec.ordinal, prev_task, completed, completed - received);
 #endif
 
-    SDL_AtomicAdd(&num_busy_workers, -1);
+    finish_worker_share();
 
     /* See if any other threads need be impersonated */
     for (effective_id = 0; effective_id < num_workers; ++effective_id)
       if (SDL_AtomicCAS(accepted_task_ids+effective_id, prev_task-1, prev_task))
         /* Ownership taken. Impersonate this thread. */
         goto process_task;
-
-    /* Done. Notify of completion and go back to waiting for assignment */
-    if (SDL_LockMutex(mutex))
-      errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
-
-    if (SDL_CondBroadcast(completion_notification))
-      errx(EX_SOFTWARE, "Unable to broadcast completion notification: %s",
-           SDL_GetError());
-
-    /* Leave mutex locked as loop entrance needs it */
   }
 }
 
 void ump_init(unsigned num_threads) {
   unsigned i;
   char thread_name[32];
-#ifdef USE_BSD_CPUSET_SETAFFINITY
-  cpuset_t affinity;
-#endif
+  const char* spin_override;
+  char* end;
+
+  init_cpu_layout();
 
   if (num_threads < 1)
     num_threads = 1;
@@ -213,19 +909,27 @@ void ump_init(unsigned num_threads) {
 
   num_workers = num_threads;
 
+  /* Spinning only pays off if every spinner has a CPU to itself; otherwise
+   * it just delays whoever would do the actual work.
+   */
+  if (num_workers + UMP_NUM_RESERVED_CPUS > cpu_layout_len)
+    spin_budget = 0;
+
+  spin_override = getenv("UMP_SPIN");
+  if (spin_override && *spin_override) {
+    i = strtoul(spin_override, &end, 0);
+    if (*end)
+      warnx("Ignoring malformed UMP_SPIN: \"%s\"", spin_override);
+    else
+      spin_budget = i;
+  }
+
+  ump_set_spin_budget(spin_budget);
+
 #ifdef UMP_NO_THREADING
   return;
 #endif
 
-#ifdef USE_BSD_CPUSET_SETAFFINITY
-  /* Pin main thread to CPU 0 */
-  CPU_ZERO(&affinity);
-  CPU_SET(0, &affinity);
-  if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
-                         sizeof(affinity), &affinity))
-    warn("Unable to set CPU affinity of main thread");
-#endif
-
   if (!(completion_notification = SDL_CreateCond()))
     errx(EX_SOFTWARE, "Unable to create completion cond: %s", SDL_GetError());
 
@@ -245,6 +949,10 @@ void ump_init(unsigned num_threads) {
 }
 
 static void ump_run(ump_task* task, int sync) {
+#ifndef UMP_NO_THREADING
+  unsigned i, lower_bound, upper_bound, master_share;
+#endif
+
   ump_join();
 
 #ifdef UMP_NO_THREADING
@@ -252,29 +960,75 @@ static void ump_run(ump_task* task, int sync) {
   current_task = task;
   exec_region(0, task->num_divisions);
 #else
-  if (SDL_LockMutex(mutex))
-    errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
-
+  /* The caller may have reduced num_divisions since divisions_for_master was
+   * last adjusted.
+   */
+  if (task->divisions_for_master > task->num_divisions)
+    task->divisions_for_master = task->num_divisions;
+
+  if (sync)
+    master_share = task->num_divisions / (num_workers+1);
+  else
+    master_share = task->divisions_for_master;
+
+  /* No lock is needed to publish the task, since no worker looks at any of
+   * this until it sees current_task_id change, and the atomic increment
+   * thereof is a full barrier.
+   */
   current_task_is_sync = sync;
   current_task = task;
+  current_task_is_stealing = task->work_stealing &&
+    task->num_divisions <= UMP_MAX_STEALABLE_DIVISIONS;
+
+  /* All deques must be populated before any thread can see the task, since
+   * thieves will otherwise conclude that there is no work left.
+   */
+  if (current_task_is_stealing) {
+    deque_init(num_workers, 0, master_share);
+    for (i = 0; i < num_workers; ++i) {
+      worker_region(&lower_bound, &upper_bound, i, num_workers);
+      deque_init(i, lower_bound, upper_bound);
+    }
+  }
+
+#ifdef UMP_VERBOSE_TIMING
+  dispatch_time = SDL_GetPerformanceCounter();
+#endif
+
   SDL_AtomicAdd(&num_busy_workers, +num_workers);
   SDL_AtomicAdd(&current_task_id, +1);
 
-  if (SDL_CondBroadcast(assignment_notification))
-    errx(EX_SOFTWARE, "Unable to broadcast assignment notification: %s",
-         SDL_GetError());
+  /* Workers still spinning will see the new task ID by themselves; only
+   * those which have given up and parked need to be woken.
+   */
+  if (SDL_AtomicGet(&num_parked_workers)) {
+    if (SDL_LockMutex(mutex))
+      errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
 
-  if (SDL_UnlockMutex(mutex))
-    errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
+    if (SDL_CondBroadcast(assignment_notification))
+      errx(EX_SOFTWARE, "Unable to broadcast assignment notification: %s",
+           SDL_GetError());
+
+    if (SDL_UnlockMutex(mutex))
+      errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
+  }
 
   if (sync) {
-    /* Execute the master's fair share */
-    exec_region(0, task->num_divisions / (num_workers+1));
+    /* Execute the master's fair share, then help the others if stealing */
+    if (current_task_is_stealing)
+      exec_stealing(num_workers, 1);
+    else
+      exec_region(0, master_share);
     /* Wait for others */
     ump_join();
   } else {
-    /* Execute requested amount */
-    exec_region(0, task->divisions_for_master);
+    /* Execute requested amount. Never steal here, since the whole point of
+     * an async call is to return as soon as possible.
+     */
+    if (current_task_is_stealing)
+      exec_stealing(num_workers, 0);
+    else
+      exec_region(0, master_share);
     /* Don't wait, return now */
   }
 #endif
@@ -294,20 +1048,60 @@ void ump_join(void) {
   return;
 #else
   int done_early = !SDL_AtomicGet(&num_busy_workers);
+  int task_id;
+  unsigned i;
+  Uint64 spin_deadline;
+#ifdef UMP_VERBOSE_TIMING
+  Uint64 join_start = SDL_GetPerformanceCounter();
+#endif
 
   if (!done_early) {
+    /* Workers may be tied up in long divisions of submitted tasks (or simply
+     * not have been scheduled yet). Rather than idling, impersonate any which
+     * have not accepted the current task yet, just like the workers do.
+     */
+    if (current_task) {
+      task_id = SDL_AtomicGet(&current_task_id);
+      for (i = 0; i < num_workers; ++i) {
+        if (SDL_AtomicCAS(accepted_task_ids+i, task_id-1, task_id)) {
+          exec_worker_share(i);
+          finish_worker_share();
+        }
+      }
+    }
+
+    /* The others are usually nearly done at this point, so poll for a while
+     * before resorting to the condition variable.
+     */
+    spin_deadline = SDL_GetPerformanceCounter() + spin_budget_ticks;
+    while (SDL_AtomicGet(&num_busy_workers) &&
+           SDL_GetPerformanceCounter() < spin_deadline)
+      SPIN_PAUSE();
+
     /* Need to wait for others */
-    if (SDL_LockMutex(mutex))
-      errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+    if (SDL_AtomicGet(&num_busy_workers)) {
+      if (SDL_LockMutex(mutex))
+        errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+
+      SDL_AtomicAdd(&num_parked_joiners, +1);
+      while (SDL_AtomicGet(&num_busy_workers)) {
+        if (SDL_CondWait(completion_notification, mutex))
+          errx(EX_SOFTWARE, "Unable to wait on completion cond: %s",
+               SDL_GetError());
+      }
+      SDL_AtomicAdd(&num_parked_joiners, -1);
 
-    while (SDL_AtomicGet(&num_busy_workers)) {
-      if (SDL_CondWait(completion_notification, mutex))
-        errx(EX_SOFTWARE, "Unable to wait on completion cond: %s",
-             SDL_GetError());
+      if (SDL_UnlockMutex(mutex))
+        errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
     }
 
-    if (SDL_UnlockMutex(mutex))
-      errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
+#ifdef UMP_VERBOSE_TIMING
+    if (current_task)
+      printf("uMP master: Task %d joined after waiting %u us, "
+             "%u us after completion\n",
+             SDL_AtomicGet(&current_task_id), micros_since(join_start),
+             micros_since(completion_time));
+#endif
   }
 
   /* If this was async, adjust distribution for master */
@@ -351,6 +1145,119 @@ unsigned ump_num_workers(void) {
   return num_workers;
 }
 
+void ump_set_spin_budget(unsigned micros) {
+  spin_budget = micros;
+  spin_budget_ticks =
+    (Uint64)micros * SDL_GetPerformanceFrequency() / 1000000;
+}
+
+unsigned ump_recommended_num_workers(void) {
+  init_cpu_layout();
+
+  if (cpu_layout_num_cores > UMP_NUM_RESERVED_CPUS + 1)
+    return cpu_layout_num_cores - UMP_NUM_RESERVED_CPUS;
+  else
+    return 1;
+}
+
+void ump_pin_reserved_thread(unsigned which) {
+  assert(which < UMP_NUM_RESERVED_CPUS);
+
+  pin_to_layout(which, UMP_RESERVED_GL == which?
+                "GL thread" : "rendering thread");
+}
+
+ump_task_id ump_submit(const ump_task* task,
+                       const ump_task_id* dependencies,
+                       unsigned num_dependencies) {
+  ump_task_id id;
+  unsigned i;
+#ifndef UMP_NO_THREADING
+  ump_task_id prev_id;
+  ump_submitted_task* slot;
+#endif
+
+  assert(num_dependencies <= UMP_MAX_DEPENDENCIES);
+  assert(task->num_divisions <= UMP_MAX_SUBMITTED_DIVISIONS);
+
+#ifdef UMP_NO_THREADING
+  /* Dependencies are always complete, since everything is synchronous */
+  for (i = 0; i < task->num_divisions; ++i)
+    (*task->exec)(i, task->num_divisions);
+
+  id = next_submitted_task_id++;
+  if (!next_submitted_task_id) next_submitted_task_id = 1;
+  return id;
+#else
+  if (SDL_LockMutex(mutex))
+    errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+
+  id = next_submitted_task_id++;
+  if (!next_submitted_task_id) next_submitted_task_id = 1;
+  slot = SUBMITTED_SLOT(id);
+
+  /* If the slot's previous occupant is still running, we have too many tasks
+   * in flight. Wait for it to complete. We must wait for exactly that
+   * occupant, and not merely for the slot to be free, so that slots are
+   * always reused in id order.
+   */
+  prev_id = id >= UMP_MAX_SUBMITTED_TASKS? id - UMP_MAX_SUBMITTED_TASKS : 0;
+  while (prev_id != (ump_task_id)SDL_AtomicGet(&slot->id) ||
+         ump_submitted_done != SDL_AtomicGet(&slot->state)) {
+    if (SDL_CondWait(completion_notification, mutex))
+      errx(EX_SOFTWARE, "Unable to wait on completion cond: %s",
+           SDL_GetError());
+  }
+
+  slot->exec = task->exec;
+  slot->num_divisions = task->num_divisions;
+  slot->num_dependencies = 0;
+  for (i = 0; i < num_dependencies; ++i)
+    if (!submitted_task_is_done(dependencies[i]))
+      slot->dependencies[slot->num_dependencies++] = dependencies[i];
+
+  SDL_AtomicSet(&slot->id, (int)id);
+
+  if (slot->num_dependencies)
+    SDL_AtomicSet(&slot->state, ump_submitted_waiting);
+  else
+    start_submitted_task_locked(slot);
+
+  if (SDL_UnlockMutex(mutex))
+    errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
+
+  return id;
+#endif
+}
+
+void ump_wait(ump_task_id id) {
+#ifndef UMP_NO_THREADING
+  /* Help out while there's anything left to claim */
+  while (exec_submitted_division(id));
+
+  if (submitted_task_is_done(id)) return;
+
+  if (SDL_LockMutex(mutex))
+    errx(EX_SOFTWARE, "Unable to lock mutex: %s", SDL_GetError());
+
+  while (!submitted_task_is_done(id))
+    if (SDL_CondWait(completion_notification, mutex))
+      errx(EX_SOFTWARE, "Unable to wait on completion cond: %s",
+           SDL_GetError());
+
+  if (SDL_UnlockMutex(mutex))
+    errx(EX_SOFTWARE, "Unable to unlock mutex: %s", SDL_GetError());
+#endif
+}
+
+int ump_is_done(ump_task_id id) {
+#ifdef UMP_NO_THREADING
+  return 1;
+#else
+  return submitted_task_is_done(id);
+#endif
+}
+
 void* align_to_cache_line(void* vinput) {
   char* input = vinput;
   unsigned long long as_int;
@@ -88,13 +88,88 @@ typedef struct {
    * This value has no effect for sync calls.
    */
   unsigned divisions_for_master;
+  /**
+   * If non-zero, the divisions of this task are load-balanced by work
+   * stealing. Each thread starts with the same contiguous range of divisions
+   * it would otherwise be statically assigned, but places them in a
+   * lock-free per-thread deque; a thread which exhausts its own deque steals
+   * single divisions from the far end of the deques of other threads until no
+   * work remains anywhere.
+   *
+   * This should be used for tasks whose divisions have highly variable cost.
+   * Tasks for which every division costs about the same should leave this
+   * off, since stealing costs an atomic operation per division.
+   *
+   * The master thread never does more work than it otherwise would have
+   * before an async call returns; it only steals during sync calls, after
+   * completing its own share.
+   *
+   * Work stealing is silently disabled for tasks with more than
+   * UMP_MAX_STEALABLE_DIVISIONS divisions.
+   */
+  int work_stealing;
 } ump_task;
 
+/**
+ * The maximum value of num_divisions for which work stealing can be used.
+ */
+#define UMP_MAX_STEALABLE_DIVISIONS 0x7FFF
+
 /**
  * Starts the given number of background worker threads and otherwise
  * initialises uMP. If anything goes wrong, the program exits.
+ *
+ * Where the platform supports it, each worker is pinned to its own CPU,
+ * preferring distinct physical cores and avoiding the CPUs reserved by
+ * ump_pin_reserved_thread(). The layout can be overridden by setting the
+ * UMP_CPUS environment variable to a CPU list such as "0,2,4-7", the first
+ * two entries of which are reserved for the GL and rendering threads, or to
+ * "none" to disable pinning.
  */
 void ump_init(unsigned num_threads);
+/**
+ * The default time, in microseconds, for which threads poll before parking
+ * when waiting for a task assignment or completion.
+ *
+ * This is a time rather than an iteration count because the cost of the
+ * pause instruction in the polling loop varies by an order of magnitude
+ * between CPUs (about 140 cycles on Skylake and later, versus about 10 on
+ * earlier Intel cores).
+ */
+#define UMP_DEFAULT_SPIN_BUDGET 100
+/**
+ * Sets the time, in microseconds, for which idle workers poll for a new task,
+ * and the master polls for completion in ump_join(), before falling back to
+ * sleeping on a condition variable. Higher values cut dispatch and join
+ * latency at the cost of burning CPU while idle; 0 makes every wait sleep
+ * immediately.
+ *
+ * The initial value is UMP_DEFAULT_SPIN_BUDGET, or 0 if there are fewer CPUs
+ * than threads, and can be overridden with the UMP_SPIN environment variable.
+ */
+void ump_set_spin_budget(unsigned);
+/**
+ * Returns the number of worker threads to pass to ump_init() for this host,
+ * ie, one per physical core not reserved for the GL or rendering threads (or
+ * one per remaining UMP_CPUS entry), but at least one.
+ */
+unsigned ump_recommended_num_workers(void);
+
+/**
+ * Identifies the CPU reserved for the thread which owns the OpenGL context.
+ */
+#define UMP_RESERVED_GL 0
+/**
+ * Identifies the CPU reserved for the thread which drives rendering and acts
+ * as the uMP master.
+ */
+#define UMP_RESERVED_RENDER 1
+/**
+ * Pins the calling thread to the CPU reserved for the given purpose (one of
+ * the UMP_RESERVED_* constants), so that uMP workers never compete with it
+ * for a core. Does nothing if pinning is unsupported or disabled.
+ */
+void ump_pin_reserved_thread(unsigned which);
 /**
  * Executes the given task synchronously. The calling thread will perform a
  * share of work equal to the other workers. When this call returns, the task
@@ -126,6 +201,74 @@ int ump_is_finished(void);
  */
 unsigned ump_num_workers(void);
 
+/**
+ * Identifies a task submitted with ump_submit(). Zero is never returned by
+ * ump_submit(), and so may be used to mean "no task".
+ */
+typedef unsigned ump_task_id;
+
+/**
+ * The maximum number of submitted tasks which may be incomplete at any one
+ * time. ump_submit() blocks if it would exceed this.
+ */
+#define UMP_MAX_SUBMITTED_TASKS 64
+/**
+ * The maximum number of dependencies that can be passed to ump_submit().
+ */
+#define UMP_MAX_DEPENDENCIES 8
+/**
+ * The maximum value of num_divisions for tasks passed to ump_submit().
+ */
+#define UMP_MAX_SUBMITTED_DIVISIONS 0xFFFF
+
+/**
+ * Submits the given task for execution once all of the given dependencies
+ * have completed, and returns immediately without doing any work on the
+ * calling thread.
+ *
+ * Unlike ump_run_sync() and ump_run_async(), this does not join the current
+ * task, and any number of submitted tasks (up to UMP_MAX_SUBMITTED_TASKS) may
+ * be in flight at once, concurrently with each other and with the current
+ * task. This allows independent stages to overlap instead of idling workers
+ * while waiting for stragglers.
+ *
+ * Divisions of submitted tasks are claimed one at a time by whichever worker
+ * gets to them first, so divisions_for_master and work_stealing are ignored.
+ * Workers always prefer the current task (as per ump_run_sync() and
+ * ump_run_async()) over submitted tasks, though a worker will not abandon a
+ * division of a submitted task it has already started.
+ *
+ * The exec function and num_divisions are copied out of the task, so the
+ * task itself need not remain valid after this call returns. num_divisions
+ * may not exceed UMP_MAX_SUBMITTED_DIVISIONS.
+ *
+ * This is not safe to call from within uMP tasks.
+ *
+ * @param task The task to execute.
+ * @param dependencies Tasks which must complete before any division of this
+ * task is started. Zero ids and ids of tasks which have already completed are
+ * ignored. May be NULL if num_dependencies is 0.
+ * @param num_dependencies The length of dependencies, at most
+ * UMP_MAX_DEPENDENCIES.
+ * @return The id of the new task.
+ */
+ump_task_id ump_submit(const ump_task* task,
+                       const ump_task_id* dependencies,
+                       unsigned num_dependencies);
+/**
+ * Blocks the calling thread until the given submitted task has completed. The
+ * calling thread helps to execute the task while any of its divisions remain
+ * unclaimed. Does nothing if the id is zero.
+ *
+ * This does not wait for the current task; use ump_join() for that.
+ */
+void ump_wait(ump_task_id);
+/**
+ * Returns whether the given submitted task has completed, without blocking.
+ * Always returns 1 for a zero id.
+ */
+int ump_is_done(ump_task_id);
+
 /**
  * Returns a pointer such that:
  *   ret >= input
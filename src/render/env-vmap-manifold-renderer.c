@@ -40,6 +40,7 @@
 #include "../alloc.h"
 #include "../defs.h"
 #include "../micromp.h"
+#include "../trace.h"
 #include "../math/coords.h"
 #include "../math/sse.h"
 #include "../math/rand.h"
@@ -56,17 +57,31 @@
 #define MHIVE_SZ ENV_VMAP_MANIFOLD_RENDERER_MHIVE_SZ
 #define DRAW_DISTANCE 16 /* mhives */
 #define NOISETEX_SZ 64
+/**
+ * The maximum number of mhives requested in one background build batch.
+ */
+#define MAX_BUILDS_PER_BATCH 64
+/**
+ * The width, in mhives, of the hysteresis band around LOD boundaries. An
+ * mhive keeps its current LOD as long as that LOD would be correct for some
+ * distance within this many mhives of its actual distance.
+ */
+#define LOD_HYSTERESIS 1
 
 /**
- * The data-intensive operations use static storage for their temporary data.
- * This both makes programming simpler, and makes it easier to ensure that that
- * memory is available. It also permits a few GCC optimisations that otherwise
- * wouldn't happen.
+ * The data-intensive operations use fixed-size scratch arenas for their
+ * temporary data. This both makes programming simpler, and makes it easier to
+ * ensure that that memory is available.
  *
- * To permit multi-threading, each of these is duplicated THREADS times,
- * permitting up to THREADS threads to run at once.
+ * To permit multi-threading, there is one arena per build division, and up to
+ * ump_num_workers()+1 divisions (ie, one for every thread which could be
+ * running the build task, including one helping from ump_wait()). Each arena
+ * is several megabytes, so they are only allocated the first time the
+ * corresponding division is used.
  */
-#define THREADS 4
+typedef struct build_scratch_s build_scratch;
+static build_scratch** scratch_arenas;
+static unsigned num_scratch_arenas;
 
 /**
  * A render operation is a set of polygons inside a render mhive which share the
@@ -109,10 +124,39 @@ struct env_vmap_manifold_render_mhive_s {
    * The base coordinate of this mhive.
    */
   vc3 base_coordinate;
+  /**
+   * The location of this mhive, in mhive coordinates.
+   */
+  unsigned short x, z;
+  /**
+   * The amount of GPU memory occupied by this mhive's buffers.
+   */
+  unsigned gpu_bytes;
+  /**
+   * While this mhive is in the mesh cache, links to the next cached mhive
+   * in the same location, and its position in the cache LRU list.
+   */
+  struct env_vmap_manifold_render_mhive_s* next_cached;
+  TAILQ_ENTRY(env_vmap_manifold_render_mhive_s) lru;
 
   env_vmap_manifold_render_operation operations[FLEXIBLE_ARRAY_MEMBER];
 };
 
+/**
+ * Holds mhives which have been built but are not currently in use, either
+ * because they went out of draw distance or were replaced by a different
+ * LOD, so that they can be reinstated without rebuilding them.
+ *
+ * Mhives are chained per location via next_cached (there are never many in
+ * one location), and are also kept on an LRU list; whenever the total GPU
+ * memory used by the cache exceeds the renderer's cache_budget_bytes, the
+ * least recently cached mhives are destroyed.
+ */
+struct env_vmap_manifold_render_cache_s {
+  TAILQ_HEAD(, env_vmap_manifold_render_mhive_s) lru;
+  env_vmap_manifold_render_mhive* slots[FLEXIBLE_ARRAY_MEMBER];
+};
+
 static env_vmap_manifold_render_mhive* env_vmap_manifold_render_mhive_new(
   const env_vmap_manifold_renderer* parent, coord x0, coord z0,
   unsigned char lod, unsigned thread_ordinal);
@@ -139,20 +183,285 @@ env_vmap_manifold_renderer* env_vmap_manifold_renderer_new(
   memcpy(this->base_coordinate, base_coordinate, sizeof(vc3));
   this->base_object = base_object;
   this->get_y_offset = get_y_offset;
+  this->frame_build_micros = 0;
+  this->frame_build_count = 0;
+  this->total_build_micros = 0;
+  this->total_build_count = 0;
+  this->num_wanted_builds = 0;
   memset(this->mhives, 0, mhives_sz);
 
+  if (!scratch_arenas) {
+    num_scratch_arenas = ump_num_workers() + 1;
+    scratch_arenas = zxmalloc(num_scratch_arenas * sizeof(build_scratch*));
+  }
+
+  this->cache_budget_bytes =
+    ENV_VMAP_MANIFOLD_RENDERER_DEFAULT_CACHE_BUDGET_BYTES;
+  this->cached_gpu_bytes = 0;
+  this->resident_gpu_bytes = 0;
+  this->cache = xmalloc(offsetof(env_vmap_manifold_render_cache, slots) +
+                        mhives_sz);
+  TAILQ_INIT(&this->cache->lru);
+  memset(this->cache->slots, 0, mhives_sz);
+
   return this;
 }
 
+static void cache_evict_to_budget(env_vmap_manifold_renderer* this) {
+  env_vmap_manifold_render_mhive* victim, ** chain;
+
+  while (this->cached_gpu_bytes > this->cache_budget_bytes) {
+    victim = TAILQ_FIRST(&this->cache->lru);
+    TAILQ_REMOVE(&this->cache->lru, victim, lru);
+
+    for (chain = this->cache->slots +
+           victim->z * (this->vmap->xmax / MHIVE_SZ) + victim->x;
+         *chain != victim; chain = &(*chain)->next_cached);
+    *chain = victim->next_cached;
+
+    this->cached_gpu_bytes -= victim->gpu_bytes;
+    env_vmap_manifold_render_mhive_delete(victim);
+  }
+}
+
+/**
+ * Moves the given mhive, which must not be installed anywhere, into the
+ * cache, evicting older entries as necessary.
+ */
+static void cache_put(env_vmap_manifold_renderer* this,
+                      env_vmap_manifold_render_mhive* mhive) {
+  env_vmap_manifold_render_mhive** slot =
+    this->cache->slots + mhive->z * (this->vmap->xmax / MHIVE_SZ) + mhive->x;
+
+  mhive->next_cached = *slot;
+  *slot = mhive;
+  TAILQ_INSERT_TAIL(&this->cache->lru, mhive, lru);
+  this->cached_gpu_bytes += mhive->gpu_bytes;
+
+  cache_evict_to_budget(this);
+}
+
+/**
+ * Removes and returns the cached mhive at the given location and LOD, or
+ * returns NULL if there is none.
+ */
+static env_vmap_manifold_render_mhive* cache_take(
+  env_vmap_manifold_renderer* this,
+  unsigned x, unsigned z, unsigned char lod
+) {
+  env_vmap_manifold_render_mhive* mhive, ** chain;
+
+  for (chain = this->cache->slots + z * (this->vmap->xmax / MHIVE_SZ) + x;
+       *chain; chain = &(*chain)->next_cached) {
+    if (lod == (*chain)->lod) {
+      mhive = *chain;
+      *chain = mhive->next_cached;
+      TAILQ_REMOVE(&this->cache->lru, mhive, lru);
+      this->cached_gpu_bytes -= mhive->gpu_bytes;
+      return mhive;
+    }
+  }
+
+  return NULL;
+}
+
+void env_vmap_manifold_renderer_set_cache_budget(
+  env_vmap_manifold_renderer* this, size_t bytes
+) {
+  this->cache_budget_bytes = bytes;
+  cache_evict_to_budget(this);
+}
+
+static unsigned char lod_for_distance(signed d) {
+  if (d <= DRAW_DISTANCE/4)
+    return 0;
+  else if (d < DRAW_DISTANCE/2)
+    return 1;
+  else
+    return 2;
+}
+
+/* Mhives are never built during the frame that needs them. Instead, the
+ * rendering pass notes which mhives are missing or at the wrong level of
+ * detail, draws whatever it has meanwhile (which may be the old LOD, or
+ * nothing), and hands the most important few to a build batch which runs as
+ * a uMP submitted task in the background. Once the batch has completed, a
+ * later frame installs the new mhives.
+ *
+ * Workers claim requests from the batch dynamically, so the cost of
+ * individual mhives (which varies wildly) evens out. Each batch stops
+ * claiming further requests once build_budget_micros has elapsed since it
+ * was submitted, so that building never hogs the workers for long; any
+ * requests not reached are simply requested again by a later frame.
+ *
+ * Only one batch is in flight at a time, for any renderer, since the build
+ * scratch space is shared.
+ *
+ * A builder may block until the GL thread has uploaded the previous mhive
+ * built in its scratch space, so the GL thread must never simply wait for a
+ * batch. Instead, deleting a renderer cancels its batch and keeps executing
+ * marshalled commands until the workers have noticed.
+ */
+typedef struct {
+  unsigned short x, z;
+  unsigned char lod;
+  /* Lower values are built first */
+  unsigned priority;
+  env_vmap_manifold_render_mhive* result;
+} mhive_build_request;
+
+static struct {
+  env_vmap_manifold_renderer* renderer;
+  mhive_build_request requests[MAX_BUILDS_PER_BATCH];
+  unsigned num_requests;
+  SDL_atomic_t next_request;
+  Uint64 deadline;
+  SDL_atomic_t cancelled;
+} build_batch;
+
+/* Microseconds, summed over all builders, spent building mhives since the
+ * last frame took the count. Builders add to this after each mhive rather
+ * than at the end of a batch, so that the time lands in the frames during
+ * which it was actually spent.
+ */
+static SDL_atomic_t build_micros_since_frame;
+
+static void build_mhives_impl(unsigned, unsigned);
+static ump_task build_mhives_task = {
+  build_mhives_impl,
+  0, /* set dynamically */
+  0, /* unused by ump_submit() */
+};
+static ump_task_id build_mhives_task_id;
+static unsigned build_budget_micros =
+  ENV_VMAP_MANIFOLD_RENDERER_DEFAULT_BUILD_BUDGET_MICROS;
+
+void env_vmap_manifold_renderer_set_build_budget(unsigned micros) {
+  build_budget_micros = micros;
+}
+
+static void build_mhives_impl(unsigned scratch, unsigned num_scratch) {
+  mhive_build_request* request;
+  unsigned ix;
+  Uint64 start, trace_start;
+
+  for (;;) {
+    if (SDL_AtomicGet(&build_batch.cancelled)) break;
+    ix = SDL_AtomicAdd(&build_batch.next_request, +1);
+    if (ix >= build_batch.num_requests) break;
+    /* Always build at least one mhive per batch so that progress is made
+     * even with a tiny budget.
+     */
+    if (ix && SDL_GetPerformanceCounter() >= build_batch.deadline) break;
+
+    request = build_batch.requests + ix;
+    start = SDL_GetPerformanceCounter();
+    trace_start = trace_begin();
+    request->result = env_vmap_manifold_render_mhive_new(
+      build_batch.renderer, request->x*MHIVE_SZ, request->z*MHIVE_SZ,
+      request->lod, scratch);
+    trace_end("mhive build", trace_start);
+    SDL_AtomicAdd(&build_micros_since_frame,
+                  (SDL_GetPerformanceCounter() - start) * 1000000 /
+                  SDL_GetPerformanceFrequency());
+  }
+}
+
+/**
+ * If the in-flight build batch belongs to the given renderer and has
+ * completed, installs its results. If cancel is true, cancels the batch and
+ * waits for the builders to stop first; any mhives already built are still
+ * installed. Must be called on the GL thread.
+ */
+static void install_built_mhives(env_vmap_manifold_renderer* this,
+                                 int cancel) {
+  env_vmap_manifold_render_mhive** slot;
+  mhive_build_request* request;
+  unsigned i, built = 0, xmax = this->vmap->xmax / MHIVE_SZ;
+
+  if (this != build_batch.renderer) return;
+
+  if (cancel) {
+    SDL_AtomicSet(&build_batch.cancelled, 1);
+    /* Builders may be waiting for their previous upload, which only this
+     * thread can perform. */
+    while (!ump_is_done(build_mhives_task_id)) {
+      glm_drain();
+      SDL_Delay(0);
+    }
+  } else if (!ump_is_done(build_mhives_task_id)) {
+    return;
+  }
+
+  for (i = 0; i < build_batch.num_requests; ++i) {
+    request = build_batch.requests + i;
+    if (!request->result) continue;
+
+    slot = this->mhives + request->z*xmax + request->x;
+    if (*slot)
+      cache_put(this, *slot);
+    *slot = request->result;
+    ++built;
+  }
+
+  this->frame_build_count = built;
+  this->total_build_count += built;
+  build_batch.renderer = NULL;
+}
+
+static int compare_build_requests(const void* va, const void* vb) {
+  const mhive_build_request* a = va, * b = vb;
+
+  return (a->priority > b->priority) - (a->priority < b->priority);
+}
+
+/**
+ * Submits a build batch for the most important of the given candidates,
+ * which are reordered in the process. Does nothing if a batch is already in
+ * flight.
+ */
+static void submit_mhive_builds(env_vmap_manifold_renderer* this,
+                                mhive_build_request* candidates,
+                                unsigned num_candidates) {
+  unsigned i, n;
+
+  if (build_batch.renderer || !num_candidates) return;
+
+  qsort(candidates, num_candidates, sizeof(mhive_build_request),
+        compare_build_requests);
+
+  n = umin(num_candidates, MAX_BUILDS_PER_BATCH);
+  for (i = 0; i < n; ++i) {
+    build_batch.requests[i] = candidates[i];
+    build_batch.requests[i].result = NULL;
+  }
+
+  build_batch.renderer = this;
+  build_batch.num_requests = n;
+  SDL_AtomicSet(&build_batch.next_request, 0);
+  SDL_AtomicSet(&build_batch.cancelled, 0);
+  build_batch.deadline = SDL_GetPerformanceCounter() +
+    (Uint64)build_budget_micros * SDL_GetPerformanceFrequency() / 1000000;
+
+  build_mhives_task.num_divisions = umin(n, num_scratch_arenas);
+  build_mhives_task_id = ump_submit(&build_mhives_task, NULL, 0);
+}
+
 void env_vmap_manifold_renderer_delete(env_vmap_manifold_renderer* this) {
   unsigned num_mhives =
     this->vmap->xmax / MHIVE_SZ * this->vmap->zmax / MHIVE_SZ;
   unsigned i;
 
+  install_built_mhives(this, 1);
+
   for (i = 0; i < num_mhives; ++i)
     if (this->mhives[i])
       env_vmap_manifold_render_mhive_delete(this->mhives[i]);
 
+  this->cache_budget_bytes = 0;
+  cache_evict_to_budget(this);
+  free(this->cache);
+
   free(this);
 }
 
@@ -195,45 +504,32 @@ static void render_env_vmap_manifolds_put_buffer_data(
   shader_manifold_configure_vbo();
 }
 
-static void render_env_vmap_manifolds_impl(
-  unsigned thread_ordinal, unsigned threads);
-
-static canvas* render_env_vmap_manifolds_dst;
-static env_vmap_manifold_renderer*restrict render_env_vmap_manifolds_this;
-static const rendering_context*restrict render_env_vmap_manifolds_ctxt;
-static ump_task render_env_vmap_manifolds_task = {
-  render_env_vmap_manifolds_impl,
-  THREADS,
-  0, /* sync */
-};
-
 void render_env_vmap_manifolds(
   canvas* dst,
   env_vmap_manifold_renderer*restrict this,
   const rendering_context*restrict ctxt
 ) {
-  glm_do(render_env_vmap_manifolds_glprepare, NULL);
-
-  render_env_vmap_manifolds_dst = dst;
-  render_env_vmap_manifolds_this = this;
-  render_env_vmap_manifolds_ctxt = ctxt;
-  ump_run_sync(&render_env_vmap_manifolds_task);
-
-  glm_do(render_env_vmap_manifolds_glfinish, NULL);
-}
-
-static void render_env_vmap_manifolds_impl(
-  unsigned thread_ordinal, unsigned ignore
-) {
-  env_vmap_manifold_renderer*restrict this = render_env_vmap_manifolds_this;
-  const rendering_context*restrict ctxt = render_env_vmap_manifolds_ctxt;
-
+  /* The most that can be within DRAW_DISTANCE */
+  static mhive_build_request candidates[(2*DRAW_DISTANCE-1) *
+                                        (2*DRAW_DISTANCE-1)];
   const rendering_context_invariant*restrict context = CTXTINV(ctxt);
+  env_vmap_manifold_render_mhive** mhive, * cached;
   unsigned x, z, xmax, zmax, cx, cz;
   signed dx, dz;
   unsigned d;
   signed dot;
+  int visible;
   unsigned char desired_lod;
+  unsigned num_candidates = 0;
+  size_t resident_gpu_bytes = 0;
+
+  this->frame_build_micros =
+    (unsigned)SDL_AtomicSet(&build_micros_since_frame, 0);
+  this->total_build_micros += this->frame_build_micros;
+  this->frame_build_count = 0;
+  install_built_mhives(this, 0);
+
+  glm_do(render_env_vmap_manifolds_glprepare, NULL);
 
   xmax = this->vmap->xmax / MHIVE_SZ;
   zmax = this->vmap->zmax / MHIVE_SZ;
@@ -242,8 +538,7 @@ static void render_env_vmap_manifolds_impl(
 
   for (z = 0; z < zmax; ++z) {
     for (x = 0; x < xmax; ++x) {
-      if ((x + z) % THREADS != thread_ordinal)
-        continue;
+      mhive = this->mhives + z*xmax + x;
 
       dx = x - cx;
       dz = z - cz;
@@ -255,27 +550,24 @@ static void render_env_vmap_manifolds_impl(
       d = umax(abs(dx), abs(dz));
 
       if (d < DRAW_DISTANCE) {
-        if (d <= DRAW_DISTANCE/4)
-          desired_lod = 0;
-        else if (d < DRAW_DISTANCE/2)
-          desired_lod = 1;
-        else
-          desired_lod = 2;
-
-        /* We want to keep mhives prepared even if they won't be rendered this
-         * frame, since the angle the camera is facing can change rapidly.
+        /* Keep the current LOD if it is correct anywhere within the
+         * hysteresis band, so that hovering around a boundary doesn't cause
+         * the mhive to flip back and forth.
          */
-
-        if (this->mhives[z*xmax + x] &&
-            this->mhives[z*xmax + x]->lod != desired_lod) {
-          env_vmap_manifold_render_mhive_delete(this->mhives[z*xmax + x]);
-          this->mhives[z*xmax + x] = NULL;
+        desired_lod = lod_for_distance(d);
+        if (*mhive &&
+            (*mhive)->lod >= lod_for_distance((signed)d - LOD_HYSTERESIS) &&
+            (*mhive)->lod <= lod_for_distance(d + LOD_HYSTERESIS))
+          desired_lod = (*mhive)->lod;
+
+        /* Reinstate a cached mesh if there is one */
+        if ((!*mhive || (*mhive)->lod != desired_lod) &&
+            (cached = cache_take(this, x, z, desired_lod))) {
+          if (*mhive)
+            cache_put(this, *mhive);
+          *mhive = cached;
         }
 
-        if (!this->mhives[z*xmax + x])
-          this->mhives[z*xmax + x] = env_vmap_manifold_render_mhive_new(
-            this, x*MHIVE_SZ, z*MHIVE_SZ, desired_lod, thread_ordinal);
-
         dot = dx * context->proj->yrot_sin +
               dz * context->proj->yrot_cos;
         /* Only render mhives that are actually visible.
@@ -291,16 +583,43 @@ static void render_env_vmap_manifolds_impl(
          * be too much of an issue, since the plan is to obscure that part of
          * the view anyway.)
          */
-        if (dot <= 0 || d < 2)
-          env_vmap_manifold_render_mhive_render(this->mhives[z*xmax + x], ctxt);
+        visible = dot <= 0 || d < 2;
+
+        /* We want to keep mhives prepared even if they won't be rendered this
+         * frame, since the angle the camera is facing can change rapidly.
+         * Missing mhives take priority over ones merely at the wrong LOD, then
+         * visible ones over invisible ones, then nearer over farther.
+         */
+        if (!*mhive || (*mhive)->lod != desired_lod) {
+          candidates[num_candidates].x = x;
+          candidates[num_candidates].z = z;
+          candidates[num_candidates].lod = desired_lod;
+          candidates[num_candidates].priority =
+            (!!*mhive << 16) | (!visible << 8) | d;
+          ++num_candidates;
+        }
+
+        /* Until the correct LOD is ready, render whatever we have */
+        if (*mhive && visible)
+          env_vmap_manifold_render_mhive_render(*mhive, ctxt);
       } else {
-        if (this->mhives[z*xmax + x]) {
-          env_vmap_manifold_render_mhive_delete(this->mhives[z*xmax + x]);
-          this->mhives[z*xmax + x] = NULL;
+        if (*mhive) {
+          cache_put(this, *mhive);
+          *mhive = NULL;
         }
       }
+
+      if (*mhive)
+        resident_gpu_bytes += (*mhive)->gpu_bytes;
     }
   }
+
+  this->resident_gpu_bytes = resident_gpu_bytes;
+
+  glm_do(render_env_vmap_manifolds_glfinish, NULL);
+
+  this->num_wanted_builds = num_candidates;
+  submit_mhive_builds(this, candidates, num_candidates);
 }
 
 #define MAX_VERTICES 65535
@@ -317,6 +636,61 @@ typedef struct {
   unsigned char  is_extraneous;
 } manifold_face;
 
+struct build_scratch_s {
+  /* Used by env_vmap_manifold_render_mhive_new() */
+  coord _base_y[NVZ][NVX];
+  ssepi _svertices[MAX_VERTICES];
+  float _glvertices[MAX_VERTICES][4];
+  unsigned short _vertex_indices[NVZ][NVX][NVY];
+  unsigned short _vertex_adjacency[MAX_VERTICES][MAX_EDGES_PER_VERTEX];
+  manifold_face _faces[MAX_FACES];
+  unsigned short _triangulated_indices[MAX_FACES*6];
+  /* A bitset indicating whether each voxel in the column [z][x] has a
+   * graphic blob.
+   *
+   * This is rather dependent on ENV_VMAP_H being 32.
+   */
+  unsigned _has_graphic_blob[NVZ][NVX];
+  /* The minimum Y coordinate (in voxels) in each column which receives
+   * light. A generated face is lit if the Y offset of the empty adjacent
+   * voxel is greater than this value.
+   */
+  signed char _light_y[NVZ][NVX];
+
+  /* To track whether the data in glvertices has finished being sent to the
+   * GPU.
+   */
+  SDL_sem* not_busy;
+
+  render_env_vmap_manifolds_put_buffer_data_op _glm_op;
+
+  /* Used by catmull_clark_subdivide() */
+  unsigned short _new_face_vertices[MAX_VERTICES][MAX_FACES_PER_VERTEX];
+  unsigned short _edge_splits[MAX_VERTICES][MAX_EDGES_PER_VERTEX];
+};
+
+/**
+ * Returns the scratch arena for the given build division, allocating it if
+ * this is the first time it is used.
+ */
+static build_scratch* get_scratch(unsigned ordinal) {
+  build_scratch* scratch;
+
+  assert(ordinal < num_scratch_arenas);
+  scratch = scratch_arenas[ordinal];
+  if (!scratch) {
+    scratch = xmalloc(sizeof(build_scratch));
+    scratch->not_busy = SDL_CreateSemaphore(1);
+    if (!scratch->not_busy)
+      errx(EX_SOFTWARE,
+           "Unable to create semaphore for manifold thread %d: %s",
+           ordinal, SDL_GetError());
+    scratch_arenas[ordinal] = scratch;
+  }
+
+  return scratch;
+}
+
 static const env_voxel_graphic_blob* env_vmap_manifold_renderer_get_graphic_blob(
   const env_voxel_graphic*const* graphics,
   const env_vmap* vmap,
@@ -431,13 +805,9 @@ static void catmull_clark_subdivide(
         recorded implicitly by copying the used portion of new_face_vertices
         onto the head of vertex_adjacency.
    */
-  static struct {
-    unsigned short _new_face_vertices[MAX_VERTICES][MAX_FACES_PER_VERTEX];
-    unsigned short _edge_splits[MAX_VERTICES][MAX_EDGES_PER_VERTEX];
-    volatile unsigned char padding[UMP_CACHE_LINE_SZ];
-  } threads[THREADS];
-#define new_face_vertices threads[thread_ordinal]._new_face_vertices
-#define edge_splits threads[thread_ordinal]._edge_splits
+  build_scratch*restrict scratch = get_scratch(thread_ordinal);
+#define new_face_vertices scratch->_new_face_vertices
+#define edge_splits scratch->_edge_splits
 
   const ssepi one   = sse_piof1(1), two  = sse_piof1(2),
               three = sse_piof1(3), four = sse_piof1(4),
@@ -646,45 +1016,17 @@ static env_vmap_manifold_render_mhive* env_vmap_manifold_render_mhive_new(
     indexed by vertex index. Elements for each vertex are in no particular
     order; values of ~0 indicate an empty slot.
    */
-  static struct {
-    coord _base_y[NVZ][NVX];
-    ssepi _svertices[MAX_VERTICES];
-    float _glvertices[MAX_VERTICES][4];
-    unsigned short _vertex_indices[NVZ][NVX][NVY];
-    unsigned short _vertex_adjacency[MAX_VERTICES][MAX_EDGES_PER_VERTEX];
-    manifold_face _faces[MAX_FACES];
-    unsigned short _triangulated_indices[MAX_FACES*6];
-    /* A bitset indicating whether each voxel in the column [z][x] has a
-     * graphic blob.
-     *
-     * This is rather dependent on ENV_VMAP_H being 32.
-     */
-    unsigned _has_graphic_blob[NVZ][NVX];
-    /* The minimum Y coordinate (in voxels) in each column which receives
-     * light. A generated face is lit if the Y offset of the empty adjacent
-     * voxel is greater than this value.
-     */
-    signed char _light_y[NVZ][NVX];
-
-    /* To track whether the data in glvertices has finished being sent to the
-     * GPU.
-     */
-    SDL_sem* not_busy;
-
-    render_env_vmap_manifolds_put_buffer_data_op _glm_op;
-
-    volatile unsigned char padding[UMP_CACHE_LINE_SZ];
-  } threads[THREADS];
-#define base_y threads[thread_ordinal]._base_y
-#define svertices threads[thread_ordinal]._svertices
-#define glvertices threads[thread_ordinal]._glvertices
-#define vertex_indices threads[thread_ordinal]._vertex_indices
-#define vertex_adjacency threads[thread_ordinal]._vertex_adjacency
-#define faces threads[thread_ordinal]._faces
-#define triangulated_indices threads[thread_ordinal]._triangulated_indices
-#define has_graphic_blob threads[thread_ordinal]._has_graphic_blob
-#define light_y threads[thread_ordinal]._light_y
-#define glm_op threads[thread_ordinal]._glm_op
+  build_scratch*restrict scratch = get_scratch(thread_ordinal);
+#define base_y scratch->_base_y
+#define svertices scratch->_svertices
+#define glvertices scratch->_glvertices
+#define vertex_indices scratch->_vertex_indices
+#define vertex_adjacency scratch->_vertex_adjacency
+#define faces scratch->_faces
+#define triangulated_indices scratch->_triangulated_indices
+#define has_graphic_blob scratch->_has_graphic_blob
+#define light_y scratch->_light_y
+#define glm_op scratch->_glm_op
 
   unsigned short num_vertices;
   unsigned short num_faces;
@@ -694,7 +1036,7 @@ static env_vmap_manifold_render_mhive* env_vmap_manifold_render_mhive_new(
 
   signed cx, cy, cz, ocx, ocy, ocz, vcx, vcy, vcz;
   coord x, y, z, xmask, zmask, vx, vz;
-  unsigned ck, cv, i, op;
+  unsigned ck, cv, i, op, occupancy;
   const env_voxel_graphic_blob* graphic_blobs[256], * all_graphic_blobs[256];
   const env_voxel_graphic_blob* graphic;
   unsigned num_graphic_blobs;
@@ -721,14 +1063,6 @@ static env_vmap_manifold_render_mhive* env_vmap_manifold_render_mhive_new(
   case ENV_VMAP_H == 8*sizeof(has_graphic_blob[0][0]):;
   }
 
-  if (!threads[thread_ordinal].not_busy) {
-    threads[thread_ordinal].not_busy = SDL_CreateSemaphore(1);
-    if (!threads[thread_ordinal].not_busy)
-      errx(EX_SOFTWARE,
-           "Unable to create semaphore for manifold thread %d: %s",
-           thread_ordinal, SDL_GetError());
-  }
-
   memset(base_y, ~0, sizeof(base_y));
   memset(vertex_indices, ~0, sizeof(vertex_indices));
   memset(vertex_adjacency, ~0, sizeof(vertex_adjacency));
@@ -760,8 +1094,18 @@ static env_vmap_manifold_render_mhive* env_vmap_manifold_render_mhive_new(
       x = (x0 + (cx<<lod)) & xmask;
       if (x >= r->vmap->xmax) continue;
 
+      /* Voxel type 0 never has a graphic, so there's no need to look at
+       * empty space. Coarser LODs read whole cells, so need the supercell
+       * granularity.
+       */
+      occupancy = lod?
+        env_vmap_supercell_occupancy(r->vmap, x, z) :
+        env_vmap_column_occupancy(r->vmap, x, z);
+
       for (cy = 0; cy < ENV_VMAP_H>>lod; ++cy) {
         y = cy<<lod;
+        if (!(occupancy & (1u << y))) continue;
+
         graphic = env_vmap_manifold_renderer_get_graphic_blob(
           r->graphics, r->vmap, x, y, z, lod);
         if (graphic) {
@@ -896,10 +1240,16 @@ static env_vmap_manifold_render_mhive* env_vmap_manifold_render_mhive_new(
     num_faces *= 4;
   }
 
+  /* The renderer is going away, and the wait below could be for an upload
+   * which will never happen.
+   */
+  if (SDL_AtomicGet(&build_batch.cancelled))
+    return NULL;
+
   /* Ensure that all the data from the prior run has been sent to the GPU
    * before we start overwriting it.
    */
-  if (SDL_SemWait(threads[thread_ordinal].not_busy))
+  if (SDL_SemWait(scratch->not_busy))
     errx(EX_SOFTWARE, "Failed to wait for semaphore on manifold thread %d: %s",
          thread_ordinal, SDL_GetError());
 
@@ -955,8 +1305,13 @@ static env_vmap_manifold_render_mhive* env_vmap_manifold_render_mhive_new(
   glm_op.index_data_size =
     num_triangulated_indices * sizeof(triangulated_indices[0]);
   glm_op.index_data = triangulated_indices;
-  glm_op.not_busy = threads[thread_ordinal].not_busy;
+  glm_op.not_busy = scratch->not_busy;
   glm_do((void(*)(void*))render_env_vmap_manifolds_put_buffer_data, &glm_op);
+
+  mhive->x = x0 / MHIVE_SZ;
+  mhive->z = z0 / MHIVE_SZ;
+  mhive->gpu_bytes = glm_op.vertex_data_size + glm_op.index_data_size;
+  mhive->next_cached = NULL;
   return mhive;
 #undef base_y
 #undef svertices
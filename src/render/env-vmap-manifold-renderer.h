@@ -39,12 +39,24 @@
  * env_vmap_manifold_renderer.
  */
 #define ENV_VMAP_MANIFOLD_RENDERER_MHIVE_SZ 32
+/**
+ * The default for env_vmap_manifold_renderer_set_build_budget().
+ */
+#define ENV_VMAP_MANIFOLD_RENDERER_DEFAULT_BUILD_BUDGET_MICROS 4000
+/**
+ * The default cache_budget_bytes of new env_vmap_manifold_renderers.
+ */
+#define ENV_VMAP_MANIFOLD_RENDERER_DEFAULT_CACHE_BUDGET_BYTES (64*1024*1024)
 
 /**
  * Internal structure storing precalculated information and heavyweight
  * handles for rendering all or part of a vmap.
  */
 typedef struct env_vmap_manifold_render_mhive_s env_vmap_manifold_render_mhive;
+/**
+ * Internal structure holding built mhives not currently in use.
+ */
+typedef struct env_vmap_manifold_render_cache_s env_vmap_manifold_render_cache;
 
 /**
  * Renders voxel maps by grouping blob-style voxels into solid manifold meshes.
@@ -81,9 +93,51 @@ typedef struct {
    */
   coord (*get_y_offset)(const void* base_object, coord x, coord z);
 
+  /**
+   * The time, in microseconds summed over all threads involved, spent
+   * building mhives between the previous frame and the most recent one.
+   */
+  unsigned frame_build_micros;
+  /**
+   * The number of mhives installed by the most recent frame.
+   */
+  unsigned frame_build_count;
+  /**
+   * The total time, in microseconds summed over all threads involved, spent
+   * building mhives so far.
+   */
+  unsigned long long total_build_micros;
+  /**
+   * The total number of mhives installed so far.
+   */
+  unsigned long long total_build_count;
+  /**
+   * The number of mhives within draw distance which were missing or at the
+   * wrong level of detail as of the most recent frame.
+   */
+  unsigned num_wanted_builds;
+
+  /**
+   * The maximum amount of GPU memory, in bytes, which may be held by built
+   * mhives which are not currently in use, so that they can be reused if the
+   * camera returns to them. See env_vmap_manifold_renderer_set_cache_budget().
+   */
+  size_t cache_budget_bytes;
+  /**
+   * The amount of GPU memory currently held by cached mhives, which never
+   * exceeds cache_budget_bytes.
+   */
+  size_t cached_gpu_bytes;
+  /**
+   * The amount of GPU memory held by mhives in use as of the most recent
+   * frame.
+   */
+  size_t resident_gpu_bytes;
+
   /**
    * Internal state.
    */
+  env_vmap_manifold_render_cache* cache;
   env_vmap_manifold_render_mhive* mhives[FLEXIBLE_ARRAY_MEMBER];
 } env_vmap_manifold_renderer;
 
@@ -105,8 +159,28 @@ env_vmap_manifold_renderer* env_vmap_manifold_renderer_new(
  */
 void env_vmap_manifold_renderer_delete(env_vmap_manifold_renderer*);
 
+/**
+ * Sets the wall-clock time, in microseconds, after which a background batch
+ * of mhive builds stops starting new mhives. This bounds how long building
+ * can occupy the uMP workers per frame. The default is
+ * ENV_VMAP_MANIFOLD_RENDERER_DEFAULT_BUILD_BUDGET_MICROS.
+ */
+void env_vmap_manifold_renderer_set_build_budget(unsigned micros);
+
+/**
+ * Sets the cache_budget_bytes of the given renderer, immediately destroying
+ * cached mhives as necessary to fit. A budget of 0 disables caching. The
+ * default is ENV_VMAP_MANIFOLD_RENDERER_DEFAULT_CACHE_BUDGET_BYTES.
+ */
+void env_vmap_manifold_renderer_set_cache_budget(
+  env_vmap_manifold_renderer*, size_t bytes);
+
 /**
  * Renders the vmap of the given renderer.
+ *
+ * Mhives which are missing or at the wrong level of detail are built in the
+ * background and used by a later frame; until then, the previous level of
+ * detail (if any) is rendered in their place.
  */
 void render_env_vmap_manifolds(canvas* dst, env_vmap_manifold_renderer*restrict,
                                const rendering_context*restrict context);
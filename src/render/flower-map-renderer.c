@@ -31,16 +31,20 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "bsd.h"
 #include "../alloc.h"
 #include "../defs.h"
+#include "../micromp.h"
+#include "../trace.h"
 #include "../math/coords.h"
 #include "../math/rand.h"
 #include "../graphics/canvas.h"
 #include "../graphics/perspective.h"
 #include "../gl/marshal.h"
 #include "../gl/shaders.h"
+#include "../gl/glinfo.h"
 #include "../world/terrain-tilemap.h"
 #include "../world/flower-map.h"
 #include "context.h"
@@ -49,25 +53,59 @@
 #define DRAW_DISTANCE 16 /* fhives */
 #define DRAW_DIAMETER (2 * DRAW_DISTANCE)
 
+/**
+ * The maximum number of fhives built in one background batch.
+ */
+#define MAX_BUILDS_PER_BATCH 64
+
+static const float corner_offsets[4][2] = {
+  { -0.5f, -0.5f }, { +0.5f, -0.5f },
+  { +0.5f, +0.5f }, { -0.5f, +0.5f },
+};
+
+/* Flowers are drawn one of two ways.
+ *
+ * When instanced arrays are available, each flower is a single
+ * shader_flower_vertex used as a per-instance record, and the four corners of
+ * the quad come from corner_buffer, which is shared by every fhive. Each fhive
+ * is then one glDrawArraysInstanced() of a 4-vertex triangle fan.
+ *
+ * Otherwise, each flower is expanded into four full vertices which differ only
+ * in corner_offset, plus six indices. Indices are 16-bit when the fhive is
+ * small enough, and 32-bit otherwise.
+ *
+ * FLOWER_INSTANCING=0 forces the latter, eg, to compare the two on the same
+ * driver.
+ */
+static GLuint corner_buffer;
+
 typedef struct {
   /**
-   * The index of the fhive in the flower map.
+   * The index of the fhive in the flower map whose data is currently in the
+   * buffers, or ~0u if none.
    *
-   * If equal to ~0u, the render_fhive has not been initialised.
+   * This and length are owned by the rendering thread.
    */
   unsigned fhive_index;
   /**
-   * The VAO configured to draw with the below buffers.
+   * The number of elements to draw; flowers if instanced, indices otherwise.
+   */
+  unsigned length;
+  /**
+   * The type of the indices in the index buffer, if not instanced.
+   */
+  GLenum index_type;
+  /**
+   * The VAO configured to draw with the below buffers, or 0 if not yet
+   * created.
+   *
+   * This and buffers are owned by the OpenGL thread.
    */
   GLuint vao;
   /**
    * The vertex and index buffers for this fhive.
    */
   GLuint buffers[2];
-  /**
-   * The number of indices in the index buffer.
-   */
-  unsigned length;
 } flower_map_render_fhive;
 
 struct flower_map_renderer_s {
@@ -75,30 +113,84 @@ struct flower_map_renderer_s {
   const flower_graphic* graphics;
   const terrain_tilemap* terrain;
 
+  /**
+   * The camera position as of the previous frame, and the direction of travel
+   * (-1, 0, or +1 on each axis) last observed, used to decide which fhives to
+   * prefetch.
+   */
+  coord prev_camera[2];
+  signed char travel[2];
+
+  /**
+   * Whether fhives are drawn with instancing. Fixed at creation.
+   */
+  int instanced;
+
   /**
    * Hives currently within the draw distance. Each fhive at (x,z) is mapped to
    * hives[z%DRAW_DIAMETER][x%DRAW_DIAMETER]; render_fhives are tagged with the
    * index of their fhive to see if they need to be regenerated for the fhive
    * that is actually to be drawn.
+   *
+   * Only 2*DRAW_DISTANCE-1 fhives are visible along each axis, so the spare
+   * row and column are used to prefetch fhives just beyond the draw distance
+   * in the direction of travel.
    */
   flower_map_render_fhive hives[DRAW_DIAMETER][DRAW_DIAMETER];
 };
 
+/* Vertex data for fhives is never generated on the OpenGL thread. Instead,
+ * render_flower_map() notes which slots need a new fhive and hands them to a
+ * uMP submitted task which generates the data into heap buffers in the
+ * background. A later frame finds the batch complete and marshals the buffer
+ * uploads to the OpenGL thread. Slots whose fhive is not yet ready are simply
+ * not drawn.
+ *
+ * Only one batch is in flight at a time.
+ */
+typedef struct {
+  flower_map_render_fhive* slot;
+  unsigned fhive_index, x, z;
+  /* Lower values are built first */
+  unsigned priority;
+
+  /* Output */
+  int instanced;
+  shader_flower_vertex* vertices;
+  void* indices;
+  GLenum index_type;
+  unsigned count;
+} flower_map_fhive_build;
+
+static struct {
+  const flower_map_renderer* renderer;
+  flower_map_fhive_build builds[MAX_BUILDS_PER_BATCH];
+  unsigned num_builds;
+} build_batch;
+
+static void flower_map_build_fhive(unsigned, unsigned);
+static ump_task flower_map_build_task = {
+  flower_map_build_fhive,
+  0, /* set dynamically */
+  0, /* unused by ump_submit() */
+};
+static ump_task_id flower_map_build_task_id;
+
+typedef struct {
+  const flower_map_render_fhive* slot;
+  unsigned length, x, z;
+  GLenum index_type;
+} flower_map_fhive_draw;
+
 typedef struct {
-  flower_map_renderer* this;
   const rendering_context*restrict ctxt;
+  int instanced;
+  unsigned num_draws;
+  flower_map_fhive_draw draws[FLEXIBLE_ARRAY_MEMBER];
 } flower_map_render_op;
 
 static void render_flower_map_impl(flower_map_render_op*);
-static void flower_map_render_fhive_prepare(
-  flower_map_render_fhive* this,
-  const flower_map_renderer* renderer,
-  unsigned x, unsigned z);
-static void flower_map_render_fhive_render(
-  const flower_map_render_fhive* this,
-  const flower_map_renderer* renderer,
-  const rendering_context*restrict ctxt,
-  unsigned x, unsigned z);
+static void flower_map_upload_fhive(flower_map_fhive_build*);
 
 flower_map_renderer* flower_map_renderer_new(
   const flower_map* flowers,
@@ -106,20 +198,74 @@ flower_map_renderer* flower_map_renderer_new(
   const terrain_tilemap* terrain
 ) {
   flower_map_renderer* this = xmalloc(sizeof(flower_map_renderer));
+  unsigned i, j;
+
   this->flowers = flowers;
   this->graphics = graphics;
   this->terrain = terrain;
+  this->prev_camera[0] = this->prev_camera[1] = 0;
+  this->travel[0] = this->travel[1] = 0;
+  this->instanced = has_instanced_arrays &&
+    !(getenv("FLOWER_INSTANCING") && !strcmp(getenv("FLOWER_INSTANCING"), "0"));
+
+  for (i = 0; i < lenof(this->hives); ++i) {
+    for (j = 0; j < lenof(this->hives[i]); ++j) {
+      this->hives[i][j].fhive_index = ~0u;
+      this->hives[i][j].length = 0;
+      this->hives[i][j].index_type = GL_UNSIGNED_SHORT;
+      this->hives[i][j].vao = 0;
+    }
+  }
 
-  memset(this->hives, ~0, sizeof(this->hives));
   return this;
 }
 
+/**
+ * If the in-flight build batch belongs to the given renderer and has
+ * completed (or wait is true, in which case it waits for completion),
+ * installs its results, enqueueing their uploads to the OpenGL thread.
+ * Otherwise, does nothing.
+ *
+ * If discard is true, the results are freed instead of installed.
+ */
+static void install_built_fhives(flower_map_renderer* this,
+                                 int wait, int discard) {
+  flower_map_fhive_build* build;
+  unsigned i;
+
+  if (this != build_batch.renderer) return;
+
+  if (wait)
+    ump_wait(flower_map_build_task_id);
+  else if (!ump_is_done(flower_map_build_task_id))
+    return;
+
+  for (i = 0; i < build_batch.num_builds; ++i) {
+    build = build_batch.builds + i;
+    if (discard) {
+      free(build->vertices);
+      free(build->indices);
+      continue;
+    }
+
+    build->slot->fhive_index = build->fhive_index;
+    build->slot->length = build->count * (build->instanced? 1 : 6);
+    build->slot->index_type = build->index_type;
+    glm_do((void(*)(void*))flower_map_upload_fhive,
+           memcpy(xmalloc(sizeof(*build)), build, sizeof(*build)));
+  }
+
+  build_batch.renderer = NULL;
+}
+
 void flower_map_renderer_delete(flower_map_renderer* this) {
   unsigned i, j;
 
+  install_built_fhives(this, 1, 1);
+
   for (i = 0; i < lenof(this->hives); ++i) {
     for (j = 0; j < lenof(this->hives[i]); ++j) {
-      if (~this->hives[i][j].fhive_index) {
+      if (this->hives[i][j].vao) {
         glDeleteBuffers(2, this->hives[i][j].buffers);
         glDeleteVertexArrays(1, &this->hives[i][j].vao);
       }
@@ -129,82 +275,164 @@ void flower_map_renderer_delete(flower_map_renderer* this) {
   free(this);
 }
 
-void render_flower_map(canvas* dst,
-                       flower_map_renderer*restrict this,
-                       const rendering_context*restrict ctxt) {
-  flower_map_render_op* op = xmalloc(sizeof(flower_map_render_op));
+static int compare_fhive_builds(const void* va, const void* vb) {
+  const flower_map_fhive_build* a = va, * b = vb;
 
-  op->this = this;
-  op->ctxt = ctxt;
-  glm_do((void(*)(void*))render_flower_map_impl, op);
+  return (a->priority > b->priority) - (a->priority < b->priority);
 }
 
-static void render_flower_map_impl(flower_map_render_op* op) {
-  flower_map_renderer* this = op->this;
-  const rendering_context*restrict ctxt = op->ctxt;
+/**
+ * Updates the direction of travel of the given renderer for the new camera
+ * location.
+ */
+static void update_travel(flower_map_renderer* this,
+                          const rendering_context_invariant*restrict context) {
+  signed delta;
+  coord torus_sz;
+  unsigned i;
+
+  for (i = 0; i < 2; ++i) {
+    torus_sz = i? context->proj->torus_h : context->proj->torus_w;
+    delta = context->proj->camera[i*2] - this->prev_camera[i];
+    /* Moving across the torus seam looks like a huge jump the other way */
+    if (delta > (signed)(torus_sz / 2))
+      delta -= torus_sz;
+    else if (delta < -(signed)(torus_sz / 2))
+      delta += torus_sz;
+
+    if (delta)
+      this->travel[i] = delta > 0? +1 : -1;
+    this->prev_camera[i] = context->proj->camera[i*2];
+  }
+}
+
+void render_flower_map(canvas* dst,
+                       flower_map_renderer*restrict this,
+                       const rendering_context*restrict ctxt) {
+  static flower_map_fhive_build candidates[DRAW_DIAMETER * DRAW_DIAMETER];
   const rendering_context_invariant*restrict context = CTXTINV(ctxt);
+  flower_map_render_op* op;
+  flower_map_render_fhive* slot;
+  signed xo, zo, xlow, xhigh, zlow, zhigh;
+  unsigned cx, cz, fx, fz, index, num_candidates = 0, i;
+  int visible;
 
-  signed xo, zo;
-  unsigned cx, cz, fx, fz, rfx, rfz;
+  install_built_fhives(this, 0, 0);
+  update_travel(this, context);
 
-  free(op);
+  op = xmalloc(offsetof(flower_map_render_op, draws) +
+               DRAW_DIAMETER * DRAW_DIAMETER * sizeof(flower_map_fhive_draw));
+  op->ctxt = ctxt;
+  op->instanced = this->instanced;
+  op->num_draws = 0;
 
   cx = context->proj->camera[0] / TILE_SZ / FLOWER_FHIVE_SIZE;
   cz = context->proj->camera[2] / TILE_SZ / FLOWER_FHIVE_SIZE;
 
-  for (zo = -DRAW_DISTANCE+1; zo < DRAW_DISTANCE; ++zo) {
+  /* Extend the range by one in the direction of travel for prefetching. Since
+   * offsets of -DRAW_DISTANCE and +DRAW_DISTANCE share a slot, only one side
+   * can be prefetched at a time.
+   */
+  xlow = -DRAW_DISTANCE + (this->travel[0] >= 0);
+  xhigh = DRAW_DISTANCE - (this->travel[0] <= 0);
+  zlow = -DRAW_DISTANCE + (this->travel[1] >= 0);
+  zhigh = DRAW_DISTANCE - (this->travel[1] <= 0);
+
+  for (zo = zlow; zo <= zhigh; ++zo) {
     fz = (zo + cz) & (this->flowers->fhives_h - 1);
-    rfz = fz % lenof(this->hives);
 
-    for (xo = -DRAW_DISTANCE+1; xo < DRAW_DISTANCE; ++xo) {
+    for (xo = xlow; xo <= xhigh; ++xo) {
       fx = (xo + cx) & (this->flowers->fhives_w - 1);
-      rfx = fx % lenof(this->hives[fz]);
+      slot = this->hives[fz % DRAW_DIAMETER] + fx % DRAW_DIAMETER;
+      index = flower_map_fhive_offset(this->flowers, fx, fz);
+      visible = abs(xo) < DRAW_DISTANCE && abs(zo) < DRAW_DISTANCE;
+
+      if (index != slot->fhive_index) {
+        candidates[num_candidates].slot = slot;
+        candidates[num_candidates].fhive_index = index;
+        candidates[num_candidates].x = fx;
+        candidates[num_candidates].z = fz;
+        candidates[num_candidates].priority =
+          (!visible << 8) | umax(abs(xo), abs(zo));
+        ++num_candidates;
+      } else if (visible && slot->length) {
+        op->draws[op->num_draws].slot = slot;
+        op->draws[op->num_draws].length = slot->length;
+        op->draws[op->num_draws].x = fx;
+        op->draws[op->num_draws].z = fz;
+        op->draws[op->num_draws].index_type = slot->index_type;
+        ++op->num_draws;
+      }
+    }
+  }
 
-      flower_map_render_fhive_prepare(this->hives[rfz] + rfx,
-                                      this, fx, fz);
-      flower_map_render_fhive_render(this->hives[rfz] + rfx,
-                                     this, ctxt, fx, fz);
+  glm_do((void(*)(void*))render_flower_map_impl, op);
+
+  if (!build_batch.renderer && num_candidates) {
+    qsort(candidates, num_candidates, sizeof(flower_map_fhive_build),
+          compare_fhive_builds);
+    build_batch.renderer = this;
+    build_batch.num_builds = umin(num_candidates, MAX_BUILDS_PER_BATCH);
+    for (i = 0; i < build_batch.num_builds; ++i) {
+      build_batch.builds[i] = candidates[i];
+      build_batch.builds[i].instanced = this->instanced;
     }
+
+    flower_map_build_task.num_divisions = build_batch.num_builds;
+    flower_map_build_task_id = ump_submit(&flower_map_build_task, NULL, 0);
   }
 }
 
-static void flower_map_render_fhive_prepare(
-  flower_map_render_fhive* this,
-  const flower_map_renderer* renderer,
-  unsigned x, unsigned z
-) {
-  static const float corner_offsets[4][2] = {
-    { -0.5f, -0.5f }, { +0.5f, -0.5f },
-    { +0.5f, +0.5f }, { -0.5f, +0.5f },
-  };
-  /* Maximum size is capped so that indices fit in shorts anyway, and only the
-   * OpenGL thread can run this code, so just statically allocate the data
-   * arrays.
-   */
-  static shader_flower_vertex vertices[65536 / 4][4];
-  static unsigned short indices[65536 / 4][6];
+static void flower_map_render_fhive_render(
+  const flower_map_fhive_draw* draw,
+  int instanced,
+  const rendering_context*restrict ctxt);
 
-  const flower_fhive* hive;
-  unsigned i, j, count, shadow, date_stagger, max_date_stagger;
-  vc3 flower_position;
-  float date0, date1;
+static void render_flower_map_impl(flower_map_render_op* op) {
+  unsigned i;
 
-  if (this->fhive_index == flower_map_fhive_offset(renderer->flowers, x, z))
-    return;
+  for (i = 0; i < op->num_draws; ++i)
+    flower_map_render_fhive_render(op->draws + i, op->instanced, op->ctxt);
 
-  if (!~this->fhive_index) {
-    glGenVertexArrays(1, &this->vao);
-    glGenBuffers(2, this->buffers);
-  }
+  free(op);
+}
 
-  this->fhive_index = flower_map_fhive_offset(renderer->flowers, x, z);
-  hive = renderer->flowers->hives + this->fhive_index;
+static void flower_map_build_fhive(unsigned ordinal, unsigned ignored) {
+  flower_map_fhive_build* build = build_batch.builds + ordinal;
+  const flower_map_renderer* renderer = build_batch.renderer;
+  const flower_fhive* hive;
+  shader_flower_vertex* vertex;
+  unsigned short* short_indices = NULL;
+  unsigned* int_indices = NULL;
+  unsigned i, j, x, z, count, shadow, date_stagger, max_date_stagger;
+  unsigned verts_per_flower;
+  vc3 flower_position;
+  float date0, date1;
+  Uint64 trace_start = trace_begin();
 
+  x = build->x;
+  z = build->z;
+  hive = renderer->flowers->hives + build->fhive_index;
   count = hive->size;
-  if (count > lenof(vertices))
-    count = 65536 / 4;
+  verts_per_flower = build->instanced? 1 : 4;
+
+  build->vertices = xmalloc(
+    count * verts_per_flower * sizeof(shader_flower_vertex));
+  build->indices = NULL;
+  build->index_type = GL_UNSIGNED_SHORT;
+  if (!build->instanced) {
+    if (count * 4 <= 65536) {
+      build->indices = short_indices =
+        xmalloc(count * 6 * sizeof(unsigned short));
+    } else {
+      build->indices = int_indices = xmalloc(count * 6 * sizeof(unsigned));
+      build->index_type = GL_UNSIGNED_INT;
+    }
+  }
 
   for (i = 0; i < count; ++i) {
+    vertex = build->vertices + i * verts_per_flower;
+
     flower_position[0] = x * FLOWER_FHIVE_SIZE * TILE_SZ +
       hive->flowers[i].x * FLOWER_COORD_UNIT;
     flower_position[2] = z * FLOWER_FHIVE_SIZE * TILE_SZ +
@@ -213,9 +441,9 @@ static void flower_map_render_fhive_prepare(
       terrain_base_y(renderer->terrain,
                      flower_position[0], flower_position[2]);
 
-    vertices[i][0].v[0] = flower_position[0] - x * FLOWER_FHIVE_SIZE * TILE_SZ;
-    vertices[i][0].v[1] = flower_position[1];
-    vertices[i][0].v[2] = flower_position[2] - z * FLOWER_FHIVE_SIZE * TILE_SZ;
+    vertex->v[0] = flower_position[0] - x * FLOWER_FHIVE_SIZE * TILE_SZ;
+    vertex->v[1] = flower_position[1];
+    vertex->v[2] = flower_position[2] - z * FLOWER_FHIVE_SIZE * TILE_SZ;
 
     shadow = renderer->terrain->type[
       terrain_tilemap_offset(renderer->terrain,
@@ -223,55 +451,106 @@ static void flower_map_render_fhive_prepare(
                              flower_position[2] / TILE_SZ)] &
       ((1 << TERRAIN_SHADOW_BITS) - 1);
     canvas_pixel_to_gl4fv(
-      vertices[i][0].colour,
+      vertex->colour,
       renderer->graphics[hive->flowers[i].type].colour[shadow]);
 
     date0 = renderer->graphics[hive->flowers[i].type].date_appear / 65536.0f;
     date1 = renderer->graphics[hive->flowers[i].type].date_disappear / 65536.0f;
     max_date_stagger = renderer->graphics[hive->flowers[i].type].date_stagger;
-    date_stagger = chaos_of(chaos_accum(chaos_accum(0, this->fhive_index), i));
+    date_stagger = chaos_of(chaos_accum(chaos_accum(0, build->fhive_index), i));
     date_stagger %= 1u + max_date_stagger;
     date0 -= ((float)date_stagger - max_date_stagger / 2.0f) / 65536.0f;
     date1 -= ((float)date_stagger - max_date_stagger / 2.0f) / 65536.0f;
 
-    vertices[i][0].lifetime_centre[0] = (date0 + date1) / 2.0f;
-    vertices[i][0].lifetime_scale[0] = 2.0f / (date1 - date0);
-    vertices[i][0].max_size[0] =
+    vertex->lifetime_centre[0] = (date0 + date1) / 2.0f;
+    vertex->lifetime_scale[0] = 2.0f / (date1 - date0);
+    vertex->max_size[0] =
       renderer->graphics[hive->flowers[i].type].size;
 
+    if (build->instanced) {
+      /* Supplied per-vertex by corner_buffer */
+      vertex->corner_offset[0] = vertex->corner_offset[1] = 0.0f;
+      continue;
+    }
+
     for (j = 0; j < 4; ++j) {
-      if (j) memcpy(vertices[i] + j, vertices[i], sizeof(vertices[i]));
-      memcpy(vertices[i][j].corner_offset, corner_offsets + j,
+      if (j) memcpy(vertex + j, vertex, sizeof(*vertex));
+      memcpy(vertex[j].corner_offset, corner_offsets + j,
              sizeof(corner_offsets[j]));
     }
 
-    indices[i][0] = i * 4 + 0;
-    indices[i][1] = i * 4 + 1;
-    indices[i][2] = i * 4 + 2;
-    indices[i][3] = i * 4 + 0;
-    indices[i][4] = i * 4 + 2;
-    indices[i][5] = i * 4 + 3;
+#define PUT_INDICES(indices) do {               \
+      (indices)[i*6 + 0] = i * 4 + 0;           \
+      (indices)[i*6 + 1] = i * 4 + 1;           \
+      (indices)[i*6 + 2] = i * 4 + 2;           \
+      (indices)[i*6 + 3] = i * 4 + 0;           \
+      (indices)[i*6 + 4] = i * 4 + 2;           \
+      (indices)[i*6 + 5] = i * 4 + 3;           \
+    } while (0)
+    if (short_indices)
+      PUT_INDICES(short_indices);
+    else
+      PUT_INDICES(int_indices);
+#undef PUT_INDICES
+  }
+
+  build->count = count;
+  trace_end("fhive build", trace_start);
+}
+
+static void flower_map_upload_fhive(flower_map_fhive_build* build) {
+  flower_map_render_fhive* this = build->slot;
+
+  shader_flower_vertex corners[4];
+  unsigned i;
+  int new_vao = !this->vao;
+
+  if (new_vao) {
+    glGenVertexArrays(1, &this->vao);
+    glGenBuffers(2, this->buffers);
+  }
+
+  if (build->instanced && !corner_buffer) {
+    memset(corners, 0, sizeof(corners));
+    for (i = 0; i < 4; ++i)
+      memcpy(corners[i].corner_offset, corner_offsets + i,
+             sizeof(corner_offsets[i]));
+
+    glGenBuffers(1, &corner_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, corner_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
   }
 
-  this->length = count * 6;
   glBindVertexArray(this->vao);
   glBindBuffer(GL_ARRAY_BUFFER, this->buffers[0]);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->buffers[1]);
-  glBufferData(GL_ARRAY_BUFFER, count * sizeof(shader_flower_vertex) * 4,
-               vertices, GL_STATIC_DRAW);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-               count * sizeof(unsigned short) * 6,
-               indices, GL_STATIC_DRAW);
-  shader_flower_configure_vbo();
+  glBufferData(GL_ARRAY_BUFFER,
+               build->count * sizeof(shader_flower_vertex) *
+               (build->instanced? 1 : 4),
+               build->vertices, GL_STATIC_DRAW);
+  if (build->instanced) {
+    if (new_vao)
+      shader_flower_configure_instanced_vbo(corner_buffer, this->buffers[0]);
+  } else {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->buffers[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 build->count * 6 * (GL_UNSIGNED_INT == build->index_type?
+                                     sizeof(unsigned) : sizeof(unsigned short)),
+                 build->indices, GL_STATIC_DRAW);
+    shader_flower_configure_vbo();
+  }
+
+  free(build->vertices);
+  free(build->indices);
+  free(build);
 }
 
 static void flower_map_render_fhive_render(
-  const flower_map_render_fhive* this,
-  const flower_map_renderer* renderer,
-  const rendering_context*restrict ctxt,
-  unsigned x, unsigned z
+  const flower_map_fhive_draw* draw,
+  int instanced,
+  const rendering_context*restrict ctxt
 ) {
   const rendering_context_invariant*restrict context = CTXTINV(ctxt);
+  unsigned x = draw->x, z = draw->z;
   shader_flower_uniform uniform;
   unsigned i;
   coord effective_camera;
@@ -308,7 +587,10 @@ static void flower_map_render_fhive_render(
   uniform.inv_max_distance = 1.0f /
     ((DRAW_DISTANCE-1) * FLOWER_FHIVE_SIZE * TILE_SZ);
 
-  glBindVertexArray(this->vao);
+  glBindVertexArray(draw->slot->vao);
   shader_flower_activate(&uniform);
-  glDrawElements(GL_TRIANGLES, this->length, GL_UNSIGNED_SHORT, (GLvoid*)0);
+  if (instanced)
+    glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, 4, draw->length);
+  else
+    glDrawElements(GL_TRIANGLES, draw->length, draw->index_type, (GLvoid*)0);
 }
@@ -36,6 +36,7 @@
 
 #include "../bsd.h"
 #include "../alloc.h"
+#include "../trace.h"
 #include "../math/rand.h"
 #include "../math/frac.h"
 #include "../math/coords.h"
@@ -202,6 +203,8 @@ void paint_overlay_delete(paint_overlay* this) {
 }
 
 static void paint_overlay_preprocess_impl(paint_overlay* this) {
+  Uint64 start = trace_begin();
+
   if (this->src_screenw != this->fbtex_dim[0] ||
       this->src_screenh != this->fbtex_dim[1]) {
     glBindTexture(GL_TEXTURE_2D, this->fbtex);
@@ -217,10 +220,12 @@ static void paint_overlay_preprocess_impl(paint_overlay* this) {
   }
 
   auxbuff_target_immediate(this->fbtex, this->src_screenw, this->src_screenh);
+  trace_end("paint_overlay preprocess", start);
 }
 
 static void paint_overlay_postprocess_impl(paint_overlay* this) {
   shader_paint_overlay_uniform uniform;
+  Uint64 start = trace_begin();
 
   glPushAttrib(GL_ENABLE_BIT);
   glEnable(GL_POINT_SPRITE);
@@ -270,6 +275,7 @@ static void paint_overlay_postprocess_impl(paint_overlay* this) {
   glDrawArrays(GL_POINTS, 0, this->num_points);
 
   glPopAttrib();
+  trace_end("paint_overlay postprocess", start);
 }
 
 void paint_overlay_preprocess(paint_overlay* this,
@@ -39,6 +39,7 @@
 #include "../defs.h"
 #include "../math/frac.h"
 #include "../micromp.h"
+#include "../trace.h"
 #include "../graphics/canvas.h"
 #include "../graphics/linear-paint-tile.h"
 #include "../graphics/perspective.h"
@@ -92,6 +93,7 @@ void terrabuff_init(void) {
                              NULL,
                              shader_terrabuff_configure_vbo,
                              sizeof(shader_terrabuff_vertex));
+  glm_slab_group_set_order(glmsg, GLM_ORDER_OPAQUE);
 }
 
 /**
@@ -422,9 +424,11 @@ static void do_interpolate(unsigned ordinal, unsigned pcount) {
   coord_offset xmax =
     (xmin + RENDER_COL_W < dst->w? xmin + RENDER_COL_W : dst->w);
   unsigned scan;
+  Uint64 trace_start;
 
   if (xmin >= xmax) return;
 
+  trace_start = trace_begin();
   lbuff_front = terrabuff_interp + xmin;
 
   memset(lbuff_back, ~0, sizeof(initial_back_buffer));
@@ -441,6 +445,8 @@ static void do_interpolate(unsigned ordinal, unsigned pcount) {
     lbuff_back = lbuff_front;
     lbuff_front += terrabuff_interp_pitch;
   }
+
+  trace_end("terrabuff interpolate", trace_start);
 }
 
 static void interp_to_gl(void* ignored) {
@@ -570,7 +576,11 @@ void terrabuff_render(canvas*restrict dst,
   lower = initial_lower;
   upper = terrabuff_interp;
 
+  /* Every scan is emitted by this thread in order, so one key covers the
+   * whole pass and the scans batch into as few slabs as possible.
+   */
   slab = glm_slab_get(glmsg);
+  glm_slab_set_key(slab, 0);
   for (scan = 0; scan < this->scan; ++scan) {
     for (i = this->boundaries[scan].low;
          i+1 < this->boundaries[scan].high; ++i) {
@@ -34,6 +34,7 @@
 #include "../alloc.h"
 #include "../math/coords.h"
 #include "../micromp.h"
+#include "../trace.h"
 #include "../graphics/canvas.h"
 #include "../graphics/perspective.h"
 #include "../world/terrain-tilemap.h"
@@ -194,6 +195,7 @@ static void render_terrain_tilemap_terrain_subrange(unsigned ix, unsigned count)
   unsigned char level = 0;
   coord_offset distance = 1 * METRE, distance_incr = 1 * METRE;
   chronon t = CTXTINV(context)->now;
+  Uint64 trace_start = trace_begin();
 
   /* Start by assuming 180 deg effective field. The terrabuff will give us
    * better boundaries after the first scan.
@@ -248,6 +250,8 @@ static void render_terrain_tilemap_terrain_subrange(unsigned ix, unsigned count)
       world = SLIST_NEXT(world, next);
     }
   }
+
+  trace_end("terrabuff scan", trace_start);
 }
 
 void render_terrain_tilemap(canvas* dst,
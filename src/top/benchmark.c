@@ -0,0 +1,316 @@
+/*-
+ * Copyright (c) 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsd.h"
+#include "alloc.h"
+#include "math/coords.h"
+#include "gl/marshal.h"
+#include "cosine-world.h"
+#include "benchmark.h"
+
+typedef struct {
+  chronon time;
+  cosine_world_camera camera;
+} benchmark_keyframe;
+
+struct benchmark_s {
+  benchmark_keyframe* keyframes;
+  unsigned num_keyframes;
+
+  Uint64* frames;
+  unsigned num_frames, frames_cap;
+
+  Uint64 generation_time;
+
+  /* See benchmark_add_stats() */
+  cosine_world_stats last_stats;
+  size_t peak_resident_mhive_bytes, peak_cached_mhive_bytes;
+  unsigned peak_frame_mhive_build_micros;
+
+  /* The extent of the (toroidal) world in world coordinates, or 0 if
+   * unknown; see benchmark_set_world_size().
+   */
+  coord world_w, world_h;
+};
+
+/* Flies a straight line over a quarter of the map while slowly turning and
+ * looking up and down, so that every direction of view and a good range of
+ * distances are covered.
+ */
+static const benchmark_keyframe builtin_path[] = {
+  {  0*SECOND, {    0*METRE,    0*METRE,         0,       0 } },
+  { 15*SECOND, {  256*METRE,  256*METRE,   DEG_90,  -DEG_90/4 } },
+  { 30*SECOND, {  512*METRE,  512*METRE,  2*DEG_90,        0 } },
+  { 45*SECOND, {  768*METRE,  768*METRE,  3*DEG_90, +DEG_90/4 } },
+  { 60*SECOND, { 1024*METRE, 1024*METRE,  4*DEG_90,        0 } },
+};
+
+static void benchmark_load_path(benchmark*, const char*);
+
+benchmark* benchmark_new(const char* path_filename) {
+  benchmark* this = zxmalloc(sizeof(benchmark));
+
+  if (path_filename) {
+    benchmark_load_path(this, path_filename);
+  } else {
+    this->num_keyframes = sizeof(builtin_path) / sizeof(builtin_path[0]);
+    this->keyframes = xmalloc(sizeof(builtin_path));
+    memcpy(this->keyframes, builtin_path, sizeof(builtin_path));
+  }
+
+  return this;
+}
+
+void benchmark_delete(benchmark* this) {
+  free(this->keyframes);
+  free(this->frames);
+  free(this);
+}
+
+static void benchmark_load_path(benchmark* this, const char* filename) {
+  char line[256];
+  unsigned lineno = 0, cap = 0;
+  long long t, x, z, yrot, rxrot;
+  benchmark_keyframe* kf;
+  FILE* file;
+
+  file = fopen(filename, "r");
+  if (!file)
+    err(EX_NOINPUT, "Unable to open camera path %s", filename);
+
+  while (fgets(line, sizeof(line), file)) {
+    ++lineno;
+    if ('#' == line[0] || strspn(line, " \t\r\n") == strlen(line))
+      continue;
+
+    if (5 != sscanf(line, "%lld %lld %lld %lld %lld",
+                    &t, &x, &z, &yrot, &rxrot))
+      errx(EX_DATAERR, "%s:%u: Malformed keyframe", filename, lineno);
+
+    if (this->num_keyframes &&
+        (chronon)t < this->keyframes[this->num_keyframes-1].time)
+      errx(EX_DATAERR, "%s:%u: Keyframe out of order", filename, lineno);
+
+    if (this->num_keyframes == cap) {
+      cap = cap? cap*2 : 256;
+      this->keyframes = xrealloc(this->keyframes,
+                                 sizeof(benchmark_keyframe) * cap);
+    }
+
+    kf = this->keyframes + this->num_keyframes++;
+    kf->time = t;
+    kf->camera.x = x;
+    kf->camera.z = z;
+    kf->camera.yrot = yrot;
+    kf->camera.rxrot = rxrot;
+  }
+
+  if (ferror(file))
+    err(EX_IOERR, "Error reading camera path %s", filename);
+  fclose(file);
+
+  if (!this->num_keyframes)
+    errx(EX_DATAERR, "Camera path %s is empty", filename);
+}
+
+void benchmark_set_world_size(benchmark* this, coord w, coord h) {
+  this->world_w = w;
+  this->world_h = h;
+}
+
+/* Returns the shortest signed distance equivalent to d on a torus of
+ * circumference w (a power of two), or d taken as signed if w is 0.
+ */
+static signed torus_delta(coord d, coord w) {
+  if (!w) return (signed)d;
+
+  d &= w - 1;
+  return d >= w/2? (signed)d - (signed)w : (signed)d;
+}
+
+int benchmark_camera_at(const benchmark* this, chronon t,
+                        cosine_world_camera* camera) {
+  const benchmark_keyframe* a, * b;
+  unsigned lo = 0, hi = this->num_keyframes - 1, mid;
+  long long num, den;
+
+  if (t > this->keyframes[hi].time) return 0;
+
+  /* Find the last keyframe at or before t */
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (this->keyframes[mid].time <= t)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  a = this->keyframes + lo;
+  if (lo + 1 == this->num_keyframes || a->time >= t) {
+    *camera = a->camera;
+    return 1;
+  }
+
+  b = a + 1;
+  num = t - a->time;
+  den = b->time - a->time;
+  /* Differences are taken modulo the world size so that paths which cross
+   * the edge of the torus take the short way round.
+   */
+  camera->x = a->camera.x + (coord)(
+    torus_delta(b->camera.x - a->camera.x, this->world_w) * num / den);
+  camera->z = a->camera.z + (coord)(
+    torus_delta(b->camera.z - a->camera.z, this->world_h) * num / den);
+  camera->yrot = a->camera.yrot +
+    (signed)((long long)(b->camera.yrot - a->camera.yrot) * num / den);
+  camera->rxrot = a->camera.rxrot +
+    (angle)((b->camera.rxrot - a->camera.rxrot) * num / den);
+  return 1;
+}
+
+void benchmark_add_frame(benchmark* this, Uint64 ticks) {
+  if (this->num_frames == this->frames_cap) {
+    this->frames_cap = this->frames_cap? this->frames_cap*2 : 1024;
+    this->frames = xrealloc(this->frames, sizeof(Uint64) * this->frames_cap);
+  }
+
+  this->frames[this->num_frames++] = ticks;
+}
+
+void benchmark_add_stats(benchmark* this, const cosine_world_stats* stats) {
+  this->last_stats = *stats;
+  if (stats->resident_mhive_bytes > this->peak_resident_mhive_bytes)
+    this->peak_resident_mhive_bytes = stats->resident_mhive_bytes;
+  if (stats->cached_mhive_bytes > this->peak_cached_mhive_bytes)
+    this->peak_cached_mhive_bytes = stats->cached_mhive_bytes;
+  if (stats->frame_mhive_build_micros > this->peak_frame_mhive_build_micros)
+    this->peak_frame_mhive_build_micros = stats->frame_mhive_build_micros;
+}
+
+void benchmark_set_generation_time(benchmark* this, Uint64 ticks) {
+  this->generation_time = ticks;
+}
+
+static int compare_ticks(const void* va, const void* vb) {
+  Uint64 a = *(const Uint64*)va, b = *(const Uint64*)vb;
+  return (a > b) - (a < b);
+}
+
+/* Nearest-rank percentile of the sorted frame times, in milliseconds */
+static double percentile(const Uint64* sorted, unsigned n, unsigned pc) {
+  unsigned rank = (n * pc + 99) / 100;
+
+  return n? sorted[rank? rank-1 : 0] * 1000.0 /
+    SDL_GetPerformanceFrequency() : 0.0;
+}
+
+void benchmark_write_report(const benchmark* this, const char* filename,
+                            unsigned seed) {
+  double freq = SDL_GetPerformanceFrequency();
+  Uint64* sorted;
+  Uint64 total = 0;
+  unsigned i, worst_frame = 0;
+  FILE* out;
+
+  sorted = xmalloc(sizeof(Uint64) * (this->num_frames? this->num_frames : 1));
+  memcpy(sorted, this->frames, sizeof(Uint64) * this->num_frames);
+  qsort(sorted, this->num_frames, sizeof(Uint64), compare_ticks);
+
+  for (i = 0; i < this->num_frames; ++i) {
+    total += this->frames[i];
+    if (this->frames[i] > this->frames[worst_frame])
+      worst_frame = i;
+  }
+
+  out = fopen(filename, "w");
+  if (!out)
+    err(EX_CANTCREAT, "Unable to open %s", filename);
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"seed\": %u,\n", seed);
+  fprintf(out, "  \"width\": %d,\n", BENCHMARK_WIDTH);
+  fprintf(out, "  \"height\": %d,\n", BENCHMARK_HEIGHT);
+  fprintf(out, "  \"step_chronons\": %u,\n", (unsigned)BENCHMARK_STEP);
+  fprintf(out, "  \"generation_ms\": %.3f,\n",
+          this->generation_time * 1000.0 / freq);
+  fprintf(out, "  \"frames\": %u,\n", this->num_frames);
+  fprintf(out, "  \"mean_ms\": %.3f,\n", this->num_frames?
+          total * 1000.0 / freq / this->num_frames : 0.0);
+  fprintf(out, "  \"p50_ms\": %.3f,\n", percentile(sorted, this->num_frames, 50));
+  fprintf(out, "  \"p95_ms\": %.3f,\n", percentile(sorted, this->num_frames, 95));
+  fprintf(out, "  \"p99_ms\": %.3f,\n", percentile(sorted, this->num_frames, 99));
+  fprintf(out, "  \"worst_ms\": %.3f,\n", this->num_frames?
+          this->frames[worst_frame] * 1000.0 / freq : 0.0);
+  fprintf(out, "  \"worst_frame\": %u,\n", worst_frame);
+  fprintf(out, "  \"slab_sequence_hash\": \"%016llx\",\n",
+          glm_slab_sequence_hash());
+  fprintf(out, "  \"mhive_builds\": %llu,\n",
+          this->last_stats.total_mhive_build_count);
+  fprintf(out, "  \"mhive_build_ms\": %.3f,\n",
+          this->last_stats.total_mhive_build_micros / 1000.0);
+  fprintf(out, "  \"peak_frame_mhive_build_ms\": %.3f,\n",
+          this->peak_frame_mhive_build_micros / 1000.0);
+  fprintf(out, "  \"peak_mhive_resident_mb\": %.1f,\n",
+          this->peak_resident_mhive_bytes / 1048576.0);
+  fprintf(out, "  \"peak_mhive_cached_mb\": %.1f,\n",
+          this->peak_cached_mhive_bytes / 1048576.0);
+  fprintf(out, "  \"frame_ms\": [");
+  for (i = 0; i < this->num_frames; ++i)
+    fprintf(out, "%s%s%.3f", i? "," : "", i % 16? "" : "\n    ",
+            this->frames[i] * 1000.0 / freq);
+  fprintf(out, "\n  ]\n}\n");
+
+  if (ferror(out) || fclose(out))
+    err(EX_IOERR, "Error writing %s", filename);
+
+  printf("Benchmark: %u frames; p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, "
+         "worst %.2f ms (frame %u)\n",
+         this->num_frames,
+         percentile(sorted, this->num_frames, 50),
+         percentile(sorted, this->num_frames, 95),
+         percentile(sorted, this->num_frames, 99),
+         this->num_frames? this->frames[worst_frame] * 1000.0 / freq : 0.0,
+         worst_frame);
+
+  free(sorted);
+}
+
+void benchmark_record_camera(FILE* out, chronon t,
+                             const cosine_world_camera* camera) {
+  fprintf(out, "%u %u %u %d %d\n", t, camera->x, camera->z,
+          camera->yrot, (int)camera->rxrot);
+}
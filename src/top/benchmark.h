@@ -0,0 +1,128 @@
+/*-
+ * Copyright (c) 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TOP_BENCHMARK_H_
+#define TOP_BENCHMARK_H_
+
+#include <stdio.h>
+
+#include <SDL.h>
+
+#include "math/coords.h"
+#include "cosine-world.h"
+
+/**
+ * @file
+ *
+ * Support for the headless benchmark mode, in which the world is generated
+ * from a fixed seed and a camera path is replayed through the game loop at a
+ * fixed time step, timing every frame.
+ *
+ * Camera paths are text files with one keyframe per line, of the form
+ *
+ *   time x z yrot rxrot
+ *
+ * where time is in chronons from the start of the path and the rest are as in
+ * cosine_world_camera. Keyframes must be in ascending order of time. Blank
+ * lines and lines starting with '#' are ignored. The camera is linearly
+ * interpolated between keyframes. Files in this format are produced by
+ * benchmark_record_camera().
+ */
+
+/**
+ * The amount of game time which elapses between benchmark frames.
+ */
+#define BENCHMARK_STEP (SECOND/32)
+/**
+ * The dimensions of the offscreen surface used for benchmarking.
+ */
+#define BENCHMARK_WIDTH 1280
+#define BENCHMARK_HEIGHT 720
+
+typedef struct benchmark_s benchmark;
+
+/**
+ * Creates a new benchmark which replays the camera path in the given file, or
+ * a built-in path if the filename is NULL. Exits the program if the file
+ * cannot be read or is malformed.
+ */
+benchmark* benchmark_new(const char* path_filename);
+/**
+ * Frees the memory held by the given benchmark.
+ */
+void benchmark_delete(benchmark*);
+
+/**
+ * Sets the extent of the world, in world coordinates, so that camera paths
+ * crossing its edges are interpolated the short way round. Both dimensions
+ * must be powers of two. Until this is called, coordinates are assumed to
+ * wrap at 2**32.
+ */
+void benchmark_set_world_size(benchmark*, coord w, coord h);
+
+/**
+ * Determines the camera for the given time since the start of the camera
+ * path. Returns 0 if the time is past the end of the path, in which case the
+ * camera is not modified.
+ */
+int benchmark_camera_at(const benchmark*, chronon, cosine_world_camera*);
+
+/**
+ * Records the time taken to produce one frame, in performance counter ticks
+ * (see SDL_GetPerformanceCounter()).
+ */
+void benchmark_add_frame(benchmark*, Uint64 ticks);
+/**
+ * Records the rendering statistics of the world after a frame. The report
+ * includes the peak GPU memory use and per-frame mhive build time, and the
+ * cumulative mhive build time as of the last call.
+ */
+void benchmark_add_stats(benchmark*, const cosine_world_stats*);
+/**
+ * Records the time taken to generate the world, in performance counter ticks.
+ */
+void benchmark_set_generation_time(benchmark*, Uint64 ticks);
+
+/**
+ * Writes the frame time statistics collected so far to the given file as a
+ * JSON object, and prints a one-line summary to stdout. Exits the program if
+ * the file cannot be written.
+ *
+ * The report includes glm_slab_sequence_hash(). Two runs with the same seed
+ * and camera path must report the same value; if they do not, some slab
+ * producer's draw order depends on thread timing.
+ */
+void benchmark_write_report(const benchmark*, const char* filename,
+                            unsigned seed);
+
+/**
+ * Appends a keyframe for the given camera at the given time to the given
+ * camera path file.
+ */
+void benchmark_record_camera(FILE*, chronon, const cosine_world_camera*);
+
+#endif /* TOP_BENCHMARK_H_ */
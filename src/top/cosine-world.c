@@ -31,6 +31,7 @@
 
 #include <SDL.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -39,6 +40,7 @@
 #include "math/rand.h"
 #include "defs.h"
 #include "micromp.h"
+#include "trace.h"
 
 #include "graphics/canvas.h"
 #include "graphics/parchment.h"
@@ -50,6 +52,8 @@
 #include "world/nfa-turtle-vmap-painter.h"
 #include "world/world-object-distributor.h"
 #include "world/flower-map.h"
+#include "world/snapshot.h"
+#include "world/world-cache.h"
 #include "gl/marshal.h"
 #include "gl/auxbuff.h"
 #include "render/context.h"
@@ -81,6 +85,7 @@
 typedef struct {
   game_state self;
   unsigned seed;
+  unsigned long long cache_key;
   int is_running;
   coord x, z;
   chronon now;
@@ -112,12 +117,21 @@ static void cosine_world_draw(cosine_world_state*, canvas*);
 static void cosine_world_key(cosine_world_state*, SDL_KeyboardEvent*);
 static void cosine_world_mmotion(cosine_world_state*, SDL_MouseMotionEvent*);
 
+static int cosine_world_load_world(cosine_world_state*);
 static void cosine_world_init_world(cosine_world_state*);
 static void cosine_world_delete(cosine_world_state*);
 
+const char* cosine_world_load_snapshot;
+const char* cosine_world_save_snapshot;
+const char* cosine_world_cache_directory;
+size_t cosine_world_cache_max_size = WORLD_CACHE_DEFAULT_MAX_SIZE;
+size_t cosine_world_mhive_cache_budget =
+  ENV_VMAP_MANIFOLD_RENDERER_DEFAULT_CACHE_BUDGET_BYTES;
+
 game_state* cosine_world_new(unsigned seed) {
   const vc3 origin = { 0, 0, 0 };
   cosine_world_state* this = zxmalloc(sizeof(cosine_world_state));
+  int loaded;
 
   this->self.update = (game_state_update_t)cosine_world_update;
   this->self.predraw = (game_state_predraw_t)cosine_world_predraw;
@@ -127,9 +141,6 @@ game_state* cosine_world_new(unsigned seed) {
   this->seed = seed;
   this->is_running = 1;
   this->bg = parchment_new();
-  this->world = terrain_tilemap_new(SIZE, SIZE, SIZE/256, SIZE/256);
-  this->vmap = env_vmap_new(SIZE, SIZE, 1);
-  this->flowers = flower_map_new(SIZE, SIZE);
   this->sky = skybox_new(seed + 7512);
   this->context = rendering_context_new();
   this->camera_y_off = 7 * METRE / 4;
@@ -137,17 +148,12 @@ game_state* cosine_world_new(unsigned seed) {
   this->use_parchment = 1;
   parchment_set_interpolate_postprocess(this->bg, 1 != PAINT_SIZE_REDUCTION);
 
-  this->vmap_manifold_renderer = env_vmap_manifold_renderer_new(
-    this->vmap, (const env_voxel_graphic*const*)&res_voxel_graphics,
-    origin, this->world,
-    (coord(*)(const void*,coord,coord))terrain_base_y);
-  this->flower_renderer = flower_map_renderer_new(
-    this->flowers, res_flower_graphics, this->world);
-
+  /* The scripts must be loaded before the world, since they are part of what
+   * identifies a cached world.
+   */
   rl_clear();
   rl_set_frozen(0);
   ntvp_clear_all();
-  wod_init(this->world, this->flowers, seed + 6420);
   lluas_init();
   lluas_load_file("share/llua/core.lua", 65536);
   lluas_load_file("share/llua/oak-tree.lua", 65536);
@@ -159,7 +165,26 @@ game_state* cosine_world_new(unsigned seed) {
     errx(EX_SOFTWARE, "Lluas not OK, aborting");
   rl_set_frozen(1);
 
-  cosine_world_init_world(this);
+  loaded = cosine_world_load_world(this);
+  if (!loaded) {
+    this->world = terrain_tilemap_new(SIZE, SIZE, SIZE/256, SIZE/256);
+    this->vmap = env_vmap_new_sparse(SIZE, SIZE, 1);
+    env_vmap_track_occupancy(this->vmap);
+    this->flowers = flower_map_new(SIZE, SIZE);
+  }
+  wod_init(this->world, this->flowers, seed + 6420);
+
+  this->vmap_manifold_renderer = env_vmap_manifold_renderer_new(
+    this->vmap, (const env_voxel_graphic*const*)&res_voxel_graphics,
+    origin, this->world,
+    (coord(*)(const void*,coord,coord))terrain_base_y);
+  env_vmap_manifold_renderer_set_cache_budget(
+    this->vmap_manifold_renderer, cosine_world_mhive_cache_budget);
+  this->flower_renderer = flower_map_renderer_new(
+    this->flowers, res_flower_graphics, this->world);
+
+  if (!loaded)
+    cosine_world_init_world(this);
   mouselook_set(1);
 
   return (game_state*)this;
@@ -178,6 +203,28 @@ static void cosine_world_delete(cosine_world_state* this) {
   free(this);
 }
 
+/* Tries to obtain the world from an explicit snapshot or the world cache
+ * instead of generating it. Returns whether it succeeded.
+ */
+static int cosine_world_load_world(cosine_world_state* this) {
+  static const unsigned params[] = { SIZE };
+
+  this->cache_key = world_cache_key(this->seed, lluas_get_chunk_hash(),
+                                    params, sizeof(params));
+
+  if (cosine_world_load_snapshot) {
+    if (world_snapshot_load(&this->world, &this->vmap, &this->flowers,
+                            cosine_world_load_snapshot, this->cache_key)) {
+      printf("Loaded world from %s\n", cosine_world_load_snapshot);
+      return 1;
+    }
+  }
+
+  return cosine_world_cache_directory &&
+    world_cache_load(&this->world, &this->vmap, &this->flowers,
+                     cosine_world_cache_directory, this->cache_key);
+}
+
 static void cosine_world_init_world(cosine_world_state* this) {
   unsigned seed = this->seed;
   world_generate(this->world, seed);
@@ -187,7 +234,59 @@ static void cosine_world_init_world(cosine_world_state* this) {
   vmap_painter_flush();
 
   world_add_shadow(this->world, this->vmap);
+  printf("Vmap: %lu of %lu MB committed\n",
+         (unsigned long)(env_vmap_committed_bytes(this->vmap) >> 20),
+         (unsigned long)((size_t)SIZE * SIZE * ENV_VMAP_H >> 20));
   terrain_tilemap_calc_next(this->world);
+
+  if (cosine_world_save_snapshot)
+    world_snapshot_save(cosine_world_save_snapshot, this->cache_key,
+                        this->world, this->vmap, this->flowers);
+  if (cosine_world_cache_directory)
+    world_cache_store(cosine_world_cache_directory, this->cache_key,
+                      cosine_world_cache_max_size,
+                      this->world, this->vmap, this->flowers);
+}
+
+void cosine_world_get_camera(const game_state* gthis,
+                             cosine_world_camera* camera) {
+  const cosine_world_state* this = (const cosine_world_state*)gthis;
+
+  camera->x = this->x;
+  camera->z = this->z;
+  camera->yrot = this->look.yrot;
+  camera->rxrot = this->look.rxrot;
+}
+
+void cosine_world_set_camera(game_state* gthis,
+                             const cosine_world_camera* camera) {
+  cosine_world_state* this = (cosine_world_state*)gthis;
+
+  this->x = camera->x & (this->world->xmax*TILE_SZ - 1);
+  this->z = camera->z & (this->world->zmax*TILE_SZ - 1);
+  this->look.yrot = camera->yrot;
+  this->look.rxrot = camera->rxrot;
+}
+
+void cosine_world_get_size(const game_state* gthis, coord* w, coord* h) {
+  const cosine_world_state* this = (const cosine_world_state*)gthis;
+
+  *w = this->world->xmax*TILE_SZ;
+  *h = this->world->zmax*TILE_SZ;
+}
+
+void cosine_world_get_stats(const game_state* gthis,
+                            cosine_world_stats* stats) {
+  const cosine_world_state* this = (const cosine_world_state*)gthis;
+  const env_vmap_manifold_renderer* r = this->vmap_manifold_renderer;
+
+  stats->frame_mhive_build_micros = r->frame_build_micros;
+  stats->frame_mhive_build_count = r->frame_build_count;
+  stats->total_mhive_build_micros = r->total_build_micros;
+  stats->total_mhive_build_count = r->total_build_count;
+  stats->wanted_mhive_builds = r->num_wanted_builds;
+  stats->resident_mhive_bytes = r->resident_gpu_bytes;
+  stats->cached_mhive_bytes = r->cached_gpu_bytes;
 }
 
 #define SPEED (4*METRES_PER_SECOND)
@@ -285,6 +384,7 @@ static void cosine_world_draw(cosine_world_state* this, canvas* dst) {
    */
   static canvas before_paint_overlay;
   static canvas after_paint_overlay;
+  Uint64 start;
 
   canvas_init_thin(&before_paint_overlay,
                    dst->w/RENDER_SIZE_REDUCTION, dst->h/RENDER_SIZE_REDUCTION);
@@ -300,13 +400,23 @@ static void cosine_world_draw(cosine_world_state* this, canvas* dst) {
     auxbuff_target(0, dst->w, dst->h);
 
   glm_clear(GL_DEPTH_BUFFER_BIT);
+  start = trace_begin();
   skybox_render(&before_paint_overlay, this->sky, this->context);
+  trace_end("skybox", start);
+  start = trace_begin();
   render_terrain_tilemap(&before_paint_overlay, this->world, this->context);
+  trace_end("terrain", start);
+  start = trace_begin();
   render_env_vmap_manifolds(
     &before_paint_overlay, this->vmap_manifold_renderer, this->context);
+  trace_end("manifolds", start);
+  start = trace_begin();
   render_flower_map(&before_paint_overlay, this->flower_renderer,
                     this->context);
+  trace_end("flowers", start);
+  start = trace_begin();
   ump_join();
+  trace_end("ump_join", start);
 
   if (this->use_paint_overlay) {
     if (this->use_parchment)
@@ -28,7 +28,81 @@
 #ifndef TOP_COSINE_WORLD_H_
 #define TOP_COSINE_WORLD_H_
 
+#include <stdlib.h>
+
 #include "game-state.h"
+#include "math/coords.h"
+
+/**
+ * The position and orientation of the camera in the cosine world.
+ */
+typedef struct {
+  /**
+   * The position of the camera on the (X,Z) plane. The camera's altitude is
+   * always determined by the terrain beneath it.
+   */
+  coord x, z;
+  /**
+   * The rotation about the Y axis, in the "long" form used by mouselook.
+   */
+  signed yrot;
+  /**
+   * The rotation about the X axis, from -DEG_90 to +DEG_90.
+   */
+  angle rxrot;
+} cosine_world_camera;
+
+/**
+ * If non-NULL, cosine_world_new() tries to load the world from the snapshot
+ * file of this name (see world/snapshot.h) instead of generating it. The
+ * snapshot is only used if it has the same cache key as the world which would
+ * be generated (see world/world-cache.h). Defaults to NULL.
+ */
+extern const char* cosine_world_load_snapshot;
+/**
+ * If non-NULL, cosine_world_new() saves a snapshot of every world it
+ * generates to the file of this name. Defaults to NULL.
+ */
+extern const char* cosine_world_save_snapshot;
+/**
+ * If non-NULL, the directory of the world cache (see world/world-cache.h)
+ * consulted by cosine_world_new() before generating a world, and into which
+ * every generated world is stored. Defaults to NULL.
+ */
+extern const char* cosine_world_cache_directory;
+/**
+ * The size limit, in bytes, of the world cache; see world_cache_store().
+ * Defaults to WORLD_CACHE_DEFAULT_MAX_SIZE.
+ */
+extern size_t cosine_world_cache_max_size;
+/**
+ * The cache budget, in bytes, of the manifold renderer of every new cosine
+ * world (see env_vmap_manifold_renderer_set_cache_budget()). Defaults to
+ * ENV_VMAP_MANIFOLD_RENDERER_DEFAULT_CACHE_BUDGET_BYTES.
+ */
+extern size_t cosine_world_mhive_cache_budget;
+
+/**
+ * Rendering statistics of a cosine world, for reporting.
+ */
+typedef struct {
+  /**
+   * The time spent building mhives and the number installed in the most
+   * recent frame, and the cumulative totals over all frames. Times are in
+   * microseconds summed over all threads involved.
+   */
+  unsigned frame_mhive_build_micros, frame_mhive_build_count;
+  unsigned long long total_mhive_build_micros, total_mhive_build_count;
+  /**
+   * The number of mhives which were missing or at the wrong level of detail
+   * as of the most recent frame.
+   */
+  unsigned wanted_mhive_builds;
+  /**
+   * The GPU memory held by mhives in use, and by cached mhives not in use.
+   */
+  size_t resident_mhive_bytes, cached_mhive_bytes;
+} cosine_world_stats;
 
 /**
  * Creates a new instance of the "cosine world" demo, which runs until the ESC
@@ -36,4 +110,23 @@
  */
 game_state* cosine_world_new(unsigned seed);
 
+/**
+ * Retrieves the current camera of the given cosine world state.
+ */
+void cosine_world_get_camera(const game_state*, cosine_world_camera*);
+/**
+ * Moves the camera of the given cosine world state. This is equivalent to the
+ * camera having arrived there by normal input.
+ */
+void cosine_world_set_camera(game_state*, const cosine_world_camera*);
+/**
+ * Retrieves the extent of the given cosine world's (toroidal) terrain in world
+ * coordinates. Camera coordinates wrap at these values.
+ */
+void cosine_world_get_size(const game_state*, coord* w, coord* h);
+/**
+ * Retrieves the current rendering statistics of the given cosine world.
+ */
+void cosine_world_get_stats(const game_state*, cosine_world_stats*);
+
 #endif /* TOP_COSINE_WORLD_H_ */
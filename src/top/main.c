@@ -63,13 +63,21 @@
 #include "gl/auxbuff.h"
 #include "control/mouselook.h"
 #include "render/terrabuff.h"
+#include "render/env-vmap-manifold-renderer.h"
+#include "world/generate.h"
+#include "world/world-cache.h"
 #include "game-state.h"
 #include "cosine-world.h"
+#include "benchmark.h"
 #include "micromp.h"
+#include "trace.h"
 
 static game_state* update(game_state*);
 static void draw(canvas*, game_state*, SDL_Window*);
 static int handle_input(game_state*);
+static void run_benchmark(canvas*, SDL_Window*, unsigned seed,
+                          const char* path_filename,
+                          const char* out_filename);
 
 static void start_render_thread(void);
 static int render_thread_main(void*);
@@ -84,6 +92,9 @@ static void invoke_draw_on_render_thread(canvas*, game_state*);
  */
 static int might_be_zaphod = 1;
 
+/* If non-NULL, where to write the frame trace when requested or on exit */
+static const char* trace_filename;
+
 static int parse_x11_screen(signed* screen, const char* display) {
   if (!display) return 0;
 
@@ -204,6 +215,34 @@ void select_window_bounds(SDL_Rect* window_bounds) {
   window_bounds->h = 480;
 }
 
+static void usage(void) {
+  errx(EX_USAGE,
+       "Usage: mantigraphia [options] [seed]\n"
+       "Options:\n"
+       "  --legacy-worldgen       Use the original serial world generator\n"
+       "  --benchmark             Run headless, replaying a camera path and\n"
+       "                          timing each frame\n"
+       "  --benchmark-path FILE   Camera path to replay (default built in)\n"
+       "  --benchmark-out FILE    Where to write frame timings\n"
+       "                          (default benchmark.json)\n"
+       "  --record-camera FILE    Record the camera path to FILE\n"
+       "  --load-world FILE       Load the world from a snapshot instead of\n"
+       "                          generating it, if it matches the seed\n"
+       "                          and scripts\n"
+       "  --save-world FILE       Save a snapshot of the generated world\n"
+       "  --world-cache DIR       Where to cache generated worlds (default\n"
+       "                          $XDG_CACHE_HOME/mantigraphia/worlds)\n"
+       "  --world-cache-size MB   Evict the least recently used cached worlds\n"
+       "                          beyond this much disk space (default 1024)\n"
+       "  --no-world-cache        Always generate the world, and don't cache it\n"
+       "  --mhive-build-budget US Microseconds per frame which background\n"
+       "                          mhive builds may occupy (default 4000)\n"
+       "  --mhive-cache-budget MB GPU memory for cached mhives not in use\n"
+       "                          (default 64; 0 disables the cache)\n"
+       "  --trace FILE            Record per-stage frame timings, writing\n"
+       "                          them to FILE on exit or on Print Screen");
+}
+
 int main(int argc, char** argv) {
   unsigned ww, wh;
   SDL_Window* screen;
@@ -214,24 +253,103 @@ int main(int argc, char** argv) {
   GLenum glew_status;
   SDL_Rect window_bounds;
   unsigned last_fps_report, frames_since_fps_report;
+  unsigned mhives_since_fps_report, mhive_micros_since_fps_report;
+  unsigned seed = 3;
+  int i;
+  int benchmark_mode = 0;
+  const char* benchmark_path = NULL;
+  const char* benchmark_out = "benchmark.json";
+  FILE* camera_recording = NULL;
+  cosine_world_camera camera;
+  cosine_world_stats stats;
+  unsigned recording_start;
+  Uint64 trace_start;
+
+  cosine_world_cache_directory = world_cache_default_directory();
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--legacy-worldgen")) {
+      world_generate_legacy = 1;
+    } else if (!strcmp(argv[i], "--benchmark")) {
+      benchmark_mode = 1;
+    } else if (!strcmp(argv[i], "--benchmark-path")) {
+      if (++i == argc) usage();
+      benchmark_path = argv[i];
+    } else if (!strcmp(argv[i], "--benchmark-out")) {
+      if (++i == argc) usage();
+      benchmark_out = argv[i];
+    } else if (!strcmp(argv[i], "--record-camera")) {
+      if (++i == argc) usage();
+      camera_recording = fopen(argv[i], "w");
+      if (!camera_recording)
+        err(EX_CANTCREAT, "Unable to open %s", argv[i]);
+    } else if (!strcmp(argv[i], "--load-world")) {
+      if (++i == argc) usage();
+      cosine_world_load_snapshot = argv[i];
+    } else if (!strcmp(argv[i], "--save-world")) {
+      if (++i == argc) usage();
+      cosine_world_save_snapshot = argv[i];
+    } else if (!strcmp(argv[i], "--world-cache")) {
+      if (++i == argc) usage();
+      cosine_world_cache_directory = argv[i];
+    } else if (!strcmp(argv[i], "--world-cache-size")) {
+      if (++i == argc) usage();
+      cosine_world_cache_max_size = (size_t)atoi(argv[i]) << 20;
+    } else if (!strcmp(argv[i], "--no-world-cache")) {
+      cosine_world_cache_directory = NULL;
+    } else if (!strcmp(argv[i], "--mhive-build-budget")) {
+      if (++i == argc) usage();
+      env_vmap_manifold_renderer_set_build_budget(atoi(argv[i]));
+    } else if (!strcmp(argv[i], "--mhive-cache-budget")) {
+      if (++i == argc) usage();
+      cosine_world_mhive_cache_budget = (size_t)atoi(argv[i]) << 20;
+    } else if (!strcmp(argv[i], "--trace")) {
+      if (++i == argc) usage();
+      trace_filename = argv[i];
+    } else if ('-' == argv[i][0]) {
+      usage();
+    } else {
+      seed = atoi(argv[i]);
+    }
+  }
+
+  /* Benchmarks need to run without a display, eg under Mesa's llvmpipe, so
+   * ask for SDL's offscreen (EGL) video driver unless the environment
+   * explicitly selects another.
+   */
+  if (benchmark_mode)
+    SDL_setenv("SDL_VIDEODRIVER", "offscreen", 0);
 
-  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO))
+  if (SDL_Init(benchmark_mode? SDL_INIT_VIDEO :
+               SDL_INIT_VIDEO | SDL_INIT_AUDIO))
     errx(EX_SOFTWARE, "Unable to initialise SDL: %s", SDL_GetError());
 
   atexit(SDL_Quit);
 
+  trace_init();
+  trace_set_thread_name("main");
+  trace_set_enabled(!!trace_filename);
+
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
                       SDL_GL_CONTEXT_PROFILE_CORE);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
 
-  select_window_bounds(&window_bounds);
+  if (benchmark_mode) {
+    window_bounds.x = SDL_WINDOWPOS_UNDEFINED;
+    window_bounds.y = SDL_WINDOWPOS_UNDEFINED;
+    window_bounds.w = BENCHMARK_WIDTH;
+    window_bounds.h = BENCHMARK_HEIGHT;
+  } else {
+    select_window_bounds(&window_bounds);
+  }
   screen = SDL_CreateWindow("Mantigraphia",
                             window_bounds.x,
                             window_bounds.y,
                             window_bounds.w,
                             window_bounds.h,
-                            SDL_WINDOW_OPENGL);
+                            SDL_WINDOW_OPENGL |
+                            (benchmark_mode? SDL_WINDOW_HIDDEN : 0));
   if (!screen)
     errx(EX_OSERR, "Unable to create window: %s", SDL_GetError());
 
@@ -260,35 +378,115 @@ int main(int argc, char** argv) {
   canvas_init_thin(&canv, ww, wh);
   canvas_gl_clip_sub_immediate(&canv, &canv);
 
-  ump_init(SDL_GetCPUCount()-1);
+  ump_init(ump_recommended_num_workers());
+  ump_pin_reserved_thread(UMP_RESERVED_GL);
   glinfo_detect(wh);
   glm_init();
   auxbuff_init(ww, wh);
   parchment_init();
-  mouselook_init(screen);
+  /* There is no mouse to grab when running headless */
+  if (!benchmark_mode)
+    mouselook_init(screen);
   terrabuff_init();
   start_render_thread();
 
-  state = cosine_world_new(2 == argc? atoi(argv[1]) : 3);
+  if (benchmark_mode) {
+    run_benchmark(&canv, screen, seed, benchmark_path, benchmark_out);
+    if (trace_filename) trace_dump(trace_filename);
+    return 0;
+  }
+
+  state = cosine_world_new(seed);
 
-  last_fps_report = SDL_GetTicks();
+  last_fps_report = recording_start = SDL_GetTicks();
   frames_since_fps_report = 0;
+  mhives_since_fps_report = mhive_micros_since_fps_report = 0;
   do {
     draw(&canv, state, screen);
     if (handle_input(state)) break; /* quit */
+    trace_start = trace_begin();
     state = update(state);
+    trace_end("update", trace_start);
+
+    if (camera_recording && state) {
+      cosine_world_get_camera(state, &camera);
+      benchmark_record_camera(
+        camera_recording,
+        (unsigned long long)(SDL_GetTicks() - recording_start) *
+        SECOND / 1000,
+        &camera);
+    }
+
+    if (!state) break;
 
     ++frames_since_fps_report;
+    cosine_world_get_stats(state, &stats);
+    mhives_since_fps_report += stats.frame_mhive_build_count;
+    mhive_micros_since_fps_report += stats.frame_mhive_build_micros;
     if (SDL_GetTicks() - last_fps_report >= 3000) {
-      printf("FPS: %d\n", frames_since_fps_report/3);
+      printf("FPS: %d; mhives: %u built, %u us/frame building, %u wanted, "
+             "%lu MB resident, %lu MB cached\n",
+             frames_since_fps_report/3,
+             mhives_since_fps_report,
+             mhive_micros_since_fps_report / frames_since_fps_report,
+             stats.wanted_mhive_builds,
+             (unsigned long)(stats.resident_mhive_bytes >> 20),
+             (unsigned long)(stats.cached_mhive_bytes >> 20));
       frames_since_fps_report = 0;
+      mhives_since_fps_report = mhive_micros_since_fps_report = 0;
       last_fps_report = SDL_GetTicks();
     }
   } while (state);
 
+  if (camera_recording && fclose(camera_recording))
+    warn("Error writing camera recording");
+
+  if (trace_filename) trace_dump(trace_filename);
+
   return 0;
 }
 
+static void run_benchmark(canvas* canv, SDL_Window* screen, unsigned seed,
+                          const char* path_filename,
+                          const char* out_filename) {
+  benchmark* bench = benchmark_new(path_filename);
+  game_state* state;
+  cosine_world_camera camera;
+  cosine_world_stats stats;
+  coord world_w, world_h;
+  chronon now = 0;
+  Uint64 start;
+
+  start = SDL_GetPerformanceCounter();
+  state = cosine_world_new(seed);
+  benchmark_set_generation_time(bench, SDL_GetPerformanceCounter() - start);
+  if (state) {
+    cosine_world_get_size(state, &world_w, &world_h);
+    benchmark_set_world_size(bench, world_w, world_h);
+  }
+
+  while (state && benchmark_camera_at(bench, now, &camera)) {
+    cosine_world_set_camera(state, &camera);
+
+    start = SDL_GetPerformanceCounter();
+    draw(canv, state, screen);
+    /* Make sure the frame is really done, rather than merely submitted */
+    glFinish();
+    benchmark_add_frame(bench, SDL_GetPerformanceCounter() - start);
+    cosine_world_get_stats(state, &stats);
+    benchmark_add_stats(bench, &stats);
+
+    if (handle_input(state)) break;
+    start = trace_begin();
+    state = (*state->update)(state, BENCHMARK_STEP);
+    trace_end("update", start);
+    now += BENCHMARK_STEP;
+  }
+
+  benchmark_write_report(bench, out_filename, seed);
+  benchmark_delete(bench);
+}
+
 static game_state* update(game_state* state) {
   static chronon prev;
   chronon now, elapsed;
@@ -313,22 +511,37 @@ static game_state* update(game_state* state) {
 
 static void draw(canvas* canv, game_state* state,
                  SDL_Window* screen) {
+  Uint64 frame_start, start;
+
+  frame_start = start = trace_begin();
   (*state->predraw)(state, canv);
+  trace_end("predraw", start);
   invoke_draw_on_render_thread(canv, state);
   /* Process OpenGL commands until the rendering thread calls glm_done() and
    * all the GL work itself is complete.
    */
+  start = trace_begin();
   glm_main();
+  trace_end("glm_main", start);
+  start = trace_begin();
   SDL_GL_SwapWindow(screen);
+  trace_end("swap", start);
+  trace_end("frame", frame_start);
 }
 
 static int handle_input(game_state* state) {
   SDL_Event evt;
+  Uint64 start = trace_begin();
 
   while (SDL_PollEvent(&evt)) {
     switch (evt.type) {
     case SDL_QUIT: return 1;
     case SDL_KEYDOWN:
+      if (SDLK_PRINTSCREEN == evt.key.keysym.sym && trace_filename) {
+        trace_dump(trace_filename);
+        break;
+      }
+      /* fall through */
     case SDL_KEYUP:
       if (state->key)
         (*state->key)(state, &evt.key);
@@ -364,6 +577,7 @@ static int handle_input(game_state* state) {
     }
   }
 
+  trace_end("input", start);
   return 0; /* continue running */
 }
 
@@ -401,6 +615,10 @@ static void start_render_thread(void) {
 static int render_thread_main(void* ignored) {
   canvas* canv;
   game_state* state;
+  Uint64 start;
+
+  ump_pin_reserved_thread(UMP_RESERVED_RENDER);
+  trace_set_thread_name("render");
 
   for (;;) {
     if (SDL_LockMutex(render_thread_lock))
@@ -421,7 +639,9 @@ static int render_thread_main(void* ignored) {
       errx(EX_SOFTWARE, "Failed to release rendering lock: %s",
            SDL_GetError());
 
+    start = trace_begin();
     (*state->draw)(state, canv);
+    trace_end("draw", start);
     /* Assume that any threads involved in drawing have already called
      * glm_finish_thread(). While we *could* try to do that here, the fact that
      * a thread might not have run (ie, due to impersonation) complicates
@@ -0,0 +1,201 @@
+/*-
+ * Copyright (c) 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <SDL.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsd.h"
+#include "alloc.h"
+#include "trace.h"
+
+/* Must be a power of two */
+#define TRACE_RING_SIZE 16384
+
+typedef struct {
+  const char* name;
+  const void* arg;
+  Uint64 start, end;
+} trace_event;
+
+/* Each thread has exactly one ring, which only it writes. Rings are never
+ * freed, since trace_dump() may read them at any time, even after their
+ * threads have exited.
+ */
+typedef struct trace_ring_s {
+  struct trace_ring_s* next;
+  unsigned tid;
+  char name[32];
+  /* The number of events ever recorded to this ring. Event n lives at
+   * events[n % TRACE_RING_SIZE]; it is written before head is advanced past
+   * it.
+   */
+  SDL_atomic_t head;
+  /* Allocated when the first event is recorded, so that threads which never
+   * record anything don't cost a whole ring.
+   */
+  trace_event*volatile events;
+} trace_ring;
+
+int trace_enabled;
+static SDL_TLSID ring_tls;
+static trace_ring*volatile rings;
+static SDL_atomic_t next_tid;
+static Uint64 base_time;
+
+void trace_init(void) {
+  ring_tls = SDL_TLSCreate();
+  if (!ring_tls)
+    errx(EX_SOFTWARE, "Unable to allocate TLS object: %s", SDL_GetError());
+
+  base_time = SDL_GetPerformanceCounter();
+}
+
+void trace_set_enabled(int enabled) {
+  trace_enabled = enabled;
+}
+
+static trace_ring* get_ring(void) {
+  trace_ring* ring = SDL_TLSGet(ring_tls);
+
+  if (!ring) {
+    ring = zxmalloc(sizeof(trace_ring));
+    ring->tid = SDL_AtomicAdd(&next_tid, 1) + 1;
+    snprintf(ring->name, sizeof(ring->name), "thread %u", ring->tid);
+    SDL_TLSSet(ring_tls, ring, NULL);
+
+    do {
+      ring->next = rings;
+    } while (!SDL_AtomicCASPtr((void**)&rings, ring->next, ring));
+  }
+
+  return ring;
+}
+
+void trace_set_thread_name(const char* name) {
+  trace_ring* ring = get_ring();
+
+  snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+void trace_record(const char* name, const void* arg, Uint64 start) {
+  trace_ring* ring = get_ring();
+  trace_event* evt;
+  int head;
+
+  if (!ring->events)
+    ring->events = xmalloc(sizeof(trace_event) * TRACE_RING_SIZE);
+
+  head = SDL_AtomicGet(&ring->head);
+  evt = ring->events + (head & (TRACE_RING_SIZE-1));
+  evt->name = name;
+  evt->arg = arg;
+  evt->start = start;
+  evt->end = SDL_GetPerformanceCounter();
+  SDL_AtomicSet(&ring->head, head + 1);
+}
+
+/* Writes str as a JSON string, dropping anything that would need escaping */
+static void write_json_string(FILE* out, const char* str) {
+  putc('"', out);
+  for (; *str; ++str)
+    if ('"' != *str && '\\' != *str && (unsigned char)*str >= ' ')
+      putc(*str, out);
+  putc('"', out);
+}
+
+int trace_dump(const char* filename) {
+  double to_micros = 1000000.0 / SDL_GetPerformanceFrequency();
+  trace_event* copy;
+  trace_ring* ring;
+  unsigned begin, end, valid_from, i;
+  int first = 1;
+  FILE* out;
+
+  out = fopen(filename, "w");
+  if (!out) {
+    warn("Unable to open %s", filename);
+    return 0;
+  }
+
+  copy = xmalloc(sizeof(trace_event) * TRACE_RING_SIZE);
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  for (ring = rings; ring; ring = ring->next) {
+    fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%u,\"args\":{\"name\":", first? "" : ",", ring->tid);
+    write_json_string(out, ring->name);
+    fprintf(out, "}}");
+    first = 0;
+
+    end = SDL_AtomicGet(&ring->head);
+    if (!end || !ring->events) continue;
+
+    begin = end > TRACE_RING_SIZE? end - TRACE_RING_SIZE : 0;
+    for (i = begin; i < end; ++i)
+      copy[i & (TRACE_RING_SIZE-1)] = ring->events[i & (TRACE_RING_SIZE-1)];
+
+    /* The owning thread may have overwritten some of what was just copied,
+     * and may be in the middle of writing the slot after the new head.
+     */
+    valid_from = SDL_AtomicGet(&ring->head) + 1;
+    valid_from = valid_from > TRACE_RING_SIZE?
+      valid_from - TRACE_RING_SIZE : 0;
+    if (valid_from > begin) begin = valid_from;
+
+    for (i = begin; i < end; ++i) {
+      const trace_event* evt = copy + (i & (TRACE_RING_SIZE-1));
+
+      fprintf(out, ",\n{\"name\":");
+      write_json_string(out, evt->name);
+      fprintf(out, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+              "\"ts\":%.3f,\"dur\":%.3f",
+              ring->tid,
+              (double)(evt->start - base_time) * to_micros,
+              (double)(evt->end - evt->start) * to_micros);
+      if (evt->arg)
+        fprintf(out, ",\"args\":{\"arg\":\"%p\"}", evt->arg);
+      fprintf(out, "}");
+    }
+  }
+
+  fprintf(out, "\n]}\n");
+  free(copy);
+
+  if (ferror(out) | fclose(out)) {
+    warn("Error writing %s", filename);
+    return 0;
+  }
+
+  return 1;
+}
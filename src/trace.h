@@ -0,0 +1,112 @@
+/*-
+ * Copyright (c) 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <SDL.h>
+
+/**
+ * @file
+ *
+ * Lightweight instrumentation of where time goes within a frame.
+ *
+ * A scope is instrumented as
+ *
+ *   Uint64 start = trace_begin();
+ *   ...
+ *   trace_end("name", start);
+ *
+ * Each completed scope is recorded, with its thread, into a lock-free ring
+ * buffer private to the thread which executed it; when a ring fills up, the
+ * oldest scopes are overwritten. trace_dump() writes everything currently
+ * held in the rings in the Chrome trace event format, which can be loaded
+ * into chrome://tracing or Perfetto.
+ *
+ * When tracing is disabled, trace_begin() and trace_end() cost one test of a
+ * global each, so instrumentation can remain in production builds. Scopes
+ * which begin while tracing is disabled are never recorded, so tracing may be
+ * enabled at any time.
+ */
+
+/**
+ * Whether tracing is currently enabled. Read-only outside of trace.c; use
+ * trace_set_enabled().
+ */
+extern int trace_enabled;
+
+/**
+ * Initialises the tracing system. Must be called before any other thread is
+ * started.
+ */
+void trace_init(void);
+/**
+ * Enables or disables the recording of scopes.
+ */
+void trace_set_enabled(int);
+/**
+ * Names the calling thread in trace dumps. The name is copied.
+ */
+void trace_set_thread_name(const char*);
+
+void trace_record(const char* name, const void* arg, Uint64 start);
+
+/**
+ * Begins a scope. Returns a token to pass to trace_end(), which is zero if
+ * tracing is disabled.
+ */
+static inline Uint64 trace_begin(void) {
+  return trace_enabled? SDL_GetPerformanceCounter() : 0;
+}
+
+/**
+ * Ends a scope started by trace_begin(), recording it under the given name,
+ * which MUST be a string with static storage duration.
+ */
+static inline void trace_end(const char* name, Uint64 start) {
+  if (start) trace_record(name, NULL, start);
+}
+
+/**
+ * Like trace_end(), but also records an arbitrary pointer with the scope,
+ * such as the function which was executed. It is written as a hex address,
+ * which can be resolved with addr2line or similar.
+ */
+static inline void trace_end_with(const char* name, const void* arg,
+                                  Uint64 start) {
+  if (start) trace_record(name, arg, start);
+}
+
+/**
+ * Writes all scopes currently held by every thread's ring to the given file
+ * in Chrome trace event (JSON) format. Other threads may continue recording
+ * while this runs. Returns whether the file was written successfully; on
+ * failure, a warning is printed.
+ */
+int trace_dump(const char* filename);
+
+#endif /* TRACE_H_ */
@@ -31,8 +31,25 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+#include <sysexits.h>
+
+#if defined(HAVE_MMAP) && defined(HAVE_MINCORE)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_SPARSE_STORAGE 1
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
 
 #include "../alloc.h"
+#include "../defs.h"
 #include "../micromp.h"
 #include "../math/coords.h"
 #include "env-vmap.h"
@@ -57,31 +74,325 @@ static inline unsigned env_vmap_visibility4_offset(
     x/4 * (ENV_VMAP_H/4) + y/4;
 }
 
+size_t env_vmap_storage_size(coord xmax, coord zmax) {
+  size_t voxels_sz = sizeof(env_voxel_type) * xmax * zmax * ENV_VMAP_H;
+  size_t visibility2_sz = (size_t)(xmax/2) * (zmax/2) * (ENV_VMAP_H/2) / 4;
+  size_t visibility4_sz = (size_t)(xmax/4) * (zmax/4) * (ENV_VMAP_H/4) / 4;
+
+  return voxels_sz + visibility2_sz + visibility4_sz;
+}
+
+size_t env_vmap_column_occupancy_size(coord xmax, coord zmax) {
+  return sizeof(unsigned) * xmax * zmax;
+}
+
+size_t env_vmap_supercell_occupancy_size(coord xmax, coord zmax) {
+  return (size_t)(xmax/4) * (zmax/4);
+}
+
+#ifdef HAVE_SPARSE_STORAGE
+/* Reserves sz bytes of zero-initialised memory without committing any of
+ * it. The memory is page-aligned, and thus cache-line-aligned.
+ */
+static void* sparse_alloc(size_t sz) {
+  void* ret = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == ret)
+    err(EX_UNAVAILABLE, "Failed to reserve %lu bytes for vmap",
+        (unsigned long)sz);
+
+  return ret;
+}
+
+/* Maps sz bytes of the given file at the given offset, privately, so writes
+ * are never carried through to the file. Returns NULL and sets errno on
+ * failure.
+ */
+static void* sparse_map(int fd, off_t offset, size_t sz) {
+  void* ret = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_NORESERVE, fd, offset);
+  return MAP_FAILED == ret? NULL : ret;
+}
+
+static void sparse_free(void* base, size_t sz) {
+  if (base) munmap(base, sz);
+}
+
+/* Bits of a /proc/self/pagemap entry; see the kernel's pagemap.txt */
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_FILE_OR_SHARED (1ULL << 61)
+#define PAGEMAP_EXCLUSIVE (1ULL << 56)
+
+/* Sets the low bit of vec[i] iff page i of the given region is committed
+ * privately to this process, using Linux's /proc/self/pagemap. Returns 0 if
+ * that is unavailable.
+ *
+ * Unlike mincore(), this distinguishes pages that were merely read (which map
+ * the shared zero page, or the page cache for file mappings) from those that
+ * were written and thus copied.
+ */
+static int sparse_committed_pagemap(unsigned char* vec, const void* base,
+                                    size_t n, size_t page_sz) {
+  unsigned long long entries[512];
+  size_t i, j, m;
+  off_t offset = (off_t)((size_t)base / page_sz) * sizeof(entries[0]);
+  int fd;
+
+  fd = open("/proc/self/pagemap", O_RDONLY);
+  if (fd < 0) return 0;
+
+  for (i = 0; i < n; i += m) {
+    m = n - i < lenof(entries)? n - i : lenof(entries);
+    if ((ssize_t)(m * sizeof(entries[0])) !=
+        pread(fd, entries, m * sizeof(entries[0]),
+              offset + i * sizeof(entries[0]))) {
+      close(fd);
+      return 0;
+    }
+
+    for (j = 0; j < m; ++j)
+      vec[i+j] = !(entries[j] & PAGEMAP_FILE_OR_SHARED) &&
+        ((entries[j] & PAGEMAP_SWAPPED) ||
+         ((entries[j] & PAGEMAP_PRESENT) && (entries[j] & PAGEMAP_EXCLUSIVE)));
+  }
+
+  close(fd);
+  return 1;
+}
+
+/* Returns a vector of one byte per page of the given sparse region, whose low
+ * bit is set iff that page has been written (and so may be non-zero). Where
+ * pagemap is unavailable this falls back to mincore(), which also counts
+ * pages that were only read; the result is then an over-estimate, but still
+ * never misses a written page. The caller must free the result.
+ */
+static unsigned char* sparse_committed(const void* base, size_t sz) {
+  size_t page_sz = sysconf(_SC_PAGESIZE);
+  size_t n = (sz + page_sz - 1) / page_sz;
+  unsigned char* vec = xmalloc(n? n : 1);
+
+  if (!sparse_committed_pagemap(vec, base, n, page_sz) &&
+      mincore((void*)base, sz, (void*)vec))
+    err(EX_OSERR, "mincore");
+
+  return vec;
+}
+
+static size_t sparse_committed_bytes(const void* base, size_t sz) {
+  size_t page_sz = sysconf(_SC_PAGESIZE);
+  size_t i, n = (sz + page_sz - 1) / page_sz, committed = 0;
+  unsigned char* vec;
+
+  if (!base) return 0;
+
+  vec = sparse_committed(base, sz);
+  for (i = 0; i < n; ++i)
+    committed += vec[i] & 1;
+  free(vec);
+
+  return committed * page_sz;
+}
+#endif /* HAVE_SPARSE_STORAGE */
+
 env_vmap* env_vmap_new(coord xmax, coord zmax, int is_toroidal) {
   size_t voxels_sz = sizeof(env_voxel_type) * xmax * zmax * ENV_VMAP_H;
-  size_t visibility2_sz = (xmax/2) * (zmax/2) * (ENV_VMAP_H/2) / 4;
-  size_t visibility4_sz = (xmax/4) * (zmax/4) * (ENV_VMAP_H/4) / 4;
+  size_t storage_sz = env_vmap_storage_size(xmax, zmax);
   char* raw;
   env_vmap* this;
 
-  raw = xmalloc(sizeof(env_vmap) + UMP_CACHE_LINE_SZ + voxels_sz +
-                visibility2_sz + visibility4_sz);
+  raw = xmalloc(sizeof(env_vmap) + UMP_CACHE_LINE_SZ + storage_sz);
   this = (env_vmap*)raw;
   this->voxels = align_to_cache_line(raw + sizeof(*this));
   this->visibility = (void*)(this->voxels + voxels_sz/sizeof(env_voxel_type));
   this->xmax = xmax;
   this->zmax = zmax;
   this->is_toroidal = is_toroidal;
-  memset(this->voxels, 0, voxels_sz);
-  memset(this->visibility, 0, visibility2_sz + visibility4_sz);
+  this->column_occupancy = NULL;
+  this->supercell_occupancy = NULL;
+  this->is_sparse = 0;
+  memset(this->voxels, 0, storage_sz);
 
   return this;
 }
 
+env_vmap* env_vmap_new_sparse(coord xmax, coord zmax, int is_toroidal) {
+#ifdef HAVE_SPARSE_STORAGE
+  size_t voxels_sz = sizeof(env_voxel_type) * xmax * zmax * ENV_VMAP_H;
+  env_vmap* this;
+
+  this = xmalloc(sizeof(env_vmap));
+  /* Not cleared; fresh anonymous memory is already zero, and touching it
+   * would commit it.
+   */
+  this->voxels = sparse_alloc(env_vmap_storage_size(xmax, zmax));
+  this->visibility = (void*)(this->voxels + voxels_sz/sizeof(env_voxel_type));
+  this->xmax = xmax;
+  this->zmax = zmax;
+  this->is_toroidal = is_toroidal;
+  this->column_occupancy = NULL;
+  this->supercell_occupancy = NULL;
+  this->is_sparse = 1;
+
+  return this;
+#else
+  return env_vmap_new(xmax, zmax, is_toroidal);
+#endif
+}
+
+env_vmap* env_vmap_new_mapped(coord xmax, coord zmax, int is_toroidal,
+                              int fd, off_t storage_offset,
+                              off_t column_occupancy_offset,
+                              off_t supercell_occupancy_offset) {
+#ifdef HAVE_SPARSE_STORAGE
+  size_t voxels_sz = sizeof(env_voxel_type) * xmax * zmax * ENV_VMAP_H;
+  void* voxels, * column_occupancy, * supercell_occupancy;
+  env_vmap* this;
+
+  voxels = sparse_map(fd, storage_offset,
+                      env_vmap_storage_size(xmax, zmax));
+  column_occupancy = sparse_map(fd, column_occupancy_offset,
+                                env_vmap_column_occupancy_size(xmax, zmax));
+  supercell_occupancy = sparse_map(
+    fd, supercell_occupancy_offset,
+    env_vmap_supercell_occupancy_size(xmax, zmax));
+  if (!voxels || !column_occupancy || !supercell_occupancy) {
+    sparse_free(voxels, env_vmap_storage_size(xmax, zmax));
+    sparse_free(column_occupancy, env_vmap_column_occupancy_size(xmax, zmax));
+    sparse_free(supercell_occupancy,
+                env_vmap_supercell_occupancy_size(xmax, zmax));
+    return NULL;
+  }
+
+  this = xmalloc(sizeof(env_vmap));
+  this->voxels = voxels;
+  this->visibility = (void*)(this->voxels + voxels_sz/sizeof(env_voxel_type));
+  this->xmax = xmax;
+  this->zmax = zmax;
+  this->is_toroidal = is_toroidal;
+  this->column_occupancy = column_occupancy;
+  this->supercell_occupancy = supercell_occupancy;
+  this->is_sparse = 1;
+
+  return this;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
 void env_vmap_delete(env_vmap* this) {
+#ifdef HAVE_SPARSE_STORAGE
+  if (this->is_sparse) {
+    sparse_free(this->column_occupancy,
+                env_vmap_column_occupancy_size(this->xmax, this->zmax));
+    sparse_free(this->supercell_occupancy,
+                env_vmap_supercell_occupancy_size(this->xmax, this->zmax));
+    sparse_free(this->voxels, env_vmap_storage_size(this->xmax, this->zmax));
+    free(this);
+    return;
+  }
+#endif
+
+  free(this->column_occupancy);
+  free(this->supercell_occupancy);
   free(this);
 }
 
+size_t env_vmap_committed_bytes(const env_vmap* this) {
+#ifdef HAVE_SPARSE_STORAGE
+  if (this->is_sparse)
+    return sparse_committed_bytes(
+      this->voxels, env_vmap_storage_size(this->xmax, this->zmax)) +
+      sparse_committed_bytes(
+        this->column_occupancy,
+        env_vmap_column_occupancy_size(this->xmax, this->zmax)) +
+      sparse_committed_bytes(
+        this->supercell_occupancy,
+        env_vmap_supercell_occupancy_size(this->xmax, this->zmax));
+#endif
+
+  return env_vmap_storage_size(this->xmax, this->zmax) +
+    (this->column_occupancy?
+     env_vmap_column_occupancy_size(this->xmax, this->zmax) : 0) +
+    (this->supercell_occupancy?
+     env_vmap_supercell_occupancy_size(this->xmax, this->zmax) : 0);
+}
+
+void env_vmap_track_occupancy(env_vmap* this) {
+  coord x, y, z, cx, cz;
+  unsigned column;
+  unsigned char* committed = NULL;
+  size_t page_sz = 1;
+
+  if (this->column_occupancy) return;
+
+#ifdef HAVE_SPARSE_STORAGE
+  if (this->is_sparse) {
+    this->column_occupancy = sparse_alloc(
+      env_vmap_column_occupancy_size(this->xmax, this->zmax));
+    this->supercell_occupancy = sparse_alloc(
+      env_vmap_supercell_occupancy_size(this->xmax, this->zmax));
+    /* Pages which were never written are all zero; don't fault them in just
+     * to find that out. A column of supercells is 512 bytes, so it never
+     * straddles a page boundary.
+     */
+    committed = sparse_committed(
+      this->voxels, env_vmap_storage_size(this->xmax, this->zmax));
+    page_sz = sysconf(_SC_PAGESIZE);
+  } else
+#endif
+  {
+    this->column_occupancy = zxmalloc(
+      env_vmap_column_occupancy_size(this->xmax, this->zmax));
+    this->supercell_occupancy = zxmalloc(
+      env_vmap_supercell_occupancy_size(this->xmax, this->zmax));
+  }
+
+  for (z = 0; z < this->zmax; z += 4) {
+    for (x = 0; x < this->xmax; x += 4) {
+      if (committed &&
+          !(committed[env_vmap_offset(this, x, 0, z) / page_sz] & 1))
+        continue;
+
+      for (cz = z; cz < z + 4; ++cz) {
+        for (cx = x; cx < x + 4; ++cx) {
+          column = 0;
+          for (y = 0; y < ENV_VMAP_H; ++y)
+            if (this->voxels[env_vmap_offset(this, cx, y, cz)])
+              column |= 1u << y;
+
+          /* Only write non-empty columns so that the index stays sparse too */
+          if (!column) continue;
+
+          this->column_occupancy[cx + this->xmax * cz] = column;
+          for (y = 0; y < ENV_VMAP_H; y += 4)
+            if (column & (0xFu << y))
+              this->supercell_occupancy[x/4 + (this->xmax/4) * (z/4)] |=
+                1 << y/4;
+        }
+      }
+    }
+  }
+
+  free(committed);
+}
+
+void env_vmap_recalc_supercell_occupancy(env_vmap* this,
+                                         coord x, coord y, coord z) {
+  coord cx, cz;
+  unsigned any = 0;
+
+  for (cz = z & ~3; cz < (z & ~3) + 4; ++cz)
+    for (cx = x & ~3; cx < (x & ~3) + 4; ++cx)
+      any |= this->column_occupancy[cx + this->xmax * cz];
+
+  if (any & (0xFu << (y & ~3)))
+    this->supercell_occupancy[x/4 + (this->xmax/4) * (z/4)] |= 1 << y/4;
+  else
+    this->supercell_occupancy[x/4 + (this->xmax/4) * (z/4)] &= ~(1 << y/4);
+}
+
 static void set_max_level(env_vmap* this,
                           unsigned offset,
                           unsigned char level) {
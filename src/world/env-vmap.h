@@ -28,6 +28,9 @@
 #ifndef WORLD_ENV_VMAP_H_
 #define WORLD_ENV_VMAP_H_
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #include "../math/coords.h"
 
 /**
@@ -129,6 +132,33 @@ typedef struct {
    * unspecified, except that it is cache-line-aligned.
    */
   unsigned char*restrict visibility;
+
+  /**
+   * If non-NULL, the occupancy of each (x,z) column, addressed by
+   * x + xmax*z. Bit y is set iff the voxel at (x,y,z) is non-zero.
+   *
+   * This (and supercell_occupancy) is only maintained once
+   * env_vmap_track_occupancy() has been called, and only if all writes to
+   * voxels go through env_vmap_put().
+   */
+  unsigned*restrict column_occupancy;
+  /**
+   * If non-NULL, the occupancy of each column of supercells, addressed by
+   * x/4 + (xmax/4)*(z/4). Bit n is set iff any voxel in the supercell whose Y
+   * coordinates are 4n..4n+3 is non-zero.
+   *
+   * Since each column of supercells is one byte, writers painting disjoint
+   * supercell-aligned regions never touch the same memory.
+   */
+  unsigned char*restrict supercell_occupancy;
+
+  /**
+   * Whether the voxels, visibility and occupancy indices of this vmap live in
+   * lazily-committed mappings (see env_vmap_new_sparse() and
+   * env_vmap_new_mapped()) rather than in the same allocation as the vmap
+   * itself.
+   */
+  int is_sparse;
 } env_vmap;
 
 /**
@@ -140,18 +170,81 @@ typedef struct {
  * axes) space. If true, xmax and zmax MUST be powers of two.
  */
 env_vmap* env_vmap_new(coord xmax, coord zmax, int is_toroidal);
+/**
+ * Like env_vmap_new(), but only commits memory for the parts of the vmap that
+ * are actually written.
+ *
+ * The storage is reserved as anonymous memory which is never cleared
+ * explicitly, so every page initially maps the operating system's shared zero
+ * page and is only copied on first write. Since most supercells are empty,
+ * this makes the resident size proportional to the amount of content rather
+ * than the size of the world. Addressing is identical to a dense vmap, so
+ * readers need not know the difference; they should however consult the
+ * occupancy indices before reading regions which are likely empty, since even
+ * reads fault page table entries in.
+ *
+ * If the platform has no support for this, this is equivalent to
+ * env_vmap_new().
+ */
+env_vmap* env_vmap_new_sparse(coord xmax, coord zmax, int is_toroidal);
+/**
+ * Like env_vmap_new_sparse(), but the voxel and visibility storage and the
+ * occupancy indices are initialised from the given file, which is mapped
+ * copy-on-write at the given offsets. The file must hold each region in
+ * exactly its in-memory layout, with env_vmap_storage_size(),
+ * env_vmap_column_occupancy_size() and env_vmap_supercell_occupancy_size()
+ * bytes respectively, and the offsets must be multiples of the page size.
+ * Changes to the vmap are never written back to the file, but the file must
+ * not be modified while the vmap exists. The file descriptor may be closed
+ * once this returns.
+ *
+ * Returns NULL and sets errno if the platform does not support this or the
+ * mapping fails.
+ */
+env_vmap* env_vmap_new_mapped(coord xmax, coord zmax, int is_toroidal,
+                              int fd, off_t storage_offset,
+                              off_t column_occupancy_offset,
+                              off_t supercell_occupancy_offset);
 /**
  * Frees the memory held by the given vmap.
  */
 void env_vmap_delete(env_vmap*);
 
+/**
+ * Returns the approximate number of bytes of the given vmap's voxel,
+ * visibility and occupancy data which have actually been committed, ie,
+ * written and thus backed by private memory. Pages which have only been read
+ * still map the shared zero page (or the snapshot file) and are not counted.
+ * For a dense vmap, this is simply the allocated size.
+ *
+ * This relies on /proc/self/pagemap where available; elsewhere it counts
+ * resident pages, which over-estimates once empty regions have been read.
+ */
+size_t env_vmap_committed_bytes(const env_vmap*);
+
+/**
+ * Returns the size in bytes of the voxel and visibility storage of a vmap of
+ * the given dimensions. The storage begins at the voxels field.
+ */
+size_t env_vmap_storage_size(coord xmax, coord zmax);
+/**
+ * Returns the size in bytes of the column_occupancy index of a vmap of the
+ * given dimensions.
+ */
+size_t env_vmap_column_occupancy_size(coord xmax, coord zmax);
+/**
+ * Returns the size in bytes of the supercell_occupancy index of a vmap of the
+ * given dimensions.
+ */
+size_t env_vmap_supercell_occupancy_size(coord xmax, coord zmax);
+
 /**
  * Returns the element offset of the voxel in the given vmap at the given
  * (x,y,z) coordinates.
  */
-static inline unsigned env_vmap_offset(const env_vmap* vmap,
-                                       coord x, coord y, coord z) {
-  unsigned supercell_offset =
+static inline size_t env_vmap_offset(const env_vmap* vmap,
+                                     coord x, coord y, coord z) {
+  size_t supercell_offset =
     z/4 * (vmap->xmax/4) * (ENV_VMAP_H/4) + x/4 * (ENV_VMAP_H/4) + y/4;
   unsigned cell_offset =
     (z&2)*2 + (x&2) + (y&2)/2;
@@ -159,6 +252,74 @@ static inline unsigned env_vmap_offset(const env_vmap* vmap,
   return supercell_offset*64 + cell_offset*8 + voxel_offset;
 }
 
+/**
+ * Starts maintaining the column_occupancy and supercell_occupancy indices of
+ * the given vmap, initialising them from its current contents. Has no effect
+ * if they are already maintained.
+ */
+void env_vmap_track_occupancy(env_vmap*);
+
+/**
+ * Recalculates the supercell_occupancy bit for the supercell containing
+ * (x,y,z) from the column occupancy of its 16 columns. Used by env_vmap_put()
+ * when a voxel is cleared.
+ */
+void env_vmap_recalc_supercell_occupancy(env_vmap*, coord x, coord y, coord z);
+
+/**
+ * Sets the voxel at (x,y,z) to the given type, updating the occupancy indices
+ * if they are being maintained.
+ */
+static inline void env_vmap_put(env_vmap* vmap, coord x, coord y, coord z,
+                                env_voxel_type type) {
+  unsigned*restrict column;
+
+  vmap->voxels[env_vmap_offset(vmap, x, y, z)] = type;
+
+  if (!vmap->column_occupancy) return;
+
+  column = vmap->column_occupancy + x + vmap->xmax * z;
+  if (type) {
+    *column |= 1u << y;
+    vmap->supercell_occupancy[x/4 + (vmap->xmax/4) * (z/4)] |= 1 << y/4;
+  } else if (*column & (1u << y)) {
+    *column &= ~(1u << y);
+    if (!(*column & (0xFu << (y & ~3))))
+      env_vmap_recalc_supercell_occupancy(vmap, x, y, z);
+  }
+}
+
+/**
+ * Returns a bitmask of the Y coordinates of the voxels in column (x,z) which
+ * are non-zero. If occupancy is not being tracked, returns all ones.
+ */
+static inline unsigned env_vmap_column_occupancy(const env_vmap* vmap,
+                                                 coord x, coord z) {
+  return vmap->column_occupancy?
+    vmap->column_occupancy[x + vmap->xmax * z] : ~0u;
+}
+
+/**
+ * Returns a bitmask of the Y coordinates in column (x,z) whose supercell
+ * contains any non-zero voxel. This is coarser than
+ * env_vmap_column_occupancy(), but also covers every column sharing those
+ * supercells, so it may be used to skip reads of whole cells. If occupancy is
+ * not being tracked, returns all ones.
+ */
+static inline unsigned env_vmap_supercell_occupancy(const env_vmap* vmap,
+                                                    coord x, coord z) {
+  unsigned packed, ret = 0, n;
+
+  if (!vmap->supercell_occupancy) return ~0u;
+
+  packed = vmap->supercell_occupancy[x/4 + (vmap->xmax/4) * (z/4)];
+  for (n = 0; n < ENV_VMAP_H/4; ++n)
+    if (packed & (1 << n))
+      ret |= 0xFu << (n*4);
+
+  return ret;
+}
+
 /**
  * Modifies the vmap to ensure that the voxel at (x,y,z) has at least the given
  * visibility level. This may affect neighbouring voxels, and will never reduce
@@ -49,22 +49,59 @@ static void rmp_up(terrain_tilemap* large, const terrain_tilemap* small,
                    signed level, mersenne_twister*);
 static void generate_level(terrain_tilemap*, signed level, mersenne_twister*);
 static void select_terrain(terrain_tilemap*, mersenne_twister*);
-static void create_path_to_from(terrain_tilemap*, mersenne_twister*,
-                                coord xto, coord zto,
-                                coord xfrom, coord zfrom);
+static void create_roads(terrain_tilemap*, const coord* xs, const coord* zs,
+                         unsigned num_waypoints);
 static void world_add_shadow_subregion(
   terrain_tilemap*, const env_vmap*,
   coord x0, coord z0, coord xs, coord zs,
   coord xmask, coord zmask);
 
+#define ROAD_NUM_WAYPOINTS 5
+
+int world_generate_legacy;
+
+/* Unless world_generate_legacy is set, the per-tile stages of generation are
+ * split into bands of rows run on uMP. Instead of drawing from the shared
+ * twister (whose sequence depends on the order in which tiles are visited),
+ * each tile derives its random values from the seed, a stream identifier, the
+ * level, and its own coordinates, so the result is independent of the number
+ * of threads. In this mode, the functions below receive a NULL twister.
+ */
+#define GENERATE_ROWS_PER_DIVISION 32
+
+enum {
+  RAND_STREAM_PERLIN = 1,
+  RAND_STREAM_PERTURB,
+  RAND_STREAM_TERRAIN,
+};
+
+static unsigned generate_seed;
+
+static inline unsigned tile_random(unsigned stream, signed level,
+                                   coord x, coord z, unsigned sub) {
+  return chaos_of(chaos_accum(chaos_accum(chaos_accum(chaos_accum(
+    chaos_accum(generate_seed, stream), level), x), z), sub));
+}
+
+static unsigned generate_divisions(coord rows) {
+  return rows > GENERATE_ROWS_PER_DIVISION?
+    rows / GENERATE_ROWS_PER_DIVISION : 1;
+}
+
 void world_generate(terrain_tilemap* world, unsigned seed) {
   mersenne_twister twister;
-  coord xs[5], zs[5], i, j;
+  coord xs[ROAD_NUM_WAYPOINTS], zs[ROAD_NUM_WAYPOINTS], i;
 
   twister_seed(&twister, seed);
+  generate_seed = seed;
 
-  generate_level(world, 0, &twister);
-  select_terrain(world, &twister);
+  if (world_generate_legacy) {
+    generate_level(world, 0, &twister);
+    select_terrain(world, &twister);
+  } else {
+    generate_level(world, 0, NULL);
+    select_terrain(world, NULL);
+  }
 
   xs[0] = zs[0] = 0;
   for (i = 1; i < lenof(xs); ++i) {
@@ -72,12 +109,7 @@ void world_generate(terrain_tilemap* world, unsigned seed) {
     zs[i] = (twist(&twister) >> 16) & (world->zmax-1);
   }
 
-  for (i = 0; i < lenof(xs)-1; ++i)
-    for (j = i+1; j < lenof(xs); ++j)
-      if (twist(&twister) & 1)
-        create_path_to_from(world, &twister, xs[i], zs[i], xs[j], zs[j]);
-      else
-        create_path_to_from(world, &twister, xs[j], zs[j], xs[i], zs[i]);
+  create_roads(world, xs, zs, lenof(xs));
 }
 
 static int above_perlin_threshold(const terrain_tilemap* world) {
@@ -109,6 +141,29 @@ static void initialise(terrain_tilemap* world) {
   }
 }
 
+static unsigned* randomise_hmap;
+static terrain_tilemap* randomise_world;
+static unsigned randomise_altitude_reduction;
+
+static void randomise_rows(unsigned ix, unsigned n) {
+  terrain_tilemap* world = randomise_world;
+  unsigned i, begin, end;
+
+  begin = world->xmax * (ix * world->zmax / n);
+  end = world->xmax * ((ix+1) * world->zmax / n);
+  for (i = begin; i < end; ++i)
+    if (randomise_hmap[i] < randomise_altitude_reduction)
+      world->alt[i] = 0;
+    else
+      world->alt[i] = randomise_hmap[i] - randomise_altitude_reduction;
+}
+
+static ump_task randomise_task = {
+  randomise_rows,
+  0, /* set dynamically */
+  0, /* sync */
+};
+
 static void randomise(terrain_tilemap* world,
                       signed level,
                       mersenne_twister* twister) {
@@ -123,18 +178,28 @@ static void randomise(terrain_tilemap* world,
   altitude_reduction = amp * 6 / 10;
 
   do {
-    perlin_noise(hmap, world->xmax, world->zmax, freq, amp, twist(twister));
+    perlin_noise(hmap, world->xmax, world->zmax, freq, amp,
+                 twister? twist(twister) :
+                 tile_random(RAND_STREAM_PERLIN, level, freq, 0, 0));
 
     freq *= 2;
     amp /= 2;
   } while (amp && freq < world->xmax && freq < world->zmax);
 
   initialise(world);
-  for (i = 0; i < world->xmax * world->zmax; ++i)
-    if (hmap[i] < altitude_reduction)
-      world->alt[i] = 0;
-    else
-      world->alt[i] = hmap[i] - altitude_reduction;
+  if (twister) {
+    for (i = 0; i < world->xmax * world->zmax; ++i)
+      if (hmap[i] < altitude_reduction)
+        world->alt[i] = 0;
+      else
+        world->alt[i] = hmap[i] - altitude_reduction;
+  } else {
+    randomise_hmap = hmap;
+    randomise_world = world;
+    randomise_altitude_reduction = altitude_reduction;
+    randomise_task.num_divisions = generate_divisions(world->zmax);
+    ump_run_sync(&randomise_task);
+  }
 
   free(hmap);
 }
@@ -146,17 +211,80 @@ static inline signed altitude(const terrain_tilemap* world,
   return s & 0xFFFF;
 }
 
-static inline unsigned short perturb(signed base_altitude,
-                                     signed level,
-                                     mersenne_twister* twister) {
+static inline unsigned short perturb_by(signed base_altitude,
+                                        signed level,
+                                        unsigned random) {
   if (level <= 1) return base_altitude;
   base_altitude -= 1 << level;
-  base_altitude += twist(twister) & ((2 << (level-1)) - 1);
+  base_altitude += random & ((2 << (level-1)) - 1);
   if (base_altitude < 0) return 0;
   if (base_altitude > 32767) return 32767;
   return base_altitude;
 }
 
+static inline unsigned short perturb(signed base_altitude,
+                                     signed level,
+                                     mersenne_twister* twister) {
+  /* Levels which aren't perturbed don't consume any randomness */
+  if (level <= 1) return base_altitude;
+  return perturb_by(base_altitude, level, twist(twister));
+}
+
+/* Like perturb(), but using counter-based randomness for the large tile at
+ * (x,z).
+ */
+static inline unsigned short perturb_at(signed base_altitude,
+                                        signed level,
+                                        coord x, coord z) {
+  return perturb_by(base_altitude, level,
+                    tile_random(RAND_STREAM_PERTURB, level, x, z, 0));
+}
+
+static terrain_tilemap* rmp_up_large;
+static const terrain_tilemap* rmp_up_small;
+static signed rmp_up_level;
+
+static void rmp_up_rows(unsigned ix, unsigned n) {
+  terrain_tilemap* large = rmp_up_large;
+  const terrain_tilemap* small = rmp_up_small;
+  signed level = rmp_up_level;
+  coord sx0, sz0, lx0, lz0, sx1, sz1, lx1, lz1, szbegin, szend;
+  signed sa00, sa01, sa10, sa11;
+
+  szbegin = ix * small->zmax / n;
+  szend = (ix+1) * small->zmax / n;
+  for (sz0 = szbegin; sz0 < szend; ++sz0) {
+    sz1 = (sz0+1) & (small->zmax-1);
+    lz0 = sz0 * 2;
+    lz1 = lz0+1; /* won't ever wrap */
+    for (sx0 = 0; sx0 < small->xmax; ++sx0) {
+      sx1 = (sx0+1) & (small->xmax-1);
+      lx0 = sx0 * 2;
+      lx1 = lx0+1; /* won't ever wrap */
+
+      sa00 = altitude(small, sx0, sz0);
+      sa10 = altitude(small, sx1, sz0);
+      sa01 = altitude(small, sx0, sz1);
+      sa11 = altitude(small, sx1, sz1);
+
+      large->alt[terrain_tilemap_offset(large, lx0, lz0)] =
+        perturb_at(sa00, level, lx0, lz0);
+      large->alt[terrain_tilemap_offset(large, lx0, lz1)] =
+        perturb_at((sa00+sa01)/2, level, lx0, lz1);
+      large->alt[terrain_tilemap_offset(large, lx1, lz0)] =
+        perturb_at((sa00+sa10)/2, level, lx1, lz0);
+      large->alt[terrain_tilemap_offset(large, lx1, lz1)] =
+        perturb_at((sa00+sa01+sa10+sa11)/4, level, lx1, lz1);
+    }
+  }
+}
+
+static ump_task rmp_up_task = {
+  rmp_up_rows,
+  0, /* set dynamically */
+  0, /* sync */
+};
+
 static void rmp_up(terrain_tilemap* large,
                    const terrain_tilemap* small,
                    signed level,
@@ -164,6 +292,15 @@ static void rmp_up(terrain_tilemap* large,
   coord sx0, sz0, lx0, lz0, sx1, sz1, lx1, lz1;
   signed sa00, sa01, sa10, sa11;
 
+  if (!twister) {
+    rmp_up_large = large;
+    rmp_up_small = small;
+    rmp_up_level = level;
+    rmp_up_task.num_divisions = generate_divisions(small->zmax);
+    ump_run_sync(&rmp_up_task);
+    return;
+  }
+
   for (sz0 = 0; sz0 < small->zmax; ++sz0) {
     sz1 = (sz0+1) & (small->zmax-1);
     lz0 = sz0 * 2;
@@ -193,191 +330,511 @@ static void rmp_up(terrain_tilemap* large,
   }
 }
 
-static void select_terrain(terrain_tilemap* world, mersenne_twister* twister) {
-  unsigned x, z, i, dx, dz;
-  coord_offset miny, maxy, y;
+/* Returns the given random value for the tile at (x,z), from the twister if
+ * there is one and counter-based otherwise.
+ */
+static inline unsigned select_terrain_random(mersenne_twister* twister,
+                                             coord x, coord z,
+                                             unsigned sub) {
+  return twister? twist(twister) :
+    tile_random(RAND_STREAM_TERRAIN, 0, x, z, sub);
+}
 
-  for (z = 0; z < world->zmax; ++z) {
-    for (x = 0; x < world->xmax; ++x) {
-      i = terrain_tilemap_offset(world, x, z);
-
-      if (world->alt[i] <= 2*METRE / TILE_YMUL) {
-        world->type[i] =
-          terrain_type_water << TERRAIN_SHADOW_BITS;
-      } else if (world->alt[i] <= 4*METRE / TILE_YMUL) {
-        world->type[i] =
-          terrain_type_gravel << TERRAIN_SHADOW_BITS;
-      /* Sometimes patches of snow, depending on altitude */
-      } else if (((signed)(twist(twister)/2)) <
-          world->alt[i] * TILE_YMUL) {
-        world->type[i] = terrain_type_snow << TERRAIN_SHADOW_BITS;
-      } else {
-        /* Stone if max dy*2 > dx, grass otherwise */
-        miny = 32767 * TILE_YMUL;
-        maxy = 0;
-        for (dz = 0; dz < 2; ++dz) {
-          for (dx = 0; dx < 2; ++dx) {
-            y = world->alt[terrain_tilemap_offset(
-                world, (x+dx) & (world->xmax-1), (z+dz) & (world->zmax-1))]
-              * TILE_YMUL;
-            if (y > maxy)
-              maxy = y;
-            if (y < miny)
-              miny = y;
-          }
-        }
+static inline void select_terrain_tile(terrain_tilemap* world,
+                                       coord x, coord z,
+                                       mersenne_twister* twister) {
+  unsigned i, dx, dz;
+  coord_offset miny, maxy, y;
 
-        if (maxy - miny > TILE_SZ/2)
-          world->type[i] =
-            terrain_type_stone << TERRAIN_SHADOW_BITS;
-        else if (twist(twister) & 7)
-          world->type[i] =
-            terrain_type_bare_grass << TERRAIN_SHADOW_BITS;
-        else
-          world->type[i] =
-            terrain_type_grass << TERRAIN_SHADOW_BITS;
+  i = terrain_tilemap_offset(world, x, z);
+
+  if (world->alt[i] <= 2*METRE / TILE_YMUL) {
+    world->type[i] =
+      terrain_type_water << TERRAIN_SHADOW_BITS;
+  } else if (world->alt[i] <= 4*METRE / TILE_YMUL) {
+    world->type[i] =
+      terrain_type_gravel << TERRAIN_SHADOW_BITS;
+  /* Sometimes patches of snow, depending on altitude */
+  } else if (((signed)(select_terrain_random(twister, x, z, 0)/2)) <
+      world->alt[i] * TILE_YMUL) {
+    world->type[i] = terrain_type_snow << TERRAIN_SHADOW_BITS;
+  } else {
+    /* Stone if max dy*2 > dx, grass otherwise */
+    miny = 32767 * TILE_YMUL;
+    maxy = 0;
+    for (dz = 0; dz < 2; ++dz) {
+      for (dx = 0; dx < 2; ++dx) {
+        y = world->alt[terrain_tilemap_offset(
+            world, (x+dx) & (world->xmax-1), (z+dz) & (world->zmax-1))]
+          * TILE_YMUL;
+        if (y > maxy)
+          maxy = y;
+        if (y < miny)
+          miny = y;
       }
     }
+
+    if (maxy - miny > TILE_SZ/2)
+      world->type[i] =
+        terrain_type_stone << TERRAIN_SHADOW_BITS;
+    else if (select_terrain_random(twister, x, z, 1) & 7)
+      world->type[i] =
+        terrain_type_bare_grass << TERRAIN_SHADOW_BITS;
+    else
+      world->type[i] =
+        terrain_type_grass << TERRAIN_SHADOW_BITS;
   }
 }
 
+static terrain_tilemap* select_terrain_world;
+
+static void select_terrain_rows(unsigned ix, unsigned n) {
+  terrain_tilemap* world = select_terrain_world;
+  coord x, z, zbegin, zend;
+
+  zbegin = ix * world->zmax / n;
+  zend = (ix+1) * world->zmax / n;
+  for (z = zbegin; z < zend; ++z)
+    for (x = 0; x < world->xmax; ++x)
+      select_terrain_tile(world, x, z, NULL);
+}
+
+static ump_task select_terrain_task = {
+  select_terrain_rows,
+  0, /* set dynamically */
+  0, /* sync */
+};
+
+static void select_terrain(terrain_tilemap* world, mersenne_twister* twister) {
+  coord x, z;
+
+  if (!twister) {
+    select_terrain_world = world;
+    select_terrain_task.num_divisions = generate_divisions(world->zmax);
+    ump_run_sync(&select_terrain_task);
+    return;
+  }
+
+  for (z = 0; z < world->zmax; ++z)
+    for (x = 0; x < world->xmax; ++x)
+      select_terrain_tile(world, x, z, twister);
+}
+
+/* Roads connect every pair of a handful of waypoints.
+ *
+ * Each road is planned as a least-cost path over the lowest-granularity
+ * tilemap that generate_level() actually populated, where a step costs its
+ * length plus a penalty for the change in altitude and for ending in water.
+ * All roads leaving one waypoint come from a single Dijkstra search rooted
+ * there, so they naturally share their first stretches instead of running
+ * side by side. Each source waypoint is one uMP division.
+ *
+ * The coarse path is then traced at full resolution, stamping a square brush
+ * of road onto every tile that can take it. Divisions do not write the tilemap
+ * directly; they only record the tiles they would touch, which are converted
+ * to road serially afterwards. Whether a tile can take road does not depend on
+ * any other road, so the result depends only on the seed.
+ */
 #define PATH_WIDTH 3
-static void create_path_to_from(terrain_tilemap* world, mersenne_twister* twister,
-                                coord xto, coord zto,
-                                coord xfrom, coord zfrom) {
-  const vc3 to = { xto, 0, zto };
-  vc3 here = { xfrom, 0, zfrom }, curr = {0,0,0}, best;
-  vo3 distv;
-  coord current_distance, this_distance;
-  coord_offset ox, oz;
-  unsigned i;
-  /* These are absolute values, but -1 is used for road intersection so that
-   * joining another road always beats using new terrain.
-   */
-  signed minimum_delta_y, this_delta_y;
+#define ROAD_STRAIGHT_COST 10
+#define ROAD_DIAGONAL_COST 14
+#define ROAD_SLOPE_COST 4
+#define ROAD_WATER_COST 40
+
+typedef struct {
+  unsigned* tiles;
+  unsigned len, cap;
+} road_tile_list;
+
+typedef struct {
+  unsigned cost, cell;
+} road_heap_entry;
+
+static void plan_roads_from(unsigned, unsigned);
+
+static struct {
+  const terrain_tilemap* world;
+  const terrain_tilemap* plan;
+  const coord* xs, * zs;
+  unsigned num_waypoints;
+  /* Indexed by source waypoint */
+  road_tile_list touched[ROAD_NUM_WAYPOINTS];
+} road_planner;
+
+static ump_task plan_roads_task = {
+  plan_roads_from,
+  0, /* set dynamically */
+  0, /* sync */
+  1, /* Dijkstra searches vary a lot in cost */
+};
 
-  while (here[0] != to[0] || here[2] != to[2]) {
-    vc3dist(distv, to, here, world->xmax, world->zmax);
-    current_distance = omagnitude(distv);
-    minimum_delta_y = 0x7fffffff;
+static void create_roads(terrain_tilemap* world,
+                         const coord* xs, const coord* zs,
+                         unsigned num_waypoints) {
+  const terrain_tilemap* plan;
+  road_tile_list* list;
+  unsigned i, t;
+
+  /* Plan on the deepest level that generate_level() actually populated */
+  plan = world;
+  while (SLIST_NEXT(plan, next) && above_perlin_threshold(plan))
+    plan = SLIST_NEXT(plan, next);
+
+  road_planner.world = world;
+  road_planner.plan = plan;
+  road_planner.xs = xs;
+  road_planner.zs = zs;
+  road_planner.num_waypoints = num_waypoints;
+  memset(road_planner.touched, 0, sizeof(road_planner.touched));
+
+  plan_roads_task.num_divisions = num_waypoints - 1;
+  ump_run_sync(&plan_roads_task);
+
+  for (i = 0; i < num_waypoints - 1; ++i) {
+    list = road_planner.touched + i;
+    for (t = 0; t < list->len; ++t)
+      world->type[list->tiles[t]] = terrain_type_road << TERRAIN_SHADOW_BITS;
+    free(list->tiles);
+  }
+}
 
-    for (oz = -PATH_WIDTH; oz < PATH_WIDTH; ++oz) {
-      for (ox = -PATH_WIDTH; ox < PATH_WIDTH; ++ox) {
-        if (!ox && !oz) continue;
+static inline int road_is_water(const terrain_tilemap* plan, unsigned cell) {
+  return plan->alt[cell] <= 2*METRE / TILE_YMUL;
+}
 
-        curr[0] = (here[0] + ox) & (world->xmax-1);
-        curr[2] = (here[2] + oz) & (world->zmax-1);
+static void road_heap_push(road_heap_entry** heap, unsigned* len,
+                           unsigned* cap, unsigned cost, unsigned cell) {
+  road_heap_entry tmp;
+  unsigned i, parent;
 
-        if (curr[0] == to[0] && curr[2] == to[2]) {
-          best[0] = to[0];
-          best[1] = to[1];
-          best[2] = to[2];
-          goto fill_point;
-        }
+  if (*len == *cap) {
+    *cap = *cap? *cap * 2 : 1024;
+    *heap = xrealloc(*heap, *cap * sizeof(road_heap_entry));
+  }
 
-        vc3dist(distv, to, curr, world->xmax, world->zmax);
-        this_distance = omagnitude(distv);
-
-        if (this_distance < current_distance) {
-          /* If the tile is already has road, treat it as if it has a delta-y
-           * of zero. This means roads prefer to join together, thus preventing
-           * certain weirdness like two nearly parallel roads only a very short
-           * distance apart, or even constantly intersecting each other.
-           */
-          if (terrain_type_road ==
-              world->type[terrain_tilemap_offset(world, curr[0], curr[2])]
-                  >> TERRAIN_SHADOW_BITS) {
-            this_delta_y = -1;
-          } else {
-            this_delta_y = abs(
-              world->alt[terrain_tilemap_offset(world, curr[0], curr[2])] -
-              world->alt[terrain_tilemap_offset(world, here[0], here[2])]);
-            this_delta_y /= fisqrt(ox*ox + oz*oz);
-          }
-
-          if (this_delta_y < minimum_delta_y) {
-            minimum_delta_y = this_delta_y;
-            memcpy(best, curr, sizeof(curr));
-          }
-        }
+  i = (*len)++;
+  (*heap)[i].cost = cost;
+  (*heap)[i].cell = cell;
+  while (i) {
+    parent = (i - 1) / 2;
+    if ((*heap)[parent].cost <= (*heap)[i].cost) break;
+
+    tmp = (*heap)[parent];
+    (*heap)[parent] = (*heap)[i];
+    (*heap)[i] = tmp;
+    i = parent;
+  }
+}
+
+static road_heap_entry road_heap_pop(road_heap_entry* heap, unsigned* len) {
+  road_heap_entry ret = heap[0], tmp;
+  unsigned i = 0, child;
+
+  heap[0] = heap[--*len];
+  for (;;) {
+    child = i * 2 + 1;
+    if (child >= *len) break;
+    if (child + 1 < *len && heap[child+1].cost < heap[child].cost)
+      ++child;
+    if (heap[i].cost <= heap[child].cost) break;
+
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+
+  return ret;
+}
+
+static void road_tile_list_add(road_tile_list* list, unsigned tile) {
+  if (list->len == list->cap) {
+    list->cap = list->cap? list->cap * 2 : 4096;
+    list->tiles = xrealloc(list->tiles, list->cap * sizeof(unsigned));
+  }
+
+  list->tiles[list->len++] = tile;
+}
+
+static void stamp_road(road_tile_list* list, const terrain_tilemap* world,
+                       coord x, coord z) {
+  coord_offset ox, oz;
+  unsigned off;
+
+  for (oz = -PATH_WIDTH; oz < PATH_WIDTH; ++oz) {
+    for (ox = -PATH_WIDTH; ox < PATH_WIDTH; ++ox) {
+      off = terrain_tilemap_offset(world, (x + ox) & (world->xmax-1),
+                                   (z + oz) & (world->zmax-1));
+      switch (world->type[off] >> TERRAIN_SHADOW_BITS) {
+      case terrain_type_water:
+      case terrain_type_gravel:
+      case terrain_type_stone:
+        /* Can't put road here */
+        break;
+
+      default:
+        road_tile_list_add(list, off);
+        break;
       }
     }
+  }
+}
+
+static inline coord_offset torus_delta(coord from, coord to, coord max) {
+  coord_offset d = (to - from) & (max - 1);
+  return d >= (coord_offset)(max / 2)? d - (coord_offset)max : d;
+}
+
+static void stamp_road_segment(road_tile_list* list,
+                               const terrain_tilemap* world,
+                               coord x0, coord z0, coord x1, coord z1) {
+  coord_offset dx, dz;
+  signed steps, s;
+
+  dx = torus_delta(x0, x1, world->xmax);
+  dz = torus_delta(z0, z1, world->zmax);
+  steps = umax(abs(dx), abs(dz));
 
-    fill_point:
-    memcpy(here, best, sizeof(here));
-    for (oz = -PATH_WIDTH; oz < PATH_WIDTH; ++oz) {
-      for (ox = -PATH_WIDTH; ox < PATH_WIDTH; ++ox) {
-        curr[0] = (here[0] + ox) & (world->xmax-1);
-        curr[2] = (here[2] + oz) & (world->zmax-1);
-        switch (world->type[terrain_tilemap_offset(world, curr[0], curr[2])]
-                    >> TERRAIN_SHADOW_BITS) {
-        case terrain_type_water:
-        case terrain_type_gravel:
-        case terrain_type_stone:
-        case terrain_type_road:
-          /* Can't put road here; if a road was already here, leave it alone so
-           * that path intersection detection works.
-           */
-          break;
-
-        default:
-          /* Don't write a road immediately so that we won't detect the path we
-           * are currently creating as if it were one to join with.
-           */
-          world->type[terrain_tilemap_offset(world, curr[0], curr[2])] =
-            TERRAIN_TYPE_PLACEHOLDER << TERRAIN_SHADOW_BITS;
+  for (s = steps? 1 : 0; s <= steps; ++s)
+    stamp_road(list, world,
+               (x0 + (steps? dx * s / steps : 0)) & (world->xmax-1),
+               (z0 + (steps? dz * s / steps : 0)) & (world->zmax-1));
+}
+
+static void plan_roads_from(unsigned source, unsigned ignored) {
+  const terrain_tilemap* world = road_planner.world;
+  const terrain_tilemap* plan = road_planner.plan;
+  road_tile_list* list = road_planner.touched + source;
+  coord scale = world->xmax / plan->xmax, pmask_x, pmask_z;
+  coord x, z, nx, nz, px, pz;
+  coord_offset ox, oz;
+  unsigned n = plan->xmax * plan->zmax;
+  unsigned* cost, * pred, cell, next, step, j, remaining;
+  unsigned target_cells[ROAD_NUM_WAYPOINTS];
+  road_heap_entry* heap = NULL, top;
+  unsigned heap_len = 0, heap_cap = 0;
+
+  pmask_x = plan->xmax - 1;
+  pmask_z = plan->zmax - 1;
+  for (j = 0; j < road_planner.num_waypoints; ++j)
+    target_cells[j] = terrain_tilemap_offset(
+      plan, road_planner.xs[j] / scale, road_planner.zs[j] / scale);
+
+  cost = xmalloc(n * sizeof(unsigned));
+  pred = xmalloc(n * sizeof(unsigned));
+  memset(cost, ~0, n * sizeof(unsigned));
+
+  cost[target_cells[source]] = 0;
+  pred[target_cells[source]] = target_cells[source];
+  road_heap_push(&heap, &heap_len, &heap_cap, 0, target_cells[source]);
+  remaining = road_planner.num_waypoints - source - 1;
+
+  while (heap_len && remaining) {
+    top = road_heap_pop(heap, &heap_len);
+    cell = top.cell;
+    if (top.cost > cost[cell]) continue;
+
+    for (j = source + 1; j < road_planner.num_waypoints; ++j)
+      if (cell == target_cells[j])
+        --remaining;
+
+    x = cell & pmask_x;
+    z = cell / plan->xmax;
+    for (oz = -1; oz <= 1; ++oz) {
+      for (ox = -1; ox <= 1; ++ox) {
+        if (!ox && !oz) continue;
+
+        nx = (x + ox) & pmask_x;
+        nz = (z + oz) & pmask_z;
+        next = terrain_tilemap_offset(plan, nx, nz);
+        step = (ox && oz? ROAD_DIAGONAL_COST : ROAD_STRAIGHT_COST) +
+          ROAD_SLOPE_COST * abs((signed)plan->alt[next] -
+                                (signed)plan->alt[cell]) +
+          (road_is_water(plan, next)? ROAD_WATER_COST : 0);
+
+        if (top.cost + step < cost[next]) {
+          cost[next] = top.cost + step;
+          pred[next] = cell;
+          road_heap_push(&heap, &heap_len, &heap_cap, cost[next], next);
         }
       }
     }
   }
 
-  /* Convert placeholders to actual roads */
-  for (i = 0; i < world->xmax * world->zmax; ++i)
-    if (TERRAIN_TYPE_PLACEHOLDER ==
-        world->type[i] >> TERRAIN_SHADOW_BITS)
-      world->type[i] = terrain_type_road << TERRAIN_SHADOW_BITS;
+  /* Trace each road back from its destination, through the centres of the
+   * planned cells, to the source.
+   */
+  for (j = source + 1; j < road_planner.num_waypoints; ++j) {
+    px = road_planner.xs[j];
+    pz = road_planner.zs[j];
+    stamp_road(list, world, px, pz);
+
+    for (cell = pred[target_cells[j]];
+         cell != target_cells[source];
+         cell = pred[cell]) {
+      nx = (cell & pmask_x) * scale + scale / 2;
+      nz = (cell / plan->xmax) * scale + scale / 2;
+      stamp_road_segment(list, world, px, pz, nx, nz);
+      px = nx;
+      pz = nz;
+    }
+
+    stamp_road_segment(list, world, px, pz,
+                       road_planner.xs[source], road_planner.zs[source]);
+  }
+
+  free(heap);
+  free(pred);
+  free(cost);
 }
 
 #define SHADOW_RADIUS 3
 #define SUBREGION_SIZE 128
+/* The halo of columns counted around each subregion, rounded up from
+ * SHADOW_RADIUS to whole supercells.
+ */
+#define SHADOW_HALO 4
+/* The largest divisor in the shadow kernel, 1+|dz|+|dx| */
+#define SHADOW_MAX_DIVISOR (1 + 2*SHADOW_RADIUS)
+
+/* The shade of a tile is
+ *
+ *   sum(65536*weight(x+dx,z+dz) / (1+|dx|+|dz|)) / 65536
+ *
+ * over dx,dz in [-SHADOW_RADIUS,SHADOW_RADIUS), clamped to 3, where the
+ * weight of a column is the number of solid voxels in it.
+ *
+ * Column weights are counted a supercell at a time. Each 8-byte cell is
+ * reduced to one 0/1 flag per byte, and the flags of the cells above and below
+ * each other are summed in parallel across the whole column of supercells, so
+ * each column costs a couple of byte reads rather than ENV_VMAP_H addressed
+ * voxel reads.
+ *
+ * Every tap's 65536*weight/divisor is looked up from shadow_taps rather than
+ * divided, so the result is exactly the same as evaluating the formula
+ * directly. Most tiles never need the taps, though: a separable box sum gives
+ * the total weight in the window, and if that is zero the shade is zero, while
+ * if even the smallest possible contribution of that weight already reaches
+ * 3, the shade is 3.
+ */
+static unsigned shadow_taps[SHADOW_MAX_DIVISOR+1][ENV_VMAP_H+1];
+
+/**
+ * Returns the given 8-byte cell with each byte replaced by 1 if it was
+ * non-zero and 0 otherwise.
+ */
+static inline unsigned long long cell_occupancy(
+  const env_voxel_type*restrict cell
+) {
+  unsigned long long word;
+
+  memcpy(&word, cell, sizeof(word));
+  /* High bit of each byte set iff the byte is non-zero */
+  word = (((word & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | word)
+       & 0x8080808080808080ULL;
+  return word >> 7;
+}
+
+static void shadow_init_tables(void) {
+  unsigned d, w;
+
+  for (d = 1; d <= SHADOW_MAX_DIVISOR; ++d)
+    for (w = 0; w <= ENV_VMAP_H; ++w)
+      shadow_taps[d][w] = 65536 * w / d;
+}
 
 static void world_add_shadow_subregion(
   terrain_tilemap* world, const env_vmap* vmap,
   coord x0, coord z0, coord xs, coord zs,
   coord xmask, coord zmask
 ) {
-  unsigned char weight[zs+2*SHADOW_RADIUS][xs+2*SHADOW_RADIUS];
+  unsigned char weight[zs+2*SHADOW_HALO][xs+2*SHADOW_HALO];
+  unsigned short vsum[xs+2*SHADOW_HALO];
+  unsigned long long sums[4];
+  unsigned char counts[4][8];
+  const env_voxel_type*restrict supercells;
   coord_offset xo, zo, xso, zso;
-  coord x, y, z;
-  unsigned shade;
-
-  memset(weight, 0, sizeof(weight));
-
-  for (zo = -SHADOW_RADIUS; zo < (signed)zs + SHADOW_RADIUS; ++zo) {
-    z = (z0 + zo) & zmask;
-    for (xo = -SHADOW_RADIUS; xo < (signed)xs + SHADOW_RADIUS; ++xo) {
-      x = (x0 + xo) & xmask;
-      for (y = 0; y < ENV_VMAP_H; ++y)
-        if (vmap->voxels[env_vmap_offset(vmap, x, y, z)])
-          ++weight[zo+SHADOW_RADIUS][xo+SHADOW_RADIUS];
+  unsigned q, k, zl, xl, v, window, shade;
+
+  /* Count the solid voxels in each column, a 4x4 column of supercells at a
+   * time.
+   */
+  for (zo = 0; zo < (signed)zs + 2*SHADOW_HALO; zo += 4) {
+    for (xo = 0; xo < (signed)xs + 2*SHADOW_HALO; xo += 4) {
+      /* Nothing to count if the occupancy index knows these are empty */
+      if (!env_vmap_supercell_occupancy(
+            vmap, (x0 + xo - SHADOW_HALO) & xmask,
+            (z0 + zo - SHADOW_HALO) & zmask)) {
+        for (zl = 0; zl < 4; ++zl)
+          memset(weight[zo + zl] + xo, 0, 4);
+        continue;
+      }
+
+      supercells = vmap->voxels + env_vmap_offset(
+        vmap, (x0 + xo - SHADOW_HALO) & xmask, 0,
+        (z0 + zo - SHADOW_HALO) & zmask);
+
+      /* Cells 2q and 2q+1 of every supercell are the lower and upper halves
+       * of the same 2x2 group of columns. No byte can exceed ENV_VMAP_H/2, so
+       * the sums never carry between bytes.
+       */
+      for (q = 0; q < 4; ++q) {
+        sums[q] = 0;
+        for (k = 0; k < ENV_VMAP_H/4; ++k)
+          sums[q] += cell_occupancy(supercells + k*64 + q*16) +
+                     cell_occupancy(supercells + k*64 + q*16 + 8);
+      }
+      memcpy(counts, sums, sizeof(counts));
+
+      /* Invert the (Z,X,Y) orders in env_vmap_offset() */
+      for (zl = 0; zl < 4; ++zl) {
+        for (xl = 0; xl < 4; ++xl) {
+          q = (zl&2) + (xl&2)/2;
+          v = (zl&1)*4 + (xl&1)*2;
+          weight[zo + zl][xo + xl] = counts[q][v] + counts[q][v+1];
+        }
+      }
     }
   }
 
+#define W(zo,xo) weight[(zo)+SHADOW_HALO][(xo)+SHADOW_HALO]
   for (zo = 0; zo < (signed)zs; ++zo) {
+    /* vsum[x] = sum of the window's rows in column x-SHADOW_HALO */
+    for (xo = -SHADOW_HALO; xo < (signed)xs + SHADOW_HALO; ++xo) {
+      vsum[xo+SHADOW_HALO] = 0;
+      for (zso = -SHADOW_RADIUS; zso < SHADOW_RADIUS; ++zso)
+        vsum[xo+SHADOW_HALO] += W(zo+zso, xo);
+    }
+
+    window = 0;
+    for (xso = -SHADOW_RADIUS; xso < SHADOW_RADIUS; ++xso)
+      window += vsum[xso+SHADOW_HALO];
+
     for (xo = 0; xo < (signed)xs; ++xo) {
-      shade = 0;
+      if (xo) {
+        window -= vsum[xo-1-SHADOW_RADIUS+SHADOW_HALO];
+        window += vsum[xo-1+SHADOW_RADIUS+SHADOW_HALO];
+      }
 
-      for (zso = -SHADOW_RADIUS; zso < SHADOW_RADIUS; ++zso)
-        for (xso = -SHADOW_RADIUS; xso < SHADOW_RADIUS; ++xso)
-          shade += 65536 * weight[zo+zso+SHADOW_RADIUS][xo+xso+SHADOW_RADIUS] /
-            (1 + abs(zso) + abs(xso));
+      if (!window) {
+        shade = 0;
+      } else if (window * shadow_taps[SHADOW_MAX_DIVISOR][1] >= 3*65536) {
+        shade = 3;
+      } else {
+        shade = 0;
+        for (zso = -SHADOW_RADIUS; zso < SHADOW_RADIUS; ++zso)
+          for (xso = -SHADOW_RADIUS; xso < SHADOW_RADIUS; ++xso)
+            shade += shadow_taps[1 + abs(zso) + abs(xso)][W(zo+zso, xo+xso)];
+
+        shade /= 65536;
+        if (shade > 3) shade = 3;
+      }
 
-      shade /= 65536;
-      if (shade > 3) shade = 3;
       world->type[terrain_tilemap_offset(
           world, (x0 + xo) & xmask, (z0 + zo) & zmask)] |= shade;
     }
   }
+#undef W
 }
 
 static void world_add_shadow_impl(unsigned row, unsigned ignored);
@@ -406,6 +863,7 @@ static void world_add_shadow_impl(unsigned row, unsigned ignored) {
 void world_add_shadow(terrain_tilemap* world, const env_vmap* vmap) {
   world_add_shadow_world = world;
   world_add_shadow_vmap = vmap;
+  shadow_init_tables();
   world_add_shadow_task.num_divisions = world->zmax / SUBREGION_SIZE;
   ump_run_sync(&world_add_shadow_task);
 }
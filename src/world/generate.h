@@ -31,6 +31,23 @@
 #include "terrain-tilemap.h"
 #include "env-vmap.h"
 
+/**
+ * If non-zero, world_generate() uses the original single-threaded generator,
+ * which draws every random value from one Mersenne Twister. This produces
+ * different worlds from the default parallel generator, and exists to compare
+ * the two. Defaults to zero.
+ */
+extern int world_generate_legacy;
+
+/**
+ * Identifies the behaviour of the C world generators: world_generate(),
+ * world_add_shadow(), the vmap painters and the world object distributor.
+ * This MUST be incremented by any change which alters the worlds they
+ * produce, since it is part of the key under which generated worlds are
+ * cached (see world-cache.h).
+ */
+#define WORLD_GENERATOR_VERSION 1
+
 void world_generate(terrain_tilemap*, unsigned seed);
 void world_add_shadow(terrain_tilemap*, const env_vmap*);
 
@@ -29,8 +29,12 @@
 #include <config.h>
 #endif
 
+#include <SDL.h>
+
+#include <stdlib.h>
 #include <string.h>
 
+#include "../alloc.h"
 #include "../math/coords.h"
 #include "../math/rand.h"
 #include "env-vmap.h"
@@ -54,23 +58,110 @@ typedef struct {
   ntvp_state_transition transitions[MAX_TRANSITIONS];
 } ntvp_state;
 
+/**
+ * The form of a state used for evaluation, built by ntvp_compile() when the
+ * NFA is frozen. All of an NFA's compiled states fit in a few cache lines.
+ */
+typedef struct {
+  env_voxel_type from_type, to_type;
+  /**
+   * The visibility values of to_type, packed as in voxel_visibilites.
+   */
+  unsigned char visibility;
+  unsigned char branch_count;
+  unsigned char branch_to_state;
+  unsigned char num_transitions;
+  /**
+   * The index of the first transition of this state in the compiled
+   * transition table.
+   */
+  unsigned short first_transition;
+  /**
+   * ceil(2**32 / num_transitions), or 0 if there is at most one transition.
+   *
+   * The low 32 bits of (r * transition_reciprocal) are the fraction part of
+   * r / num_transitions, so the transition for a random number r is
+   * (((r * transition_reciprocal) & 0xFFFFFFFF) * num_transitions) >> 32,
+   * which equals r % num_transitions without a division. This is exact
+   * whenever r and num_transitions both fit in 16 bits, which holds for the
+   * results of lcgrand() and the 8-bit transition counts here.
+   */
+  unsigned transition_reciprocal;
+} ntvp_compiled_state;
+
 typedef struct {
   int is_frozen;
   ntvp_state states[MAX_STATES];
   unsigned char voxel_visibilites[NUM_ENV_VOXEL_TYPES];
+
+  /**
+   * Valid once is_frozen is set. The transitions of every state, stored
+   * contiguously.
+   */
+  ntvp_compiled_state compiled_states[MAX_STATES];
+  ntvp_state_transition* compiled_transitions;
 } ntvp_nfa;
 
+typedef struct {
+  unsigned short x, y, z;
+  unsigned char state;
+} ntvp_turtle;
+
+/**
+ * Scratch memory private to each thread which runs ntvp_do_paint(), kept
+ * across paints.
+ */
+typedef struct {
+  /**
+   * The breadth-first frontier of turtles. Only the first max_iterations
+   * turtles are ever evaluated, so it need not be any longer than that.
+   */
+  ntvp_turtle* turtles;
+  unsigned turtles_size;
+  /**
+   * The maximum visibility level of each 2x2x2 cell within the bounding box
+   * of the current operation, in the same (Z,X,Y) order as the cells
+   * themselves, so that they can be written back in memory order once the
+   * paint is complete.
+   */
+  unsigned char* visibility;
+  unsigned visibility_size;
+} ntvp_scratch;
+
+/* Bounding boxes with more cells than this have their visibility written
+ * directly rather than batched.
+ */
+#define MAX_BATCHED_VISIBILITY_CELLS (256*256*ENV_VMAP_H/8)
+
 static void ntvp_do_paint(env_vmap*, const vmap_paint_operation*);
+static void ntvp_compile(ntvp_nfa*);
+static void ntvp_scratch_delete(void*);
 
 static ntvp_nfa ntvp_nfas[MAX_NFAS];
 static unsigned ntvp_num_nfas = 1;
+static SDL_TLSID ntvp_scratch_tls;
 
 #define CKIX(ix,max) do { if (!(ix) || (ix) >= (max)) return 0; } while (0)
 #define CKNF(nfa) do { if (ntvp_nfas[nfa].is_frozen) return 0; } while (0)
 
 void ntvp_clear_all(void) {
+  unsigned i;
+
+  for (i = 1; i < ntvp_num_nfas; ++i)
+    free(ntvp_nfas[i].compiled_transitions);
+
   ntvp_num_nfas = 1;
   memset(ntvp_nfas, 0, sizeof(ntvp_nfas));
+
+  /* Created here since this is always called on the main thread before
+   * anything is painted.
+   */
+  if (!ntvp_scratch_tls) {
+    ntvp_scratch_tls = SDL_TLSCreate();
+    if (!ntvp_scratch_tls)
+      errx(EX_SOFTWARE, "Unable to allocate TLS object: %s",
+           SDL_GetError());
+  }
 }
 
 unsigned ntvp_new(void) {
@@ -148,42 +239,130 @@ unsigned ntvp_paint(unsigned nfa,
 
   CKIX(nfa, ntvp_num_nfas);
 
-  ntvp_nfas[nfa].is_frozen = 1;
+  if (!ntvp_nfas[nfa].is_frozen) {
+    ntvp_compile(ntvp_nfas + nfa);
+    ntvp_nfas[nfa].is_frozen = 1;
+  }
   vmap_painter_add(&op);
 
   return max_iterations/1024? max_iterations/1024 : 1;
 }
 
+static void ntvp_compile(ntvp_nfa* nfa) {
+  unsigned s, num_transitions = 0;
+
+  for (s = 0; s < MAX_STATES; ++s)
+    num_transitions += nfa->states[s].num_transitions;
+
+  nfa->compiled_transitions = xmalloc(
+    sizeof(ntvp_state_transition) * (num_transitions? num_transitions : 1));
+
+  num_transitions = 0;
+  for (s = 0; s < MAX_STATES; ++s) {
+    nfa->compiled_states[s].from_type = nfa->states[s].from_type;
+    nfa->compiled_states[s].to_type = nfa->states[s].to_type;
+    nfa->compiled_states[s].visibility =
+      nfa->voxel_visibilites[nfa->states[s].to_type];
+    nfa->compiled_states[s].branch_count = nfa->states[s].branch_count;
+    nfa->compiled_states[s].branch_to_state = nfa->states[s].branch_to_state;
+    nfa->compiled_states[s].num_transitions = nfa->states[s].num_transitions;
+    nfa->compiled_states[s].first_transition = num_transitions;
+    nfa->compiled_states[s].transition_reciprocal =
+      nfa->states[s].num_transitions > 1?
+      (unsigned)(((1ULL << 32) + nfa->states[s].num_transitions - 1) /
+                 nfa->states[s].num_transitions) : 0;
+    memcpy(nfa->compiled_transitions + num_transitions,
+           nfa->states[s].transitions,
+           sizeof(ntvp_state_transition) * nfa->states[s].num_transitions);
+    num_transitions += nfa->states[s].num_transitions;
+  }
+}
+
+static ntvp_scratch* ntvp_get_scratch(unsigned num_turtles,
+                                      unsigned num_cells) {
+  ntvp_scratch* scratch = SDL_TLSGet(ntvp_scratch_tls);
+
+  if (!scratch) {
+    scratch = zxmalloc(sizeof(ntvp_scratch));
+    SDL_TLSSet(ntvp_scratch_tls, scratch, ntvp_scratch_delete);
+  }
+
+  if (scratch->turtles_size < num_turtles) {
+    free(scratch->turtles);
+    scratch->turtles = xmalloc(sizeof(ntvp_turtle) * num_turtles);
+    scratch->turtles_size = num_turtles;
+  }
+
+  if (scratch->visibility_size < num_cells) {
+    free(scratch->visibility);
+    scratch->visibility = xmalloc(num_cells);
+    scratch->visibility_size = num_cells;
+  }
+
+  return scratch;
+}
+
+static void ntvp_scratch_delete(void* vscratch) {
+  ntvp_scratch* scratch = vscratch;
+
+  free(scratch->turtles);
+  free(scratch->visibility);
+  free(scratch);
+}
+
 static void ntvp_do_paint(env_vmap* vmap,
                           const vmap_paint_operation* op) {
-  unsigned short iterations_left = (op->parms[3] >> 16) & 0xFFFF;
-  const ntvp_state* nfa = ntvp_nfas[op->parms[3] & 0xFF].states;
-  const unsigned char* voxel_visibilites =
-    ntvp_nfas[op->parms[3] & 0xFF].voxel_visibilites;
-  /* Each transition or branch writes its new state at states[head++]; each
-   * iteration advances tail, and operates on states[tail++]. Thus, we get
+  unsigned iterations = (op->parms[3] >> 16) & 0xFFFF;
+  const ntvp_nfa* nfa_def = ntvp_nfas + (op->parms[3] & 0xFF);
+  const ntvp_compiled_state*restrict nfa = nfa_def->compiled_states;
+  const ntvp_state_transition*restrict transitions =
+    nfa_def->compiled_transitions;
+  const ntvp_compiled_state*restrict state;
+  const ntvp_state_transition*restrict transition;
+  ntvp_scratch* scratch;
+  /* Each transition or branch writes its new state at turtles[head++]; each
+   * iteration advances tail, and operates on turtles[tail++]. Thus, we get
    * cheap breadth-first evaluation with a hard limit on recursion depth.
+   * Turtles which would land beyond the iteration limit are never evaluated,
+   * so they are simply not stored.
    */
-  struct {
-    unsigned short x, y, z;
-    unsigned char state;
-  } states[65536];
-  unsigned short head, tail;
+  ntvp_turtle*restrict turtles;
+  unsigned head, tail;
+  /* Visibility is only ever raised, so the levels can be accumulated per
+   * cell and written back in one ordered pass instead of a read-modify-write
+   * of two visibility bytes per voxel.
+   */
+  unsigned char*restrict cell_visibility;
+  unsigned cx0, cz0, ncx, ncz, cx, cy, cz, num_cells;
   unsigned short xmin, xmax, zmin, zmax, xmask, zmask;
-  unsigned i, rnd, s, vis;
-
-  states[0].x = op->parms[0];
-  states[0].y = op->parms[1];
-  states[0].z = op->parms[2];
-  states[0].state = 0;
+  unsigned i, rnd, vis, level, r;
 
   xmin = op->x;
-  xmax = umax(op->x + op->w - 1, vmap->xmax - 1);
+  xmax = umin(op->x + op->w - 1, vmap->xmax - 1);
   xmask = vmap->is_toroidal? vmap->xmax - 1 : 0xFFFF;
   zmin = op->z;
-  zmax = umax(op->z + op->w - 1, vmap->zmax - 1);
+  zmax = umin(op->z + op->h - 1, vmap->zmax - 1);
   zmask = vmap->is_toroidal? vmap->zmax - 1 : 0xFFFF;
 
+  cx0 = xmin/2;
+  cz0 = zmin/2;
+  ncx = xmax/2 - cx0 + 1;
+  ncz = zmax/2 - cz0 + 1;
+  num_cells = ncx * ncz * (ENV_VMAP_H/2);
+  if (xmin > xmax || zmin > zmax || num_cells > MAX_BATCHED_VISIBILITY_CELLS)
+    num_cells = 0;
+
+  scratch = ntvp_get_scratch(iterations? iterations : 1, num_cells);
+  turtles = scratch->turtles;
+  cell_visibility = num_cells? scratch->visibility : NULL;
+  if (cell_visibility)
+    memset(cell_visibility, 0, num_cells);
+
+  turtles[0].x = op->parms[0];
+  turtles[0].y = op->parms[1];
+  turtles[0].z = op->parms[2];
+  turtles[0].state = 0;
+
   rnd = 0;
   for (i = 0; i < 4; ++i)
     rnd = chaos_accum(rnd, op->parms[i]);
@@ -192,40 +371,66 @@ static void ntvp_do_paint(env_vmap* vmap,
   vis = lcgrand(&rnd) & 0x3;
   vis <<= 1;
 
-  for (tail = 0, head = 1; head != tail && iterations_left;
-       ++tail, --iterations_left) {
-    s = states[tail].state;
-
-    if (states[tail].x >= xmin && states[tail].x <= xmax &&
-        states[tail].z >= zmin && states[tail].z <= zmax &&
-        states[tail].y < ENV_VMAP_H &&
-        vmap->voxels[env_vmap_offset(vmap, states[tail].x,
-                                     states[tail].y,
-                                     states[tail].z)] == nfa[s].from_type) {
-      vmap->voxels[env_vmap_offset(vmap, states[tail].x,
-                                   states[tail].y,
-                                   states[tail].z)] = nfa[s].to_type;
-      env_vmap_make_visible(
-        vmap, states[tail].x, states[tail].y, states[tail].z,
-        (voxel_visibilites[nfa[s].to_type] >> vis) & 3);
+  for (tail = 0, head = 1; tail < head && tail < iterations; ++tail) {
+    state = nfa + turtles[tail].state;
+
+    if (turtles[tail].x >= xmin && turtles[tail].x <= xmax &&
+        turtles[tail].z >= zmin && turtles[tail].z <= zmax &&
+        turtles[tail].y < ENV_VMAP_H &&
+        vmap->voxels[env_vmap_offset(vmap, turtles[tail].x,
+                                     turtles[tail].y,
+                                     turtles[tail].z)] == state->from_type) {
+      env_vmap_put(vmap, turtles[tail].x, turtles[tail].y, turtles[tail].z,
+                   state->to_type);
+
+      level = (state->visibility >> vis) & 3;
+      if (!level) {
+        /* Visibility is never lowered, so there is nothing to do */
+      } else if (cell_visibility) {
+        i = ((turtles[tail].z/2 - cz0) * ncx +
+             (turtles[tail].x/2 - cx0)) * (ENV_VMAP_H/2) +
+          turtles[tail].y/2;
+        if (level > cell_visibility[i])
+          cell_visibility[i] = level;
+      } else {
+        env_vmap_make_visible(
+          vmap, turtles[tail].x, turtles[tail].y, turtles[tail].z, level);
+      }
     }
 
-    for (i = 0; i < nfa[s].branch_count; ++i) {
-      states[head] = states[tail];
-      states[head].state = nfa[s].branch_to_state;
+    for (i = 0; i < state->branch_count && head < iterations; ++i) {
+      turtles[head] = turtles[tail];
+      turtles[head].state = state->branch_to_state;
       ++head;
     }
 
-    if (nfa[s].num_transitions) {
-      i = lcgrand(&rnd) % nfa[s].num_transitions;
-      states[head] = states[tail];
-      states[head].x += (signed short)nfa[s].transitions[i].dx;
-      states[head].x &= xmask;
-      states[head].y += (signed short)nfa[s].transitions[i].dy;
-      states[head].z += (signed short)nfa[s].transitions[i].dz;
-      states[head].z &= zmask;
-      states[head].state = nfa[s].transitions[i].to_state;
-      ++head;
+    if (state->num_transitions) {
+      r = lcgrand(&rnd);
+      /* r % num_transitions, via the fractional part of r / num_transitions */
+      transition = transitions + state->first_transition +
+        (unsigned)((unsigned long long)
+                   (unsigned)(r * state->transition_reciprocal) *
+                   state->num_transitions >> 32);
+      if (head < iterations) {
+        turtles[head] = turtles[tail];
+        turtles[head].x += (signed short)transition->dx;
+        turtles[head].x &= xmask;
+        turtles[head].y += (signed short)transition->dy;
+        turtles[head].z += (signed short)transition->dz;
+        turtles[head].z &= zmask;
+        turtles[head].state = transition->to_state;
+        ++head;
+      }
     }
   }
+
+  if (cell_visibility) {
+    for (cz = 0; cz < ncz; ++cz)
+      for (cx = 0; cx < ncx; ++cx)
+        for (cy = 0; cy < ENV_VMAP_H/2; ++cy)
+          if (cell_visibility[(cz*ncx + cx) * (ENV_VMAP_H/2) + cy])
+            env_vmap_make_visible(
+              vmap, (cx0 + cx)*2, cy*2, (cz0 + cz)*2,
+              cell_visibility[(cz*ncx + cx) * (ENV_VMAP_H/2) + cy]);
+  }
 }
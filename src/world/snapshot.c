@@ -0,0 +1,891 @@
+/*-
+ * Copyright (c) 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "../bsd.h"
+#include "../alloc.h"
+#include "terrain-tilemap.h"
+#include "env-vmap.h"
+#include "flower-map.h"
+#include "snapshot.h"
+
+/* File layout
+ *
+ * The file is divided into blocks of BLOCK_SZ bytes. The first block holds
+ * the header, described below. Each section starts at a multiple of
+ * SECTION_ALIGN, which is at least the page size of any supported platform,
+ * so that sections can be mapped directly. The block map follows the last
+ * section, and holds one bit per block preceding it (LSB first), set iff the
+ * block was written. Blocks which are entirely zero are not written, and
+ * their bits are clear; the section checksums cover only the blocks which
+ * were written, so absent blocks are never read while loading.
+ *
+ * Header, all integers little-endian:
+ *   0   char[8]  magic, "MGWORLD\0"
+ *   8   u32      format version (WORLD_SNAPSHOT_VERSION)
+ *   12  u32      block size (BLOCK_SZ)
+ *   16  u64      tag
+ *   24  u64      total file size
+ *   32  u64      checksum of the header block, with this field zeroed
+ *   40  section  block map
+ *   64  u32[3]   tilemap xmax, zmax, number of levels in the mip chain
+ *   76  u32[3]   vmap xmax, zmax, is_toroidal
+ *   88  u32[2]   flower map fhives_w, fhives_h
+ *   96  u64      total number of flowers
+ *   104 section[NUM_SECTIONS], in the order of the enum below
+ * where a section is a u64 offset, u64 length and u64 checksum. The rest of
+ * the header block is zero.
+ *
+ * Sections:
+ *   TILEMAP          For each level of the mip chain, largest first, the
+ *                    types (1 byte each) then the altitudes (u16 each).
+ *   FHIVE_SIZES      The number of flowers in each fhive (u32 each).
+ *   FLOWERS          The flowers of each fhive, in fhive order; each is
+ *                    the type, y (1 byte each), x, z (u16 each).
+ *   VMAP_STORAGE     The vmap voxels and visibility, in memory layout.
+ *   VMAP_COLUMNS     The vmap column occupancy index (u32 each).
+ *   VMAP_SUPERCELLS  The vmap supercell occupancy index.
+ */
+#define BLOCK_SZ 4096
+#define SECTION_ALIGN 65536
+#define MAGIC "MGWORLD"
+/* Upper bound on any dimension, so that sizes computed from an untrusted
+ * header cannot overflow.
+ */
+#define MAX_DIM 32768
+
+enum {
+  SECTION_TILEMAP = 0,
+  SECTION_FHIVE_SIZES,
+  SECTION_FLOWERS,
+  SECTION_VMAP_STORAGE,
+  SECTION_VMAP_COLUMNS,
+  SECTION_VMAP_SUPERCELLS,
+  NUM_SECTIONS
+};
+
+typedef struct {
+  unsigned long long offset, length, checksum;
+} snapshot_section;
+
+typedef struct {
+  unsigned version, block_sz;
+  unsigned long long tag, file_sz, checksum;
+  snapshot_section block_map;
+  unsigned tilemap_xmax, tilemap_zmax, tilemap_levels;
+  unsigned vmap_xmax, vmap_zmax, vmap_is_toroidal;
+  unsigned fhives_w, fhives_h;
+  unsigned long long num_flowers;
+  snapshot_section sections[NUM_SECTIONS];
+} snapshot_header;
+
+#define HEADER_CHECKSUM_OFFSET 32
+
+static inline void put_le16(unsigned char* dst, unsigned v) {
+  dst[0] = v;
+  dst[1] = v >> 8;
+}
+
+static inline void put_le32(unsigned char* dst, unsigned v) {
+  dst[0] = v;
+  dst[1] = v >> 8;
+  dst[2] = v >> 16;
+  dst[3] = v >> 24;
+}
+
+static inline void put_le64(unsigned char* dst, unsigned long long v) {
+  put_le32(dst, (unsigned)v);
+  put_le32(dst + 4, (unsigned)(v >> 32));
+}
+
+static inline unsigned get_le16(const unsigned char* src) {
+  return src[0] | (src[1] << 8);
+}
+
+static inline unsigned get_le32(const unsigned char* src) {
+  return src[0] | (src[1] << 8) | (src[2] << 16) | ((unsigned)src[3] << 24);
+}
+
+static inline unsigned long long get_le64(const unsigned char* src) {
+  return get_le32(src) | ((unsigned long long)get_le32(src + 4) << 32);
+}
+
+static int host_is_little_endian(void) {
+  const unsigned one = 1;
+  return *(const unsigned char*)&one;
+}
+
+static inline unsigned long long hash_word(unsigned long long hash,
+                                           unsigned long long word) {
+  /* FNV-1a on whole words. Multiplication only carries differences towards
+   * the high bits, so fold them back down to let later words mix with them.
+   */
+  hash ^= word;
+  hash *= 1099511628211ULL;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+unsigned long long world_snapshot_hash(unsigned long long hash,
+                                       const void* vdata, size_t len) {
+  const unsigned char* data = vdata;
+  unsigned char tail[8];
+
+  for (; len >= 8; data += 8, len -= 8)
+    hash = hash_word(hash, get_le64(data));
+
+  if (len) {
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data, len);
+    hash = hash_word(hash, get_le64(tail));
+  }
+
+  return hash;
+}
+
+static unsigned char* encode_section(unsigned char* dst,
+                                     const snapshot_section* section) {
+  put_le64(dst, section->offset);
+  put_le64(dst + 8, section->length);
+  put_le64(dst + 16, section->checksum);
+  return dst + 24;
+}
+
+static const unsigned char* decode_section(snapshot_section* section,
+                                           const unsigned char* src) {
+  section->offset = get_le64(src);
+  section->length = get_le64(src + 8);
+  section->checksum = get_le64(src + 16);
+  return src + 24;
+}
+
+static void encode_header(unsigned char dst[BLOCK_SZ],
+                          const snapshot_header* header) {
+  unsigned char* p = dst;
+  unsigned i;
+
+  memset(dst, 0, BLOCK_SZ);
+  memcpy(p, MAGIC, sizeof(MAGIC)); p += 8;
+  put_le32(p, header->version); p += 4;
+  put_le32(p, header->block_sz); p += 4;
+  put_le64(p, header->tag); p += 8;
+  put_le64(p, header->file_sz); p += 8;
+  put_le64(p, header->checksum); p += 8;
+  p = encode_section(p, &header->block_map);
+  put_le32(p, header->tilemap_xmax); p += 4;
+  put_le32(p, header->tilemap_zmax); p += 4;
+  put_le32(p, header->tilemap_levels); p += 4;
+  put_le32(p, header->vmap_xmax); p += 4;
+  put_le32(p, header->vmap_zmax); p += 4;
+  put_le32(p, header->vmap_is_toroidal); p += 4;
+  put_le32(p, header->fhives_w); p += 4;
+  put_le32(p, header->fhives_h); p += 4;
+  put_le64(p, header->num_flowers); p += 8;
+  for (i = 0; i < NUM_SECTIONS; ++i)
+    p = encode_section(p, header->sections + i);
+}
+
+static void decode_header(snapshot_header* header,
+                          const unsigned char src[BLOCK_SZ]) {
+  const unsigned char* p = src + 8;
+  unsigned i;
+
+  header->version = get_le32(p); p += 4;
+  header->block_sz = get_le32(p); p += 4;
+  header->tag = get_le64(p); p += 8;
+  header->file_sz = get_le64(p); p += 8;
+  header->checksum = get_le64(p); p += 8;
+  p = decode_section(&header->block_map, p);
+  header->tilemap_xmax = get_le32(p); p += 4;
+  header->tilemap_zmax = get_le32(p); p += 4;
+  header->tilemap_levels = get_le32(p); p += 4;
+  header->vmap_xmax = get_le32(p); p += 4;
+  header->vmap_zmax = get_le32(p); p += 4;
+  header->vmap_is_toroidal = get_le32(p); p += 4;
+  header->fhives_w = get_le32(p); p += 4;
+  header->fhives_h = get_le32(p); p += 4;
+  header->num_flowers = get_le64(p); p += 8;
+  for (i = 0; i < NUM_SECTIONS; ++i)
+    p = decode_section(header->sections + i, p);
+}
+
+static unsigned long long header_checksum(const unsigned char block[BLOCK_SZ]) {
+  static const unsigned char zero[8];
+  unsigned long long hash = WORLD_SNAPSHOT_HASH_INIT;
+
+  hash = world_snapshot_hash(hash, block, HEADER_CHECKSUM_OFFSET);
+  hash = world_snapshot_hash(hash, zero, sizeof(zero));
+  return world_snapshot_hash(hash, block + HEADER_CHECKSUM_OFFSET + 8,
+                             BLOCK_SZ - HEADER_CHECKSUM_OFFSET - 8);
+}
+
+/* The lengths of the sections implied by the dimensions in the header */
+static void expected_section_lengths(unsigned long long lengths[NUM_SECTIONS],
+                                     const snapshot_header* header) {
+  unsigned long long xs, zs, levels;
+
+  lengths[SECTION_TILEMAP] = 0;
+  for (xs = header->tilemap_xmax, zs = header->tilemap_zmax, levels = 0;
+       levels < header->tilemap_levels; xs /= 2, zs /= 2, ++levels)
+    lengths[SECTION_TILEMAP] += xs * zs * (sizeof(terrain_tile_type) + 2);
+
+  lengths[SECTION_FHIVE_SIZES] =
+    4ULL * header->fhives_w * header->fhives_h;
+  lengths[SECTION_FLOWERS] = 6 * header->num_flowers;
+  lengths[SECTION_VMAP_STORAGE] =
+    env_vmap_storage_size(header->vmap_xmax, header->vmap_zmax);
+  lengths[SECTION_VMAP_COLUMNS] =
+    4ULL * header->vmap_xmax * header->vmap_zmax;
+  lengths[SECTION_VMAP_SUPERCELLS] =
+    env_vmap_supercell_occupancy_size(header->vmap_xmax, header->vmap_zmax);
+}
+
+static inline int is_power_of_two(unsigned n) {
+  return n && !(n & (n-1));
+}
+
+/*****************************************************************************
+ * Writing
+ *****************************************************************************/
+
+typedef struct {
+  FILE* out;
+  /* The position of out, or ~0 if unknown */
+  unsigned long long pos;
+  /* The block currently being assembled, and its index in the file */
+  unsigned char block[BLOCK_SZ];
+  unsigned fill;
+  unsigned long long block_ix;
+  /* One bit per block which has been written */
+  unsigned char* block_map;
+  size_t block_map_cap;
+  /* The section currently being written */
+  snapshot_section section;
+  int ok;
+} snapshot_writer;
+
+static void writer_write(snapshot_writer* this, unsigned long long offset,
+                         const void* data, size_t len) {
+  if (!this->ok) return;
+
+  if (offset != this->pos &&
+      fseeko(this->out, (off_t)offset, SEEK_SET)) {
+    this->ok = 0;
+    return;
+  }
+
+  if (1 != fwrite(data, len, 1, this->out)) {
+    this->ok = 0;
+    return;
+  }
+
+  this->pos = offset + len;
+}
+
+static int block_is_zero(const unsigned char block[BLOCK_SZ]) {
+  unsigned long long any = 0, word;
+  unsigned i;
+
+  for (i = 0; i < BLOCK_SZ; i += sizeof(word)) {
+    memcpy(&word, block + i, sizeof(word));
+    any |= word;
+  }
+
+  return !any;
+}
+
+static void writer_grow_block_map(snapshot_writer* this, size_t len) {
+  size_t old_cap = this->block_map_cap;
+
+  if (len <= this->block_map_cap) return;
+
+  while (len > this->block_map_cap)
+    this->block_map_cap *= 2;
+  this->block_map = xrealloc(this->block_map, this->block_map_cap);
+  memset(this->block_map + old_cap, 0, this->block_map_cap - old_cap);
+}
+
+static void writer_mark_block(snapshot_writer* this, unsigned long long ix) {
+  writer_grow_block_map(this, ix/8 + 1);
+  this->block_map[ix/8] |= 1 << (ix % 8);
+}
+
+static void writer_flush_block(snapshot_writer* this) {
+  if (!this->fill) return;
+
+  memset(this->block + this->fill, 0, BLOCK_SZ - this->fill);
+  if (!block_is_zero(this->block)) {
+    writer_mark_block(this, this->block_ix);
+    this->section.checksum = world_snapshot_hash(
+      this->section.checksum, this->block, BLOCK_SZ);
+    writer_write(this, this->block_ix * BLOCK_SZ, this->block, BLOCK_SZ);
+  }
+
+  ++this->block_ix;
+  this->fill = 0;
+}
+
+static void writer_put(snapshot_writer* this, const void* vdata, size_t len) {
+  const unsigned char* data = vdata;
+  size_t n;
+
+  this->section.length += len;
+  while (len) {
+    n = BLOCK_SZ - this->fill;
+    if (n > len) n = len;
+
+    memcpy(this->block + this->fill, data, n);
+    this->fill += n;
+    data += n;
+    len -= n;
+
+    if (BLOCK_SZ == this->fill)
+      writer_flush_block(this);
+  }
+}
+
+/* Equivalent to writer_put() with len zero bytes, but whole blocks are
+ * skipped without being assembled or scanned.
+ */
+static void writer_put_zeros(snapshot_writer* this, size_t len) {
+  size_t n;
+
+  if (this->fill) {
+    n = BLOCK_SZ - this->fill;
+    if (n > len) n = len;
+
+    memset(this->block + this->fill, 0, n);
+    this->fill += n;
+    this->section.length += n;
+    len -= n;
+
+    if (BLOCK_SZ != this->fill) return;
+    writer_flush_block(this);
+  }
+
+  /* Entirely-zero blocks are holes; only the position needs to advance */
+  this->block_ix += len / BLOCK_SZ;
+  this->section.length += len / BLOCK_SZ * BLOCK_SZ;
+  len %= BLOCK_SZ;
+
+  memset(this->block, 0, len);
+  this->fill = len;
+  this->section.length += len;
+}
+
+static void writer_put_le16s(snapshot_writer* this,
+                             const unsigned short* data, size_t n) {
+  unsigned char buf[2];
+  size_t i;
+
+  if (host_is_little_endian()) {
+    writer_put(this, data, n * sizeof(unsigned short));
+  } else {
+    for (i = 0; i < n; ++i) {
+      put_le16(buf, data[i]);
+      writer_put(this, buf, sizeof(buf));
+    }
+  }
+}
+
+static void writer_put_le32s(snapshot_writer* this,
+                             const unsigned* data, size_t n) {
+  unsigned char buf[4];
+  size_t i;
+
+  if (host_is_little_endian()) {
+    writer_put(this, data, n * sizeof(unsigned));
+  } else {
+    for (i = 0; i < n; ++i) {
+      put_le32(buf, data[i]);
+      writer_put(this, buf, sizeof(buf));
+    }
+  }
+}
+
+static void writer_begin_section(snapshot_writer* this) {
+  writer_flush_block(this);
+  this->block_ix = (this->block_ix + SECTION_ALIGN/BLOCK_SZ - 1) /
+    (SECTION_ALIGN/BLOCK_SZ) * (SECTION_ALIGN/BLOCK_SZ);
+  this->section.offset = this->block_ix * BLOCK_SZ;
+  this->section.length = 0;
+  this->section.checksum = WORLD_SNAPSHOT_HASH_INIT;
+}
+
+static void writer_end_section(snapshot_writer* this,
+                               snapshot_section* dst) {
+  writer_flush_block(this);
+  *dst = this->section;
+}
+
+static void write_tilemap(snapshot_writer* writer, snapshot_header* header,
+                          const terrain_tilemap* tilemap) {
+  const terrain_tilemap* level;
+
+  header->tilemap_xmax = tilemap->xmax;
+  header->tilemap_zmax = tilemap->zmax;
+  header->tilemap_levels = 0;
+
+  writer_begin_section(writer);
+  for (level = tilemap; level; level = SLIST_NEXT(level, next)) {
+    writer_put(writer, level->type,
+               sizeof(terrain_tile_type) * level->xmax * level->zmax);
+    writer_put_le16s(writer, level->alt, level->xmax * level->zmax);
+    ++header->tilemap_levels;
+  }
+  writer_end_section(writer, header->sections + SECTION_TILEMAP);
+}
+
+static void write_flowers(snapshot_writer* writer, snapshot_header* header,
+                          const flower_map* flowers) {
+  unsigned i, j, n = flowers->fhives_w * flowers->fhives_h;
+  const flower_desc* flower;
+  unsigned char buf[6];
+
+  header->fhives_w = flowers->fhives_w;
+  header->fhives_h = flowers->fhives_h;
+  header->num_flowers = 0;
+
+  writer_begin_section(writer);
+  for (i = 0; i < n; ++i) {
+    put_le32(buf, flowers->hives[i].size);
+    writer_put(writer, buf, 4);
+    header->num_flowers += flowers->hives[i].size;
+  }
+  writer_end_section(writer, header->sections + SECTION_FHIVE_SIZES);
+
+  writer_begin_section(writer);
+  for (i = 0; i < n; ++i) {
+    for (j = 0; j < flowers->hives[i].size; ++j) {
+      flower = flowers->hives[i].flowers + j;
+      buf[0] = flower->type;
+      buf[1] = flower->y;
+      put_le16(buf + 2, flower->x);
+      put_le16(buf + 4, flower->z);
+      writer_put(writer, buf, sizeof(buf));
+    }
+  }
+  writer_end_section(writer, header->sections + SECTION_FLOWERS);
+}
+
+static void write_vmap(snapshot_writer* writer, snapshot_header* header,
+                       env_vmap* vmap) {
+  size_t column_sz = ENV_VMAP_H/4 * 64;
+  size_t voxels_sz = (size_t)vmap->xmax * vmap->zmax * ENV_VMAP_H;
+  size_t i, n = env_vmap_supercell_occupancy_size(vmap->xmax, vmap->zmax);
+
+  env_vmap_track_occupancy(vmap);
+
+  header->vmap_xmax = vmap->xmax;
+  header->vmap_zmax = vmap->zmax;
+  header->vmap_is_toroidal = !!vmap->is_toroidal;
+
+  /* Columns of supercells are laid out in the same order as the supercell
+   * occupancy index. Empty ones are written as holes without being read, so
+   * saving a sparse vmap doesn't walk the whole reservation.
+   */
+  writer_begin_section(writer);
+  for (i = 0; i < n; ++i) {
+    if (vmap->supercell_occupancy[i])
+      writer_put(writer, vmap->voxels + i * column_sz, column_sz);
+    else
+      writer_put_zeros(writer, column_sz);
+  }
+  writer_put(writer, vmap->voxels + voxels_sz,
+             env_vmap_storage_size(vmap->xmax, vmap->zmax) - voxels_sz);
+  writer_end_section(writer, header->sections + SECTION_VMAP_STORAGE);
+
+  writer_begin_section(writer);
+  writer_put_le32s(writer, vmap->column_occupancy,
+                   (size_t)vmap->xmax * vmap->zmax);
+  writer_end_section(writer, header->sections + SECTION_VMAP_COLUMNS);
+
+  writer_begin_section(writer);
+  writer_put(writer, vmap->supercell_occupancy,
+             env_vmap_supercell_occupancy_size(vmap->xmax, vmap->zmax));
+  writer_end_section(writer, header->sections + SECTION_VMAP_SUPERCELLS);
+}
+
+int world_snapshot_save(const char* filename, unsigned long long tag,
+                        const terrain_tilemap* tilemap, env_vmap* vmap,
+                        const flower_map* flowers) {
+  snapshot_writer writer;
+  snapshot_header header;
+  char* tmpname;
+  size_t block_map_len;
+  int fd;
+
+  /* Write to a uniquely-named file beside the target and rename it into
+   * place, so concurrent savers never share a temporary and readers only
+   * ever see complete snapshots.
+   */
+  tmpname = xmalloc(strlen(filename) + sizeof(".XXXXXX"));
+  sprintf(tmpname, "%s.XXXXXX", filename);
+
+  memset(&writer, 0, sizeof(writer));
+  fd = mkstemp(tmpname);
+  if (-1 == fd) {
+    warn("Unable to create world snapshot %s", tmpname);
+    free(tmpname);
+    return 0;
+  }
+
+  writer.out = fdopen(fd, "wb");
+  if (!writer.out) {
+    warn("Unable to create world snapshot %s", tmpname);
+    close(fd);
+    remove(tmpname);
+    free(tmpname);
+    return 0;
+  }
+  writer.pos = 0;
+  writer.ok = 1;
+  writer.block_map_cap = 64;
+  writer.block_map = zxmalloc(writer.block_map_cap);
+  /* The header is written last, but always occupies the first block */
+  writer.block_ix = 1;
+  writer_mark_block(&writer, 0);
+
+  memset(&header, 0, sizeof(header));
+  header.version = WORLD_SNAPSHOT_VERSION;
+  header.block_sz = BLOCK_SZ;
+  header.tag = tag;
+
+  write_tilemap(&writer, &header, tilemap);
+  write_flowers(&writer, &header, flowers);
+  write_vmap(&writer, &header, vmap);
+
+  writer_flush_block(&writer);
+  block_map_len = (writer.block_ix + 7) / 8;
+  writer_grow_block_map(&writer, block_map_len);
+  header.block_map.offset = writer.block_ix * BLOCK_SZ;
+  header.block_map.length = block_map_len;
+  header.block_map.checksum = world_snapshot_hash(
+    WORLD_SNAPSHOT_HASH_INIT, writer.block_map, block_map_len);
+  writer_write(&writer, header.block_map.offset,
+               writer.block_map, block_map_len);
+  header.file_sz = header.block_map.offset + block_map_len;
+
+  encode_header(writer.block, &header);
+  header.checksum = header_checksum(writer.block);
+  put_le64(writer.block + HEADER_CHECKSUM_OFFSET, header.checksum);
+  writer_write(&writer, 0, writer.block, BLOCK_SZ);
+
+  if (fclose(writer.out))
+    writer.ok = 0;
+
+  if (!writer.ok) {
+    warn("Error writing world snapshot %s", tmpname);
+    remove(tmpname);
+  } else if (rename(tmpname, filename)) {
+    warn("Unable to rename %s to %s", tmpname, filename);
+    remove(tmpname);
+    writer.ok = 0;
+  }
+
+  free(writer.block_map);
+  free(tmpname);
+  return writer.ok;
+}
+
+/*****************************************************************************
+ * Loading
+ *****************************************************************************/
+
+#ifdef HAVE_MMAP
+/* Returns the checksum of the blocks of the given section present in the
+ * file.
+ */
+static unsigned long long section_checksum(const unsigned char* file,
+                                           const unsigned char* block_map,
+                                           const snapshot_section* section) {
+  unsigned long long hash = WORLD_SNAPSHOT_HASH_INIT;
+  unsigned long long ix, begin, end;
+
+  begin = section->offset / BLOCK_SZ;
+  end = (section->offset + section->length + BLOCK_SZ - 1) / BLOCK_SZ;
+  for (ix = begin; ix < end; ++ix)
+    if (block_map[ix/8] & (1 << (ix % 8)))
+      hash = world_snapshot_hash(hash, file + ix * BLOCK_SZ, BLOCK_SZ);
+
+  return hash;
+}
+
+/* Checks the consistency of the header and verifies every checksum. Returns
+ * NULL if the snapshot is usable, or a description of the problem
+ * otherwise.
+ */
+static const char* validate(snapshot_header* header,
+                            const unsigned char* file,
+                            unsigned long long file_sz,
+                            unsigned long long tag) {
+  unsigned long long lengths[NUM_SECTIONS], num_flowers;
+  const snapshot_section* section;
+  const unsigned char* fhive_sizes;
+  unsigned i;
+
+  if (memcmp(file, MAGIC, sizeof(MAGIC)))
+    return "not a world snapshot";
+
+  decode_header(header, file);
+  if (WORLD_SNAPSHOT_VERSION != header->version)
+    return "unsupported snapshot version";
+  if (BLOCK_SZ != header->block_sz)
+    return "unsupported block size";
+  if (header_checksum(file) != header->checksum)
+    return "header checksum mismatch";
+  if (header->file_sz != file_sz)
+    return "file is truncated";
+  if (header->tag != tag)
+    return "snapshot is of a different world";
+
+  if (header->block_map.offset % BLOCK_SZ ||
+      header->block_map.offset > file_sz ||
+      header->block_map.length > file_sz - header->block_map.offset ||
+      header->block_map.length * 8 < header->block_map.offset / BLOCK_SZ)
+    return "invalid block map";
+  if (world_snapshot_hash(WORLD_SNAPSHOT_HASH_INIT,
+                          file + header->block_map.offset,
+                          header->block_map.length) !=
+      header->block_map.checksum)
+    return "block map checksum mismatch";
+
+  if (!is_power_of_two(header->tilemap_xmax) ||
+      !is_power_of_two(header->tilemap_zmax) ||
+      header->tilemap_xmax > MAX_DIM || header->tilemap_zmax > MAX_DIM ||
+      !header->tilemap_levels ||
+      !(header->tilemap_xmax >> (header->tilemap_levels-1)) ||
+      !(header->tilemap_zmax >> (header->tilemap_levels-1)))
+    return "invalid tilemap dimensions";
+  if (!is_power_of_two(header->vmap_xmax) ||
+      !is_power_of_two(header->vmap_zmax) ||
+      header->vmap_xmax < 4 || header->vmap_zmax < 4 ||
+      header->vmap_xmax > MAX_DIM || header->vmap_zmax > MAX_DIM ||
+      header->vmap_is_toroidal > 1)
+    return "invalid vmap dimensions";
+  if (!is_power_of_two(header->fhives_w) ||
+      !is_power_of_two(header->fhives_h) ||
+      header->fhives_w > MAX_DIM || header->fhives_h > MAX_DIM ||
+      header->num_flowers > file_sz)
+    return "invalid flower map dimensions";
+
+  expected_section_lengths(lengths, header);
+  for (i = 0; i < NUM_SECTIONS; ++i) {
+    section = header->sections + i;
+    if (section->offset % SECTION_ALIGN ||
+        section->offset > header->block_map.offset ||
+        section->length > header->block_map.offset - section->offset ||
+        section->length != lengths[i])
+      return "invalid section table";
+  }
+
+  for (i = 0; i < NUM_SECTIONS; ++i)
+    if (section_checksum(file, file + header->block_map.offset,
+                         header->sections + i) !=
+        header->sections[i].checksum)
+      return "section checksum mismatch";
+
+  fhive_sizes = file + header->sections[SECTION_FHIVE_SIZES].offset;
+  num_flowers = 0;
+  for (i = 0; i < header->fhives_w * header->fhives_h; ++i)
+    num_flowers += get_le32(fhive_sizes + i*4);
+  if (num_flowers != header->num_flowers)
+    return "inconsistent flower count";
+
+  return NULL;
+}
+
+static terrain_tilemap* load_tilemap(const snapshot_header* header,
+                                     const unsigned char* file) {
+  const unsigned char* src = file + header->sections[SECTION_TILEMAP].offset;
+  terrain_tilemap* tilemap, * level;
+  unsigned i, n;
+
+  tilemap = terrain_tilemap_new(
+    header->tilemap_xmax, header->tilemap_zmax,
+    header->tilemap_xmax >> (header->tilemap_levels-1),
+    header->tilemap_zmax >> (header->tilemap_levels-1));
+
+  for (level = tilemap; level; level = SLIST_NEXT(level, next)) {
+    n = level->xmax * level->zmax;
+    memcpy(level->type, src, n * sizeof(terrain_tile_type));
+    src += n * sizeof(terrain_tile_type);
+    for (i = 0; i < n; ++i)
+      level->alt[i] = get_le16(src + i*2);
+    src += n * 2;
+  }
+
+  return tilemap;
+}
+
+static flower_map* load_flowers(const snapshot_header* header,
+                                const unsigned char* file) {
+  const unsigned char* sizes =
+    file + header->sections[SECTION_FHIVE_SIZES].offset;
+  const unsigned char* src = file + header->sections[SECTION_FLOWERS].offset;
+  flower_map* flowers;
+  flower_fhive* hive;
+  unsigned i, j, size;
+
+  flowers = flower_map_new(header->fhives_w * FLOWER_FHIVE_SIZE,
+                           header->fhives_h * FLOWER_FHIVE_SIZE);
+
+  for (i = 0; i < header->fhives_w * header->fhives_h; ++i) {
+    hive = flowers->hives + i;
+    size = get_le32(sizes + i*4);
+    if (size > hive->cap) {
+      while (size > hive->cap)
+        hive->cap *= 2;
+      hive->flowers = xrealloc(hive->flowers,
+                               hive->cap * sizeof(flower_desc));
+    }
+
+    for (j = 0; j < size; ++j, src += 6) {
+      hive->flowers[j].type = src[0];
+      hive->flowers[j].y = src[1];
+      hive->flowers[j].x = get_le16(src + 2);
+      hive->flowers[j].z = get_le16(src + 4);
+    }
+    hive->size = size;
+  }
+
+  return flowers;
+}
+
+static env_vmap* load_vmap(const snapshot_header* header,
+                           const unsigned char* file, int fd) {
+  const snapshot_section* sections = header->sections;
+  env_vmap* vmap;
+  size_t i, n;
+
+  vmap = env_vmap_new_mapped(
+    header->vmap_xmax, header->vmap_zmax, header->vmap_is_toroidal, fd,
+    sections[SECTION_VMAP_STORAGE].offset,
+    sections[SECTION_VMAP_COLUMNS].offset,
+    sections[SECTION_VMAP_SUPERCELLS].offset);
+
+  if (!vmap) {
+    /* Fall back to copying everything */
+    vmap = env_vmap_new(header->vmap_xmax, header->vmap_zmax,
+                        header->vmap_is_toroidal);
+    memcpy(vmap->voxels, file + sections[SECTION_VMAP_STORAGE].offset,
+           sections[SECTION_VMAP_STORAGE].length);
+    vmap->column_occupancy = xmalloc(sections[SECTION_VMAP_COLUMNS].length);
+    memcpy(vmap->column_occupancy,
+           file + sections[SECTION_VMAP_COLUMNS].offset,
+           sections[SECTION_VMAP_COLUMNS].length);
+    vmap->supercell_occupancy =
+      xmalloc(sections[SECTION_VMAP_SUPERCELLS].length);
+    memcpy(vmap->supercell_occupancy,
+           file + sections[SECTION_VMAP_SUPERCELLS].offset,
+           sections[SECTION_VMAP_SUPERCELLS].length);
+  }
+
+  if (!host_is_little_endian()) {
+    n = (size_t)vmap->xmax * vmap->zmax;
+    for (i = 0; i < n; ++i)
+      vmap->column_occupancy[i] = get_le32(
+        (const unsigned char*)(vmap->column_occupancy + i));
+  }
+
+  return vmap;
+}
+#endif /* HAVE_MMAP */
+
+int world_snapshot_load(terrain_tilemap** tilemap, env_vmap** vmap,
+                        flower_map** flowers,
+                        const char* filename, unsigned long long tag) {
+#ifdef HAVE_MMAP
+  snapshot_header header;
+  struct stat st;
+  const unsigned char* file;
+  const char* problem;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    if (ENOENT != errno)
+      warn("Unable to open world snapshot %s", filename);
+    return 0;
+  }
+
+  if (fstat(fd, &st)) {
+    warn("Unable to stat world snapshot %s", filename);
+    close(fd);
+    return 0;
+  }
+
+  if (st.st_size < BLOCK_SZ) {
+    warnx("Ignoring world snapshot %s: not a world snapshot", filename);
+    close(fd);
+    return 0;
+  }
+
+  file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (MAP_FAILED == file) {
+    warn("Unable to map world snapshot %s", filename);
+    close(fd);
+    return 0;
+  }
+
+  problem = validate(&header, file, st.st_size, tag);
+  if (problem) {
+    warnx("Ignoring world snapshot %s: %s", filename, problem);
+    munmap((void*)file, st.st_size);
+    close(fd);
+    return 0;
+  }
+
+  *tilemap = load_tilemap(&header, file);
+  *flowers = load_flowers(&header, file);
+  *vmap = load_vmap(&header, file, fd);
+
+  munmap((void*)file, st.st_size);
+  close(fd);
+  return 1;
+#else
+  warnx("Unable to load world snapshot %s: not supported on this platform",
+        filename);
+  return 0;
+#endif
+}
@@ -0,0 +1,109 @@
+/*-
+ * Copyright (c) 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef WORLD_SNAPSHOT_H_
+#define WORLD_SNAPSHOT_H_
+
+#include <stddef.h>
+
+#include "terrain-tilemap.h"
+#include "env-vmap.h"
+#include "flower-map.h"
+
+/**
+ * @file
+ *
+ * World snapshots store the complete output of world generation (the terrain
+ * tilemap and its mip chain, the environment vmap and the flower map) in a
+ * single file, so that a world can be reused rather than regenerated.
+ *
+ * The format is versioned and fully defined: all integers are little-endian,
+ * and every section carries a checksum which is verified on load. The vmap
+ * sections are stored in exactly their in-memory layout at aligned offsets,
+ * so they are mapped directly (copy-on-write) from the file rather than read;
+ * loading thus costs page faults on the parts of the vmap actually used.
+ * Blocks of the file which would be entirely zero are not written at all,
+ * leaving holes on filesystems which support them.
+ */
+
+/**
+ * The version of the snapshot format written by world_snapshot_save().
+ * Snapshots of any other version are rejected.
+ */
+#define WORLD_SNAPSHOT_VERSION 1
+
+/**
+ * The initial value for world_snapshot_hash().
+ */
+#define WORLD_SNAPSHOT_HASH_INIT 14695981039346656037ULL
+
+/**
+ * Accumulates the given bytes into a hash value, which should start at
+ * WORLD_SNAPSHOT_HASH_INIT. The data is consumed as little-endian 64-bit
+ * words, the final partial word being zero-padded; the result is thus only
+ * independent of how the data is split across calls if every call but the
+ * last has a length which is a multiple of 8.
+ *
+ * This is the function used for all checksums in the snapshot format. It is
+ * not cryptographic.
+ */
+unsigned long long world_snapshot_hash(unsigned long long hash,
+                                       const void* data, size_t len);
+
+/**
+ * Writes the given world to a snapshot file. The tag is an arbitrary value
+ * identifying what the world was generated from (eg, its seed), which must be
+ * matched when the snapshot is loaded.
+ *
+ * The file is written under a temporary name and renamed into place, so a
+ * snapshot which is currently mapped by a running process is never modified.
+ *
+ * Occupancy tracking is enabled on the vmap if it was not already, since the
+ * occupancy indices are part of the snapshot.
+ *
+ * Returns whether the snapshot was written successfully. On failure, a
+ * diagnostic is printed.
+ */
+int world_snapshot_save(const char* filename, unsigned long long tag,
+                        const terrain_tilemap*, env_vmap*,
+                        const flower_map*);
+
+/**
+ * Loads a world from a snapshot file written by world_snapshot_save(). On
+ * success, the new tilemap (with its mip chain already calculated), vmap
+ * (with occupancy tracking enabled) and flower map are stored into the given
+ * pointers, which the caller owns, and 1 is returned.
+ *
+ * If the file does not exist, 0 is returned silently. If it cannot be read,
+ * or is malformed, corrupt, of a different version, or has a different tag,
+ * 0 is returned after printing a diagnostic. In either case, the output
+ * pointers are unmodified.
+ */
+int world_snapshot_load(terrain_tilemap**, env_vmap**, flower_map**,
+                        const char* filename, unsigned long long tag);
+
+#endif /* WORLD_SNAPSHOT_H_ */
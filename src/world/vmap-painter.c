@@ -29,10 +29,14 @@
 #include <config.h>
 #endif
 
+#include <SDL.h>
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#include "../alloc.h"
 #include "../micromp.h"
 #include "../math/coords.h"
 #include "env-vmap.h"
@@ -42,26 +46,64 @@
  * sets of work queues. At any given time, one is the "busy set", which is
  * read-only and possibly in use by uMP threads; the other is the "append set",
  * which is write-only and may be appended to by the main thread. Swapping
- * between these two occurs when one fills up, when a barrier is requested, or
- * when flushing the whole state. The basic procedure for this is
- * - Wait for uMP threads to be idle.
+ * between these two occurs only when a barrier is requested or when flushing
+ * the whole state. The basic procedure for this is
+ * - Wait for the uMP task working on the busy set to complete.
  * - Swap the busy and append sets.
- * - If work is to be done, start the uMP threads again.
+ * - Submit a new uMP task for the busy set.
+ *
+ * If the append set fills up, it is grown rather than swapped, so that the
+ * main thread never blocks on painting just to make room. This also matters
+ * for determinism: operations within one set are ordered only by bucket and
+ * colour, so where set boundaries fall changes the order in which
+ * overlapping operations apply. Boundaries must therefore depend only on the
+ * caller, never on how far the busy set has got.
+ *
+ * The busy set is executed as a submitted uMP task (see ump_submit()) rather
+ * than the current task, so that other work done by the main thread in the
+ * meantime (eg, distributing flowers with wod_distribute()) doesn't need to
+ * wait for painting to finish before it can use uMP itself.
  *
  * Parallelism is achieved on the basis that the vast majority of painting
  * operations are relatively small, and thus can be run in parallel if
  * bucketted appropriately.
  *
- * Thus, the world is partitioned into an 8x8 grid (approximately; this is
- * achieved via bitshifts, so non-power-of-two vmaps might not be partitioned
- * exactly this way). Each operation is added to a queue specific to the grid
- * cell in which it occurs; operations that stradle grid boundaries are split
- * into separate operations within each bucket.
+ * Thus, the world is partitioned into a grid of buckets (approximately; this
+ * is achieved via bitshifts, so non-power-of-two vmaps might not be
+ * partitioned exactly this way). The grid is sized from the vmap dimensions
+ * when the painter is initialised: as fine as it can be while buckets are
+ * still large enough for typical operations, so that each phase (see below)
+ * has far more buckets than there are threads and uneven ones balance out.
+ * It deliberately does not depend on the number of threads, since which
+ * operations are split and the order in which overlapping operations apply
+ * both depend on the grid, and the world must not differ between machines.
+ * Each
+ * operation which is no larger than a bucket and does not wrap around the
+ * vmap is added whole to the queue of the bucket containing its origin; its
+ * footprint thus lies within that bucket and its neighbours in the positive X
+ * and Z directions. Other operations are split into separate operations
+ * within each bucket they touch.
+ *
+ * Buckets are coloured by the parity of their X and Z indices, and the four
+ * colours are executed as four consecutive phases. Any two buckets of the
+ * same colour are at least one whole bucket apart on some axis, so their
+ * footprints never meet, even at the supercell granularity of the occupancy
+ * and visibility data. Operations thus never run concurrently with any other
+ * operation whose footprint overlaps theirs, and the result is deterministic
+ * regardless of the number of threads.
+ *
+ * The number of operations and the time spent in each bucket is accumulated
+ * and reported by vmap_painter_flush(); if the VMAP_PAINTER_STATS environment
+ * variable is set, the full per-bucket grid is printed too.
  */
 
-#define NUM_BUCKETS 8
-#define QUEUE_SIZE 65536
-typedef unsigned short vmap_painter_queue_index;
+/* Buckets are never narrower than 1 << MIN_BUCKET_SHIFT (unless the vmap
+ * itself is), so that trees and the like usually fit in one whole.
+ */
+#define MIN_BUCKET_SHIFT 6
+#define MAX_BUCKETS_PER_AXIS 64
+#define INITIAL_QUEUE_SIZE 65536
+typedef unsigned vmap_painter_queue_index;
 
 typedef struct {
   /**
@@ -70,22 +112,26 @@ typedef struct {
    *
    * The zeroth element is never used since index 0 is used as a sentinel.
    */
-  vmap_paint_operation operations[QUEUE_SIZE];
+  vmap_paint_operation* operations;
   /**
    * For each operation, indicates the index of the next operation in the same
    * bucket, or 0 for the end of the list.
    */
-  vmap_painter_queue_index index_list[QUEUE_SIZE];
+  vmap_painter_queue_index* index_list;
+  /**
+   * The length of operations and index_list.
+   */
+  unsigned capacity;
   /**
    * The index of the first operation for each bucket, or 0 if the bucket is
-   * empty.
+   * empty. Indexed by bx + num_xbuckets*bz.
    */
-  vmap_painter_queue_index bucket_start[NUM_BUCKETS][NUM_BUCKETS];
+  vmap_painter_queue_index* bucket_start;
   /**
    * The index of the last operation for each bucket, or undefined if the
-   * bucket is empty.
+   * bucket is empty. Indexed by bx + num_xbuckets*bz.
    */
-  vmap_painter_queue_index bucket_end[NUM_BUCKETS][NUM_BUCKETS];
+  vmap_painter_queue_index* bucket_end;
   /**
    * The number of operations consumed in this queue set, including the unused
    * element at the head of operations.
@@ -93,11 +139,29 @@ typedef struct {
   unsigned num_operations;
 } vmap_painter_queue_set;
 
-static void vmap_painter_execute(unsigned, unsigned);
+typedef struct {
+  /**
+   * The number of operations executed in this bucket.
+   */
+  unsigned operations;
+  /**
+   * The total time spent executing them, in performance counter ticks.
+   */
+  Uint64 ticks;
+} vmap_painter_bucket_stats;
+
+static void vmap_painter_execute(unsigned colour, unsigned ordinal);
+static void vmap_painter_execute_0(unsigned, unsigned);
+static void vmap_painter_execute_1(unsigned, unsigned);
+static void vmap_painter_execute_2(unsigned, unsigned);
+static void vmap_painter_execute_3(unsigned, unsigned);
+static void vmap_painter_size_grid(const env_vmap*);
 static void vmap_painter_init_queue_set(vmap_painter_queue_set*);
+static void vmap_painter_grow_queue_set(vmap_painter_queue_set*);
 static void vmap_painter_swap_sets(void);
 static void vmap_painter_start_busy(int sync);
 static void vmap_painter_add_atomic(const vmap_paint_operation*);
+static void vmap_painter_report(void);
 
 static vmap_painter_queue_set queue_set_alpha, queue_set_beta;
 static vmap_painter_queue_set
@@ -106,11 +170,17 @@ static vmap_painter_queue_set
 
 static env_vmap* vmap;
 static unsigned char bucket_xshift, bucket_zshift;
-
-static ump_task vmap_painter_task = {
-  vmap_painter_execute,
-  NUM_BUCKETS*NUM_BUCKETS,
-  0
+static unsigned num_xbuckets, num_zbuckets;
+static vmap_painter_bucket_stats* bucket_stats;
+static ump_task_id busy_task;
+
+#define NUM_COLOURS 4
+/* num_divisions is set by vmap_painter_size_grid() */
+static ump_task vmap_painter_tasks[NUM_COLOURS] = {
+  { vmap_painter_execute_0, 0, 0 /* unused */ },
+  { vmap_painter_execute_1, 0, 0 /* unused */ },
+  { vmap_painter_execute_2, 0, 0 /* unused */ },
+  { vmap_painter_execute_3, 0, 0 /* unused */ },
 };
 
 void vmap_painter_init(env_vmap* v) {
@@ -119,20 +189,74 @@ void vmap_painter_init(env_vmap* v) {
 
   vmap = v;
 
-  bucket_xshift = bucket_zshift = 0;
-  while (((v->xmax - 1) >> bucket_xshift) >= NUM_BUCKETS)
+  vmap_painter_size_grid(v);
+  vmap_painter_init_queue_set(append_set);
+}
+
+/* Returns the number of buckets to use on an axis of the given length. This
+ * is always even so that colours alternate all the way around a toroidal
+ * vmap.
+ */
+static unsigned vmap_painter_max_buckets(coord max) {
+  unsigned n = 2;
+
+  while (n < MAX_BUCKETS_PER_AXIS && (2*n << MIN_BUCKET_SHIFT) <= max)
+    n *= 2;
+
+  return n;
+}
+
+static void vmap_painter_size_grid(const env_vmap* v) {
+  unsigned colour, old_num_buckets = num_xbuckets * num_zbuckets;
+
+  num_xbuckets = vmap_painter_max_buckets(v->xmax);
+  num_zbuckets = vmap_painter_max_buckets(v->zmax);
+
+  /* Buckets are at least a supercell wide so that no two share one */
+  bucket_xshift = bucket_zshift = 2;
+  while (((v->xmax - 1) >> bucket_xshift) >= num_xbuckets)
     ++bucket_xshift;
-  while (((v->zmax - 1) >> bucket_zshift) >= NUM_BUCKETS)
+  while (((v->zmax - 1) >> bucket_zshift) >= num_zbuckets)
     ++bucket_zshift;
 
-  vmap_painter_init_queue_set(append_set);
+  for (colour = 0; colour < NUM_COLOURS; ++colour)
+    vmap_painter_tasks[colour].num_divisions =
+      num_xbuckets * num_zbuckets / NUM_COLOURS;
+
+  /* Both sets are idle here, since the last flush or abort waited for the
+   * busy set.
+   */
+  if (num_xbuckets * num_zbuckets != old_num_buckets) {
+    queue_set_alpha.bucket_start = xrealloc(
+      queue_set_alpha.bucket_start,
+      sizeof(vmap_painter_queue_index) * num_xbuckets * num_zbuckets);
+    queue_set_alpha.bucket_end = xrealloc(
+      queue_set_alpha.bucket_end,
+      sizeof(vmap_painter_queue_index) * num_xbuckets * num_zbuckets);
+    queue_set_beta.bucket_start = xrealloc(
+      queue_set_beta.bucket_start,
+      sizeof(vmap_painter_queue_index) * num_xbuckets * num_zbuckets);
+    queue_set_beta.bucket_end = xrealloc(
+      queue_set_beta.bucket_end,
+      sizeof(vmap_painter_queue_index) * num_xbuckets * num_zbuckets);
+    bucket_stats = xrealloc(
+      bucket_stats,
+      sizeof(vmap_painter_bucket_stats) * num_xbuckets * num_zbuckets);
+  }
+
+  memset(bucket_stats, 0,
+         sizeof(vmap_painter_bucket_stats) * num_xbuckets * num_zbuckets);
+  /* The busy set's buckets must be valid in case it is executed before
+   * anything is swapped into it.
+   */
+  vmap_painter_init_queue_set(busy_set);
 }
 
 void vmap_painter_abort(void) {
   if (!vmap) return;
 
   vmap_painter_init_queue_set(append_set);
-  ump_join();
+  ump_wait(busy_task);
   vmap = NULL;
 }
 
@@ -141,7 +265,7 @@ void vmap_painter_flush(void) {
 
   vmap_painter_swap_sets();
   vmap_painter_start_busy(1);
-  ump_join();
+  vmap_painter_report();
   vmap = NULL;
 }
 
@@ -149,6 +273,7 @@ void vmap_painter_barrier(void) {
   if (!vmap) return;
 
   vmap_painter_swap_sets();
+  vmap_painter_start_busy(0);
 }
 
 void vmap_painter_add(const vmap_paint_operation* opp) {
@@ -158,6 +283,16 @@ void vmap_painter_add(const vmap_paint_operation* opp) {
 
   if (!vmap) return;
 
+  /* Small operations go whole into the bucket containing their origin; see
+   * the colouring scheme above.
+   */
+  if (op.w && op.h &&
+      op.w <= (1u << bucket_xshift) && op.h <= (1u << bucket_zshift) &&
+      op.x + op.w <= vmap->xmax && op.z + op.h <= vmap->zmax) {
+    vmap_painter_add_atomic(&op);
+    return;
+  }
+
   x0 = op.x;
   x1 = x0 + op.w;
   z0 = op.z;
@@ -188,7 +323,7 @@ void vmap_painter_add(const vmap_paint_operation* opp) {
 }
 
 static void vmap_painter_add_atomic(const vmap_paint_operation* op) {
-  unsigned bx, bz;
+  unsigned bucket;
 
   if (!vmap->is_toroidal &&
       (op->x >= vmap->xmax ||
@@ -198,35 +333,44 @@ static void vmap_painter_add_atomic(const vmap_paint_operation* op) {
     /* Out of bounds, non-toroidal */
     return;
 
-  if (append_set->num_operations == QUEUE_SIZE) {
-    vmap_painter_swap_sets();
-    vmap_painter_start_busy(0);
-  }
+  if (append_set->num_operations == append_set->capacity)
+    vmap_painter_grow_queue_set(append_set);
 
-  bx = op->x >> bucket_xshift;
-  bz = op->z >> bucket_zshift;
+  bucket = (op->x >> bucket_xshift) + num_xbuckets * (op->z >> bucket_zshift);
 
-  if (!append_set->bucket_start[bz][bx]) {
-    append_set->bucket_start[bz][bx] = append_set->num_operations;
+  if (!append_set->bucket_start[bucket]) {
+    append_set->bucket_start[bucket] = append_set->num_operations;
   } else {
-    append_set->index_list[append_set->bucket_end[bz][bx]] =
+    append_set->index_list[append_set->bucket_end[bucket]] =
       append_set->num_operations;
   }
   append_set->operations[append_set->num_operations] = *op;
-  append_set->bucket_end[bz][bx] = append_set->num_operations;
+  append_set->bucket_end[bucket] = append_set->num_operations;
   append_set->index_list[append_set->num_operations] = 0;
   ++append_set->num_operations;
 }
 
 static void vmap_painter_init_queue_set(vmap_painter_queue_set* set) {
+  if (!set->capacity)
+    vmap_painter_grow_queue_set(set);
+
   set->num_operations = 1;
-  memset(set->bucket_start, 0, sizeof(set->bucket_start));
+  memset(set->bucket_start, 0,
+         sizeof(vmap_painter_queue_index) * num_xbuckets * num_zbuckets);
+}
+
+static void vmap_painter_grow_queue_set(vmap_painter_queue_set* set) {
+  set->capacity = set->capacity? set->capacity * 2 : INITIAL_QUEUE_SIZE;
+  set->operations = xrealloc(set->operations,
+                             sizeof(vmap_paint_operation) * set->capacity);
+  set->index_list = xrealloc(set->index_list,
+                             sizeof(vmap_painter_queue_index) * set->capacity);
 }
 
 static void vmap_painter_swap_sets(void) {
   vmap_painter_queue_set* tmp;
 
-  ump_join();
+  ump_wait(busy_task);
 
   tmp = append_set;
   append_set = busy_set;
@@ -236,19 +380,81 @@ static void vmap_painter_swap_sets(void) {
 }
 
 static void vmap_painter_start_busy(int sync) {
+  unsigned colour;
+
+  busy_task = 0;
+  for (colour = 0; colour < NUM_COLOURS; ++colour)
+    busy_task = ump_submit(vmap_painter_tasks + colour, &busy_task, 1);
+
   if (sync)
-    ump_run_sync(&vmap_painter_task);
-  else
-    ump_run_async(&vmap_painter_task);
+    ump_wait(busy_task);
 }
 
-static void vmap_painter_execute(unsigned ordinal, unsigned divisions) {
-  unsigned bz = ordinal / NUM_BUCKETS, bx = ordinal % NUM_BUCKETS;
+static void vmap_painter_execute(unsigned colour, unsigned ordinal) {
+  unsigned bz = ordinal / (num_xbuckets/2) * 2 + colour / 2;
+  unsigned bx = ordinal % (num_xbuckets/2) * 2 + colour % 2;
+  unsigned bucket = bx + num_xbuckets * bz, count = 0;
   const vmap_painter_queue_set*restrict set = busy_set;
   env_vmap* v = vmap;
   vmap_painter_queue_index index;
+  Uint64 start;
 
-  for (index = set->bucket_start[bz][bx]; index;
-       index = set->index_list[index])
+  if (!set->bucket_start[bucket]) return;
+
+  start = SDL_GetPerformanceCounter();
+  for (index = set->bucket_start[bucket]; index;
+       index = set->index_list[index]) {
     (*set->operations[index].f)(v, set->operations+index);
+    ++count;
+  }
+
+  /* Each bucket belongs to exactly one division, so nothing else touches its
+   * stats concurrently.
+   */
+  bucket_stats[bucket].operations += count;
+  bucket_stats[bucket].ticks += SDL_GetPerformanceCounter() - start;
+}
+
+static void vmap_painter_execute_0(unsigned ordinal, unsigned divisions) {
+  vmap_painter_execute(0, ordinal);
+}
+
+static void vmap_painter_execute_1(unsigned ordinal, unsigned divisions) {
+  vmap_painter_execute(1, ordinal);
+}
+
+static void vmap_painter_execute_2(unsigned ordinal, unsigned divisions) {
+  vmap_painter_execute(2, ordinal);
+}
+
+static void vmap_painter_execute_3(unsigned ordinal, unsigned divisions) {
+  vmap_painter_execute(3, ordinal);
+}
+
+static void vmap_painter_report(void) {
+  unsigned bucket, num_buckets = num_xbuckets * num_zbuckets;
+  unsigned total_ops = 0, max_ops = 0;
+  Uint64 total_ticks = 0, max_ticks = 0, freq = SDL_GetPerformanceFrequency();
+
+  for (bucket = 0; bucket < num_buckets; ++bucket) {
+    total_ops += bucket_stats[bucket].operations;
+    total_ticks += bucket_stats[bucket].ticks;
+    max_ops = umax(max_ops, bucket_stats[bucket].operations);
+    if (bucket_stats[bucket].ticks > max_ticks)
+      max_ticks = bucket_stats[bucket].ticks;
+  }
+
+  printf("Vmap painter: %u ops in %ux%u buckets; "
+         "per bucket mean %u max %u ops, mean %u max %u us\n",
+         total_ops, num_xbuckets, num_zbuckets,
+         total_ops / num_buckets, max_ops,
+         (unsigned)(total_ticks * 1000000 / freq / num_buckets),
+         (unsigned)(max_ticks * 1000000 / freq));
+
+  if (getenv("VMAP_PAINTER_STATS")) {
+    for (bucket = 0; bucket < num_buckets; ++bucket)
+      printf("%6u/%-7u%s", bucket_stats[bucket].operations,
+             (unsigned)(bucket_stats[bucket].ticks * 1000000 / freq),
+             (bucket+1) % num_xbuckets? " " : "\n");
+  }
 }
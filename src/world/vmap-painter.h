@@ -39,7 +39,9 @@
  *
  * Population is realised as a sequence of paint operations. Each operation is
  * bound to a rectangle on the (X,Z) plane; the painting function can safely
- * assume that it has exclusive control of that rectangle during its operation.
+ * assume that it has exclusive control of that rectangle during its operation,
+ * and that no other operation whose rectangle overlaps it (before or after
+ * splitting) runs concurrently.
  * Furthermore, for any sequence of paint operations, the end result is
  * guaranteed to be consistent, though the operations are not necessarily
  * applied in the exact order requested.
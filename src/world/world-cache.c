@@ -0,0 +1,238 @@
+/*-
+ * Copyright (c) 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+
+#include "../bsd.h"
+#include "../alloc.h"
+#include "generate.h"
+#include "snapshot.h"
+#include "world-cache.h"
+
+const char* world_cache_default_directory(void) {
+  static char* directory;
+  const char* base, * suffix;
+
+  if (directory) return directory;
+
+  if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+    suffix = "/mantigraphia/worlds";
+  } else if ((base = getenv("HOME")) && *base) {
+    suffix = "/.cache/mantigraphia/worlds";
+  } else {
+    return NULL;
+  }
+
+  directory = xmalloc(strlen(base) + strlen(suffix) + 1);
+  sprintf(directory, "%s%s", base, suffix);
+  return directory;
+}
+
+unsigned long long world_cache_key(unsigned seed,
+                                   unsigned long long script_hash,
+                                   const void* params, size_t params_len) {
+  unsigned long long fields[4], key;
+
+  fields[0] = WORLD_GENERATOR_VERSION;
+  fields[1] = !!world_generate_legacy;
+  fields[2] = seed;
+  fields[3] = script_hash;
+
+  key = world_snapshot_hash(WORLD_SNAPSHOT_HASH_INIT, fields, sizeof(fields));
+  return world_snapshot_hash(key, params, params_len);
+}
+
+/* Returns the name of the snapshot file for the given key, which the caller
+ * must free.
+ */
+static char* world_cache_filename(const char* directory,
+                                  unsigned long long key) {
+  char* filename = xmalloc(strlen(directory) + sizeof("/world-.snap") + 16);
+
+  sprintf(filename, "%s/world-%016llx.snap", directory, key);
+  return filename;
+}
+
+/* Creates the given directory and any missing parents. Returns whether the
+ * directory now exists.
+ */
+static int make_directories(const char* directory) {
+  char* path = xmalloc(strlen(directory) + 1);
+  char* slash;
+  int ok = 1;
+
+  strcpy(path, directory);
+  for (slash = strchr(path + 1, '/'); ok; slash = strchr(slash + 1, '/')) {
+    if (slash) *slash = 0;
+    if (mkdir(path, 0777) && EEXIST != errno) {
+      warn("Unable to create %s", path);
+      ok = 0;
+    }
+    if (!slash) break;
+    *slash = '/';
+  }
+
+  free(path);
+  return ok;
+}
+
+int world_cache_load(terrain_tilemap** tilemap, env_vmap** vmap,
+                     flower_map** flowers,
+                     const char* directory, unsigned long long key) {
+  char* filename = world_cache_filename(directory, key);
+  int hit;
+
+  hit = world_snapshot_load(tilemap, vmap, flowers, filename, key);
+  if (hit) {
+    printf("Loaded cached world from %s\n", filename);
+    /* Bump the modification time so that eviction sees this entry as
+     * recently used. */
+    if (utimes(filename, NULL))
+      warn("Unable to touch %s", filename);
+  }
+
+  free(filename);
+  return hit;
+}
+
+typedef struct {
+  unsigned long long key;
+  time_t mtime;
+  size_t size;
+} world_cache_entry;
+
+static int compare_world_cache_entries(const void* va, const void* vb) {
+  const world_cache_entry* a = va, * b = vb;
+
+  /* Most recently used first */
+  return (a->mtime < b->mtime) - (a->mtime > b->mtime);
+}
+
+/* Removes the least recently used entries other than the one with the given
+ * key until the total disk usage of the entries in the given directory is at
+ * most max_size.
+ */
+static void world_cache_prune(const char* directory, unsigned long long keep,
+                              size_t max_size) {
+  DIR* dir;
+  struct dirent* ent;
+  struct stat st;
+  world_cache_entry* entries = NULL;
+  unsigned num_entries = 0, cap_entries = 0, i;
+  unsigned long long key;
+  size_t total = 0, len;
+  char* filename, * end;
+  int evicting = 0;
+
+  dir = opendir(directory);
+  if (!dir) {
+    warn("Unable to list %s", directory);
+    return;
+  }
+
+  while ((ent = readdir(dir))) {
+    len = strlen(ent->d_name);
+    if (len != sizeof("world-.snap") - 1 + 16 ||
+        strncmp(ent->d_name, "world-", 6) ||
+        strcmp(ent->d_name + len - 5, ".snap"))
+      continue;
+
+    key = strtoull(ent->d_name + 6, &end, 16);
+    if (end != ent->d_name + len - 5) continue;
+
+    filename = world_cache_filename(directory, key);
+    if (!stat(filename, &st) && S_ISREG(st.st_mode)) {
+      if (num_entries == cap_entries) {
+        cap_entries = cap_entries? cap_entries * 2 : 16;
+        entries = xrealloc(entries, sizeof(world_cache_entry) * cap_entries);
+      }
+
+      entries[num_entries].key = key;
+      entries[num_entries].mtime = st.st_mtime;
+      /* Snapshots are sparse, so count allocated blocks rather than the
+       * apparent size. */
+      entries[num_entries].size = (size_t)st.st_blocks * 512;
+      ++num_entries;
+    }
+    free(filename);
+  }
+  closedir(dir);
+
+  qsort(entries, num_entries, sizeof(world_cache_entry),
+        compare_world_cache_entries);
+
+  for (i = 0; i < num_entries; ++i)
+    if (keep == entries[i].key)
+      total += entries[i].size;
+
+  for (i = 0; i < num_entries; ++i) {
+    if (keep == entries[i].key) continue;
+
+    /* Once anything has been evicted, so is everything older, even if it
+     * would still fit. */
+    if (!evicting && total + entries[i].size <= max_size) {
+      total += entries[i].size;
+    } else {
+      evicting = 1;
+      filename = world_cache_filename(directory, entries[i].key);
+      if (remove(filename))
+        warn("Unable to evict %s", filename);
+      else
+        printf("Evicted cached world %s\n", filename);
+      free(filename);
+    }
+  }
+
+  free(entries);
+}
+
+void world_cache_store(const char* directory, unsigned long long key,
+                       size_t max_size,
+                       const terrain_tilemap* tilemap, env_vmap* vmap,
+                       const flower_map* flowers) {
+  char* filename;
+
+  if (!make_directories(directory)) return;
+
+  filename = world_cache_filename(directory, key);
+  if (world_snapshot_save(filename, key, tilemap, vmap, flowers))
+    printf("Cached world in %s\n", filename);
+  free(filename);
+
+  world_cache_prune(directory, key, max_size);
+}
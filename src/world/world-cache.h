@@ -0,0 +1,100 @@
+/*-
+ * Copyright (c) 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef WORLD_WORLD_CACHE_H_
+#define WORLD_WORLD_CACHE_H_
+
+#include <stddef.h>
+
+#include "terrain-tilemap.h"
+#include "env-vmap.h"
+#include "flower-map.h"
+
+/**
+ * @file
+ *
+ * A content-addressed on-disk cache of generated worlds.
+ *
+ * Each world is stored as a snapshot (see snapshot.h) in the cache directory,
+ * named after a key derived from everything the generated world depends on.
+ * A world found under the current key can therefore be used in place of
+ * generating it, and a change to any input simply results in a different key
+ * rather than needing explicit invalidation. Stale entries are evicted in
+ * least-recently-used order whenever the cache would otherwise exceed its
+ * size limit.
+ */
+
+/**
+ * The default limit on the total size of the world cache, in bytes.
+ */
+#define WORLD_CACHE_DEFAULT_MAX_SIZE ((size_t)1024*1024*1024)
+
+/**
+ * Returns the default cache directory, which is "mantigraphia/worlds" under
+ * $XDG_CACHE_HOME, or under $HOME/.cache if that is unset. Returns NULL if
+ * neither variable is set. The returned string is valid for the life of the
+ * process.
+ */
+const char* world_cache_default_directory(void);
+
+/**
+ * Computes the cache key for a world generated from the given seed and
+ * scripts (as identified by lluas_get_chunk_hash()), by the current version
+ * of the C generators (including whether the legacy generator is selected).
+ * Any further parameters which affect generation, such as the world
+ * dimensions, are passed as the given opaque bytes.
+ *
+ * Keys are only meaningful on the host which computed them.
+ */
+unsigned long long world_cache_key(unsigned seed,
+                                   unsigned long long script_hash,
+                                   const void* params, size_t params_len);
+
+/**
+ * Loads the world with the given key from the cache in the given directory.
+ * On a hit, the new world is stored into the output pointers as with
+ * world_snapshot_load(), and 1 is returned. On a miss, 0 is returned and the
+ * output pointers are unmodified. A hit marks the entry as recently used.
+ */
+int world_cache_load(terrain_tilemap**, env_vmap**, flower_map**,
+                     const char* directory, unsigned long long key);
+
+/**
+ * Stores the given world under the given key in the cache in the given
+ * directory, creating the directory if needed. Failure to do so is not fatal;
+ * a diagnostic is printed and the world simply remains uncached.
+ *
+ * Afterwards, the least recently used other entries are removed until the
+ * disk space used by the cache is no more than max_size bytes. The new entry
+ * itself is always kept.
+ */
+void world_cache_store(const char* directory, unsigned long long key,
+                       size_t max_size,
+                       const terrain_tilemap*, env_vmap*,
+                       const flower_map*);
+
+#endif /* WORLD_WORLD_CACHE_H_ */
@@ -251,7 +251,8 @@ static void wod_distribute_in_ump(unsigned ordinal, unsigned total) {
 static ump_task wod_distribute_ump_task = {
   wod_distribute_in_ump,
   /* set dynamically */ 0,
-  /* sync */ 0
+  /* sync */ 0,
+  /* work stealing; density varies wildly between rows */ 1
 };
 
 static unsigned long long wod_distribute_parallel(
@@ -26,6 +26,8 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+
 #include "test.h"
 #include "defs.h"
 #include "math/coords.h"
@@ -43,8 +45,78 @@ defsuite(evaluator);
   evaluator_builder_init(&builder, c, lenof(c))
 
 
-#define EXECUTE()                                               \
-  evaluator_execute(val, c, evaluator_builder_n(&builder))
+/* Every test doubles as a conformance test for compiled programs: the
+ * function is also run through evaluator_compile() both as written (so
+ * constants fold away) and with every constant turned into an input (so
+ * each opcode actually executes), one-at-a-time and batched, and all must
+ * agree exactly with the interpreter.
+ */
+#define EXECUTE() do {                                          \
+    evaluator_value _pre[lenof(val)];                           \
+    memcpy(_pre, val, sizeof(val));                             \
+    evaluator_execute(val, c, evaluator_builder_n(&builder));   \
+    check_compiled(c, _pre, val, evaluator_builder_n(&builder)); \
+  } while (0)
+
+#define BATCH 3
+
+static void check_program(const evaluator_program* program,
+                          const evaluator_value* pre,
+                          const evaluator_value* expected,
+                          const unsigned* outputs, unsigned num_outputs) {
+  unsigned n = program->num_cells, i, k;
+  evaluator_value single[n], batch[n*BATCH];
+
+  memcpy(single, pre, sizeof(single));
+  for (i = 0; i < n; ++i)
+    for (k = 0; k < BATCH; ++k)
+      batch[i*BATCH + k] = pre[i];
+
+  evaluator_program_execute(program, single);
+  evaluator_program_execute_batch(program, batch, BATCH);
+
+  for (i = 0; i < num_outputs; ++i) {
+    ck_assert_int_eq(expected[outputs[i]], single[outputs[i]]);
+    for (k = 0; k < BATCH; ++k)
+      ck_assert_int_eq(expected[outputs[i]], batch[outputs[i]*BATCH + k]);
+  }
+}
+
+static void check_compiled(const evaluator_cell* cells,
+                           const evaluator_value* pre,
+                           const evaluator_value* expected,
+                           unsigned n) {
+  evaluator_cell unfolded[n], nop;
+  evaluator_value unfolded_pre[n];
+  evaluator_builder builder;
+  evaluator_program* program;
+  unsigned outputs[n], i;
+
+  for (i = 0; i < n; ++i)
+    outputs[i] = i;
+
+  program = evaluator_compile(cells, n, NULL, 0);
+  check_program(program, pre, expected, outputs, n);
+  evaluator_program_delete(program);
+
+  evaluator_builder_init(&builder, &nop, 1);
+  evaluator_nop(&builder);
+  memcpy(unfolded, cells, sizeof(unfolded));
+  memcpy(unfolded_pre, pre, sizeof(unfolded_pre));
+  for (i = 0; i < n; ++i) {
+    if (ecf_direct == cells[i].format) {
+      unfolded[i] = nop;
+      unfolded[i].value.indirect[0] = i;
+      unfolded[i].value.indirect[1] = i;
+      unfolded[i].value.indirect[2] = i;
+      unfolded_pre[i] = expected[i];
+    }
+  }
+
+  program = evaluator_compile(unfolded, n, outputs, n);
+  check_program(program, unfolded_pre, expected, outputs, n);
+  evaluator_program_delete(program);
+}
 
 deftest(single_const) {
   DATA(1);
@@ -348,3 +420,184 @@ deftest(basic_fraction_umul) {
 deftest(basic_evaluator_zoscale) {
   BINTEST(-2, 4, zoscale, -ZO_SCALING_FACTOR_MAX/2);
 }
+
+deftest(compile_folds_constants) {
+  evaluator_program* program;
+  unsigned out;
+  DATA(5);
+
+  out = evaluator_mul(&builder,
+                      evaluator_add(&builder,
+                                    evaluator_const(&builder, 2),
+                                    evaluator_const(&builder, 3)),
+                      evaluator_const(&builder, 4));
+  program = evaluator_compile(c, evaluator_builder_n(&builder), &out, 1);
+  ck_assert_int_eq(1, program->num_insns);
+  evaluator_program_execute(program, val);
+  ck_assert_int_eq(20, val[out]);
+  evaluator_program_delete(program);
+}
+
+deftest(compile_eliminates_dead_cells) {
+  evaluator_program* program;
+  unsigned x, y, z;
+  DATA(5);
+
+  x = evaluator_nop(&builder);
+  y = evaluator_add(&builder, x, evaluator_const(&builder, 1));
+  z = evaluator_mul(&builder, x, evaluator_const(&builder, 2));
+  program = evaluator_compile(c, evaluator_builder_n(&builder), &y, 1);
+  /* The constant 1 and the add; the nop input costs nothing. */
+  ck_assert_int_eq(2, program->num_insns);
+  val[x] = 41;
+  val[z] = -1;
+  evaluator_program_execute(program, val);
+  ck_assert_int_eq(42, val[y]);
+  ck_assert_int_eq(-1, val[z]);
+  evaluator_program_delete(program);
+}
+
+deftest(compile_reads_forward_references_as_inputs) {
+  evaluator_program* program;
+  unsigned outputs[2];
+  DATA(3);
+
+  /* Cell 0 reads cell 1 before cell 1 is computed, so it sees whatever the
+   * caller stored there.
+   */
+  outputs[0] = evaluator_neg(&builder, 1);
+  outputs[1] = evaluator_const(&builder, 5);
+  program = evaluator_compile(c, evaluator_builder_n(&builder), outputs, 2);
+  val[1] = 3;
+  evaluator_program_execute(program, val);
+  ck_assert_int_eq(-3, val[0]);
+  ck_assert_int_eq(5, val[1]);
+  evaluator_program_delete(program);
+}
+
+deftest(batch_matches_interpreter_per_input_set) {
+  evaluator_program* program;
+  evaluator_value batch[8*32];
+  unsigned x, y, out, k;
+  DATA(8);
+
+  x = evaluator_nop(&builder);
+  y = evaluator_nop(&builder);
+  out = evaluator_clamp(&builder,
+                        evaluator_const(&builder, 0),
+                        evaluator_const(&builder, 100),
+                        evaluator_sub(&builder,
+                                      evaluator_mul(&builder, x, y),
+                                      evaluator_const(&builder, 7)));
+  program = evaluator_compile(c, evaluator_builder_n(&builder), &out, 1);
+
+  for (k = 0; k < 32; ++k) {
+    batch[x*32 + k] = k;
+    batch[y*32 + k] = 31 - (evaluator_value)k;
+  }
+  evaluator_program_execute_batch(program, batch, 32);
+
+  for (k = 0; k < 32; ++k) {
+    val[x] = k;
+    val[y] = 31 - (evaluator_value)k;
+    evaluator_execute(val, c, evaluator_builder_n(&builder));
+    ck_assert_int_eq(val[out], batch[out*32 + k]);
+  }
+
+  evaluator_program_delete(program);
+}
+
+static unsigned long long random_state;
+
+static unsigned long long random_next(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+static evaluator_value random_value(void) {
+  static const evaluator_value interesting[] = {
+    0, 1, -1, 2, -2, 65536, -65536, 0x7FFFFFFFLL, -0x80000000LL,
+    0x7FFFFFFFFFFFFFFFLL, MOST_NEGATIVE,
+  };
+  unsigned long long r = random_next();
+
+  switch (r & 3) {
+  case 0: return interesting[(r >> 2) % lenof(interesting)];
+  case 1: return (evaluator_value)(r >> 2) % 1000 - 500;
+  default: return (evaluator_value)random_next();
+  }
+}
+
+deftest(random_programs_match_interpreter) {
+  static unsigned (*const unary[])(evaluator_builder*, unsigned) = {
+    evaluator_neg, evaluator_abs, evaluator_to_angle, evaluator_cos,
+    evaluator_sin, evaluator_sqrt, evaluator_lognot, evaluator_fraction_of,
+  };
+  static unsigned (*const binary[])(evaluator_builder*, unsigned, unsigned) = {
+    evaluator_add, evaluator_sub, evaluator_mul, evaluator_div,
+    evaluator_mod, evaluator_logand, evaluator_logor, evaluator_equ,
+    evaluator_neq, evaluator_lt, evaluator_le, evaluator_gt, evaluator_ge,
+    evaluator_clamp_min, evaluator_clamp_max, evaluator_fraction_smul,
+    evaluator_fraction_umul, evaluator_zoscale,
+  };
+  static unsigned (*const ternary[])(evaluator_builder*, unsigned, unsigned,
+                                     unsigned) = {
+    evaluator_magnitude, evaluator_if, evaluator_clamp, evaluator_chaos,
+  };
+  unsigned program_ix, i, n, num_outputs, outputs[64];
+  evaluator_program* program;
+  evaluator_value pre[64];
+  unsigned long long r;
+  DATA(64);
+
+  random_state = 0x9E3779B97F4A7C15ULL;
+  for (program_ix = 0; program_ix < 256; ++program_ix) {
+    evaluator_builder_init(&builder, c, lenof(c));
+    /* A handful of inputs, then a random mix of constants and operations
+     * over any earlier cell.
+     */
+    for (i = 0; i < 4; ++i)
+      evaluator_nop(&builder);
+    while (!evaluator_builder_is_full(&builder)) {
+      r = random_next();
+      n = evaluator_builder_n(&builder);
+      switch (r % 8) {
+      case 0:
+        evaluator_const(&builder, random_value());
+        break;
+
+      case 1:
+      case 2:
+        (*unary[(r >> 3) % lenof(unary)])(&builder, (r >> 16) % n);
+        break;
+
+      case 3:
+      case 4:
+      case 5:
+        (*binary[(r >> 3) % lenof(binary)])(
+          &builder, (r >> 16) % n, (r >> 32) % n);
+        break;
+
+      default:
+        (*ternary[(r >> 3) % lenof(ternary)])(
+          &builder, (r >> 16) % n, (r >> 32) % n, (r >> 48) % n);
+        break;
+      }
+    }
+
+    for (i = 0; i < lenof(val); ++i)
+      val[i] = pre[i] = random_value();
+    evaluator_execute(val, c, lenof(c));
+    check_compiled(c, pre, val, lenof(c));
+
+    num_outputs = 0;
+    for (i = 0; i < lenof(c); ++i)
+      if (!(random_next() % 8))
+        outputs[num_outputs++] = i;
+    program = evaluator_compile(c, lenof(c), outputs, num_outputs);
+    check_program(program, pre, val, outputs, num_outputs);
+    evaluator_program_delete(program);
+  }
+}
@@ -0,0 +1,217 @@
+/*-
+ * Copyright (c) 2014, 2015 Jason Lingle
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Benchmarks world_add_shadow() against a straightforward implementation of
+ * the same shade formula, on a 4096x4096 vmap populated with random columns,
+ * and checks that both produce exactly the same tilemap. world_add_shadow()
+ * is run both without and with occupancy tracking, since the latter lets it
+ * skip empty supercells.
+ *
+ * Usage: shadow-bench [num-workers]
+ *
+ * This is not run by `make check`; build it with `make world/shadow-bench`.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bsd.h"
+#include "micromp.h"
+#include "trace.h"
+#include "math/rand.h"
+#include "world/terrain-tilemap.h"
+#include "world/env-vmap.h"
+#include "world/generate.h"
+
+#define SIZE 4096
+#define SHADOW_RADIUS 3
+#define SUBREGION_SIZE 128
+
+static terrain_tilemap* reference_world;
+static const env_vmap* reference_vmap;
+
+/* The per-voxel, per-tap implementation world_add_shadow() used to have */
+static void reference_subregion(coord x0, coord z0, coord xs, coord zs) {
+  terrain_tilemap* world = reference_world;
+  const env_vmap* vmap = reference_vmap;
+  coord xmask = world->xmax - 1, zmask = world->zmax - 1;
+  unsigned char weight[zs+2*SHADOW_RADIUS][xs+2*SHADOW_RADIUS];
+  coord_offset xo, zo, xso, zso;
+  coord x, y, z;
+  unsigned shade;
+
+  memset(weight, 0, sizeof(weight));
+
+  for (zo = -SHADOW_RADIUS; zo < (signed)zs + SHADOW_RADIUS; ++zo) {
+    z = (z0 + zo) & zmask;
+    for (xo = -SHADOW_RADIUS; xo < (signed)xs + SHADOW_RADIUS; ++xo) {
+      x = (x0 + xo) & xmask;
+      for (y = 0; y < ENV_VMAP_H; ++y)
+        if (vmap->voxels[env_vmap_offset(vmap, x, y, z)])
+          ++weight[zo+SHADOW_RADIUS][xo+SHADOW_RADIUS];
+    }
+  }
+
+  for (zo = 0; zo < (signed)zs; ++zo) {
+    for (xo = 0; xo < (signed)xs; ++xo) {
+      shade = 0;
+
+      for (zso = -SHADOW_RADIUS; zso < SHADOW_RADIUS; ++zso)
+        for (xso = -SHADOW_RADIUS; xso < SHADOW_RADIUS; ++xso)
+          shade += 65536 * weight[zo+zso+SHADOW_RADIUS][xo+xso+SHADOW_RADIUS] /
+            (1 + abs(zso) + abs(xso));
+
+      shade /= 65536;
+      if (shade > 3) shade = 3;
+      world->type[terrain_tilemap_offset(
+          world, (x0 + xo) & xmask, (z0 + zo) & zmask)] |= shade;
+    }
+  }
+}
+
+static void reference_row(unsigned row, unsigned ignored) {
+  unsigned col;
+
+  for (col = 0; col < reference_world->xmax / SUBREGION_SIZE; ++col)
+    reference_subregion(col * SUBREGION_SIZE, row * SUBREGION_SIZE,
+                        SUBREGION_SIZE, SUBREGION_SIZE);
+}
+
+static ump_task reference_task = {
+  reference_row,
+  SIZE / SUBREGION_SIZE,
+  0, /* sync */
+};
+
+/* Scatters trees (tall, solid trunks with a wider crown) and low shrubs over
+ * the vmap, so that the shadow pass sees a realistic mix of empty, sparse and
+ * saturated windows.
+ */
+static void populate(env_vmap* vmap) {
+  unsigned rnd = 42, i, n, x, y, z, h, dx, dz;
+
+  n = SIZE * SIZE / 64;
+  for (i = 0; i < n; ++i) {
+    x = lcgrand(&rnd) % SIZE;
+    z = lcgrand(&rnd) % SIZE;
+    if (lcgrand(&rnd) & 3) {
+      /* Shrub */
+      h = 1 + lcgrand(&rnd) % 3;
+      for (y = 0; y < h; ++y)
+        vmap->voxels[env_vmap_offset(vmap, x, y, z)] = 1;
+    } else {
+      /* Tree */
+      h = 8 + lcgrand(&rnd) % (ENV_VMAP_H - 8);
+      for (y = 0; y < h; ++y)
+        vmap->voxels[env_vmap_offset(vmap, x, y, z)] = 2;
+      for (dz = 0; dz < 5; ++dz)
+        for (dx = 0; dx < 5; ++dx)
+          for (y = h*2/3; y < h; ++y)
+            vmap->voxels[env_vmap_offset(
+                vmap, (x+dx-2) & (SIZE-1), y, (z+dz-2) & (SIZE-1))] = 3;
+    }
+  }
+}
+
+static double seconds_since(const struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) +
+    (now.tv_nsec - start->tv_nsec) / 1.0e9;
+}
+
+/* Runs world_add_shadow() on a fresh copy of the tilemap, reports its time
+ * relative to the reference, and returns the number of tiles which differ
+ * from expected.
+ */
+static unsigned run_world_add_shadow(const char* name,
+                                     const terrain_tilemap* expected,
+                                     terrain_tilemap* actual,
+                                     env_vmap* vmap, double reference_time) {
+  struct timespec start;
+  double time;
+  unsigned i, mismatches;
+
+  memset(actual->type, 0, SIZE * SIZE);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  world_add_shadow(actual, vmap);
+  time = seconds_since(&start);
+
+  mismatches = 0;
+  for (i = 0; i < SIZE * SIZE; ++i)
+    mismatches += expected->type[i] != actual->type[i];
+
+  printf("world_add_shadow (%s): %.3f s (%.1fx), %u mismatched tiles\n",
+         name, time, reference_time / time, mismatches);
+  return mismatches;
+}
+
+int main(int argc, char** argv) {
+  terrain_tilemap* expected, * actual;
+  env_vmap* vmap;
+  struct timespec start;
+  double reference_time;
+  unsigned mismatches;
+
+  trace_init();
+  ump_init(argc > 1? atoi(argv[1]) : 0);
+
+  expected = terrain_tilemap_new(SIZE, SIZE, SIZE, SIZE);
+  actual = terrain_tilemap_new(SIZE, SIZE, SIZE, SIZE);
+  memset(expected->type, 0, SIZE * SIZE);
+  vmap = env_vmap_new(SIZE, SIZE, 1);
+  populate(vmap);
+
+  reference_world = expected;
+  reference_vmap = vmap;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ump_run_sync(&reference_task);
+  reference_time = seconds_since(&start);
+  printf("reference: %.3f s\n", reference_time);
+
+  mismatches = run_world_add_shadow("untracked", expected, actual,
+                                    vmap, reference_time);
+  /* Generated worlds always track occupancy, so this is the case that
+   * matters; it initialises the indices from what populate() wrote.
+   */
+  env_vmap_track_occupancy(vmap);
+  mismatches += run_world_add_shadow("occupancy", expected, actual,
+                                     vmap, reference_time);
+
+  env_vmap_delete(vmap);
+  terrain_tilemap_delete(actual);
+  terrain_tilemap_delete(expected);
+  return mismatches? 1 : 0;
+}